@@ -0,0 +1,364 @@
+#include "cache.h"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace psd
+{
+    // native byte order; the cache is local to one machine
+    struct CacheEntryHeader
+    {
+        uint32_t magic; // "PSDC"
+        uint32_t version;
+        uint32_t w;
+        uint32_t h;
+        uint32_t channels;
+        uint32_t reserved;
+        uint64_t key; // Key::digest(), guards against name collisions
+        uint64_t payload_size;
+        uint8_t padding[24]; // pixels start 64 byte aligned
+    };
+    static_assert(sizeof(CacheEntryHeader) == 64, "cache entry header must be 64 bytes");
+
+    static const uint32_t cache_magic = 0x43445350; // "PSDC"
+    static const uint32_t cache_version = 1;
+
+    bool DiskCache::Key::from_file(const std::string& path, const std::string& operation, Key& key, bool hash_contents)
+    {
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0)
+            return false;
+        uint64_t id[5] = {
+            (uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size,
+            (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec,
+        };
+        key.file_id = hash64(id, sizeof(id));
+        key.operation = operation;
+        if (!hash_contents)
+        {
+            key.content_hash = hash64(id+2, sizeof(uint64_t)*3);
+            return true;
+        }
+        std::ifstream f(path, std::ios::binary);
+        if (!f)
+            return false;
+        Hasher hasher;
+        std::vector<char> buffer(1 << 20);
+        while(f)
+        {
+            f.read(buffer.data(), buffer.size());
+            hasher.update(buffer.data(), f.gcount());
+        }
+        key.content_hash = hasher.digest();
+        return true;
+    }
+
+    uint64_t DiskCache::Key::digest() const
+    {
+        Hasher hasher;
+        hasher.update(&file_id, sizeof(file_id));
+        hasher.update(&content_hash, sizeof(content_hash));
+        hasher.update(operation.data(), operation.size());
+        return hasher.digest();
+    }
+
+    DiskCache::Mapped::Mapped()
+        : w(0), h(0), pixels(nullptr), base_(nullptr), size_(0)
+    {
+    }
+
+    DiskCache::Mapped::~Mapped()
+    {
+        reset();
+    }
+
+    void DiskCache::Mapped::reset()
+    {
+        if (base_)
+            munmap(base_, size_);
+        base_ = nullptr;
+        size_ = 0;
+        pixels = nullptr;
+        w = h = 0;
+    }
+
+    // Exclusive lock on dir/.lock, whose first eight bytes (native order)
+    // hold the bytes of all entries. Each lock opens the file anew, so
+    // threads of one process exclude each other like processes do.
+    class DiskCache::Lock
+    {
+    public:
+        explicit Lock(const std::string& dir)
+            : fd_(::open((dir + "/.lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644))
+        {
+            if (fd_ >= 0 && flock(fd_, LOCK_EX) != 0)
+            {
+                ::close(fd_);
+                fd_ = -1;
+            }
+        }
+        ~Lock()
+        {
+            if (fd_ >= 0)
+                ::close(fd_); // releases the lock
+        }
+        Lock(const Lock&) = delete;
+        Lock& operator = (const Lock&) = delete;
+
+        bool locked() const { return fd_ >= 0; }
+        bool read_total(uint64_t& total) const { return pread(fd_, &total, sizeof(total), 0) == (ssize_t)sizeof(total); }
+        void write_total(uint64_t total) const
+        {
+            if (pwrite(fd_, &total, sizeof(total), 0) != (ssize_t)sizeof(total))
+                std::cerr << "DiskCache: cannot update the size in .lock" << std::endl;
+        }
+
+    private:
+        int fd_;
+    };
+
+    DiskCache::DiskCache(const std::string& dir, uint64_t max_bytes)
+        : dir_(dir), max_bytes_(max_bytes)
+    {
+        mkdir(dir_.c_str(), 0755);
+        // recount, in case a process died between renaming an entry and counting it
+        Lock lock(dir_);
+        if (lock.locked())
+            evict(lock);
+    }
+
+    std::string DiskCache::path(const Key& key) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.psdc", (unsigned long long)key.digest());
+        return dir_ + "/" + name;
+    }
+
+    bool DiskCache::open_entry(const Key& key, int& fd, uint32_t& w, uint32_t& h)
+    {
+        fd = ::open(path(key).c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        CacheEntryHeader header;
+        if (::read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ||
+            header.magic != cache_magic || header.version != cache_version ||
+            header.key != key.digest() || header.channels != 4 ||
+            header.payload_size != (uint64_t)header.w*header.h*4)
+        {
+            ::close(fd);
+            return false;
+        }
+        w = header.w;
+        h = header.h;
+        // a hit makes the entry the most recently used
+        futimens(fd, nullptr);
+        return true;
+    }
+
+    bool DiskCache::get(const Key& key, Image& image)
+    {
+        int fd;
+        uint32_t w, h;
+        if (!open_entry(key, fd, w, h))
+            return false;
+        image.resize(w, h);
+        size_t size = image.pixels.size();
+        size_t done = 0;
+        while(done < size)
+        {
+            ssize_t n = ::read(fd, &image.pixels[done], size - done);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        ::close(fd);
+        return done == size;
+    }
+
+    bool DiskCache::map(const Key& key, Mapped& mapped)
+    {
+        mapped.reset();
+        int fd;
+        uint32_t w, h;
+        if (!open_entry(key, fd, w, h))
+            return false;
+        size_t size = sizeof(CacheEntryHeader) + (size_t)w*h*4;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < size)
+        {
+            ::close(fd);
+            return false;
+        }
+        void* base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED)
+            return false;
+        mapped.base_ = base;
+        mapped.size_ = size;
+        mapped.w = w;
+        mapped.h = h;
+        mapped.pixels = (const uint8_t*)base + sizeof(CacheEntryHeader);
+        return true;
+    }
+
+    bool DiskCache::put(const Key& key, const Image& image)
+    {
+        static std::atomic<unsigned> counter(0);
+        std::string final_path = path(key);
+        char suffix[48];
+        snprintf(suffix, sizeof(suffix), ".tmp.%d.%u", (int)getpid(), counter++);
+        std::string tmp_path = final_path + suffix;
+
+        int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0)
+        {
+            std::cerr << "DiskCache: cannot create " << tmp_path << std::endl;
+            return false;
+        }
+        CacheEntryHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = cache_magic;
+        header.version = cache_version;
+        header.w = image.w;
+        header.h = image.h;
+        header.channels = 4;
+        header.key = key.digest();
+        header.payload_size = (uint64_t)image.w*image.h*4;
+
+        bool ok = ::write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header);
+        size_t done = 0;
+        while(ok && done < image.pixels.size())
+        {
+            ssize_t n = ::write(fd, &image.pixels[done], image.pixels.size() - done);
+            if (n <= 0)
+                ok = false;
+            else
+                done += n;
+        }
+        ok = ::close(fd) == 0 && ok;
+        // the entry and the shared total change together
+        Lock lock(dir_);
+        struct stat old;
+        uint64_t replaced = ::stat(final_path.c_str(), &old) == 0 ? old.st_size : 0;
+        // rename is atomic: readers see either the old entry or the complete new one
+        if (!ok || ::rename(tmp_path.c_str(), final_path.c_str()) != 0)
+        {
+            ::unlink(tmp_path.c_str());
+            return false;
+        }
+        uint64_t total;
+        if (!lock.locked())
+            return true;
+        if (!lock.read_total(total))
+            evict(lock);
+        else if ((total = std::max(total, replaced) - replaced + sizeof(header) + header.payload_size) > max_bytes_)
+            evict(lock);
+        else
+            lock.write_total(total);
+        return true;
+    }
+
+    bool DiskCache::remove(const Key& key)
+    {
+        std::string entry = path(key);
+        Lock lock(dir_);
+        struct stat st;
+        if (::stat(entry.c_str(), &st) != 0 || ::unlink(entry.c_str()) != 0)
+            return false;
+        uint64_t total;
+        if (lock.locked() && lock.read_total(total))
+            lock.write_total(total - std::min<uint64_t>(total, st.st_size));
+        return true;
+    }
+
+    struct CacheFile
+    {
+        std::string path;
+        uint64_t size;
+        int64_t mtime_ns;
+        bool temporary;
+    };
+
+    static std::vector<CacheFile> list_cache_files(const std::string& dir)
+    {
+        std::vector<CacheFile> files;
+        DIR* d = opendir(dir.c_str());
+        if (d == nullptr)
+            return files;
+        while(dirent* e = readdir(d))
+        {
+            std::string name = e->d_name;
+            bool entry = name.size() > 5 && name.compare(name.size()-5, 5, ".psdc") == 0;
+            bool temporary = name.find(".psdc.tmp.") != std::string::npos;
+            if (!entry && !temporary)
+                continue;
+            CacheFile f;
+            f.path = dir + "/" + name;
+            struct stat st;
+            if (::stat(f.path.c_str(), &st) != 0)
+                continue;
+            f.size = st.st_size;
+            f.mtime_ns = (int64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+            f.temporary = temporary;
+            files.push_back(f);
+        }
+        closedir(d);
+        return files;
+    }
+
+    uint64_t DiskCache::size()
+    {
+        uint64_t total = 0;
+        for(auto& f:list_cache_files(dir_))
+            total += f.size;
+        return total;
+    }
+
+    void DiskCache::evict()
+    {
+        Lock lock(dir_);
+        if (lock.locked())
+            evict(lock);
+    }
+
+    void DiskCache::evict(Lock& lock)
+    {
+        auto files = list_cache_files(dir_);
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t now_ns = (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+        uint64_t total = 0;
+        std::vector<CacheFile> entries;
+        for(auto& f:files)
+        {
+            // leftovers of writers that died more than an hour ago
+            if (f.temporary)
+            {
+                if (now_ns - f.mtime_ns > 3600LL*1000000000)
+                    ::unlink(f.path.c_str());
+                continue;
+            }
+            total += f.size;
+            entries.push_back(f);
+        }
+        std::sort(entries.begin(), entries.end(),
+            [](const CacheFile& a, const CacheFile& b) { return a.mtime_ns < b.mtime_ns; });
+        // past the limit, evict down to 90% so every put near it does not evict again
+        uint64_t target = total > max_bytes_ ? max_bytes_ / 10 * 9 : total;
+        for(auto& f:entries)
+        {
+            if (total <= target)
+                break;
+            if (::unlink(f.path.c_str()) == 0)
+                total -= f.size;
+        }
+        lock.write_total(total);
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "composite.h"
+
+namespace psd
+{
+    // Persistent cache of decoded or rendered images in a directory. One
+    // file per entry: a fixed header followed by raw RGBA rows, so entries
+    // can be mapped directly. Entries are written to a temporary file and
+    // renamed into place, which keeps concurrent processes safe. The bytes
+    // of all entries are counted in the directory's .lock file, updated
+    // under flock by every process using it; eviction removes the least
+    // recently used files once that total exceeds max_bytes.
+    class DiskCache
+    {
+    public:
+        struct Key
+        {
+            Key()
+                : file_id(0), content_hash(0)
+            {}
+            uint64_t file_id; // device, inode, size and mtime of the source
+            uint64_t content_hash; // e.g. hash64 of the file, or of a layer's channel hashes
+            std::string operation; // "composite", "preview:256", "layer:12", ...
+
+            // file_id from stat(); content_hash from the file bytes when
+            // hash_contents is set, else from size and mtime only
+            static bool from_file(const std::string& path, const std::string& operation, Key& key, bool hash_contents = false);
+            uint64_t digest() const;
+        };
+
+        // read only mapping of one entry
+        class Mapped
+        {
+        public:
+            Mapped();
+            ~Mapped();
+            Mapped(const Mapped&) = delete;
+            Mapped& operator = (const Mapped&) = delete;
+
+            bool valid() const { return pixels != nullptr; }
+            void reset();
+
+            uint32_t w;
+            uint32_t h;
+            const uint8_t* pixels; // w*h RGBA
+
+        private:
+            friend class DiskCache;
+            void* base_;
+            size_t size_;
+        };
+
+        DiskCache(const std::string& dir, uint64_t max_bytes);
+
+        bool get(const Key& key, Image& image);
+        bool map(const Key& key, Mapped& mapped);
+        bool put(const Key& key, const Image& image);
+        bool remove(const Key& key);
+
+        uint64_t size(); // bytes on disk; scans the directory
+        void evict();
+
+    private:
+        class Lock;
+
+        std::string path(const Key& key) const;
+        bool open_entry(const Key& key, int& fd, uint32_t& w, uint32_t& h);
+        void evict(Lock& lock);
+
+        std::string dir_;
+        uint64_t max_bytes_;
+    };
+}
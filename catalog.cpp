@@ -0,0 +1,558 @@
+#include "catalog.h"
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace psd
+{
+    // native byte order; the catalog is local to one machine. Entries follow
+    // the header sorted by path, each path stored as the length shared with
+    // the previous one plus the remainder; integers are LEB128 varints.
+    static const uint32_t catalog_magic = 0x49445350; // "PSDI"
+    static const uint32_t catalog_version = 1;
+
+    static void put_varint(std::string& out, uint64_t v)
+    {
+        while(v >= 0x80)
+        {
+            out += (char)(v | 0x80);
+            v >>= 7;
+        }
+        out += (char)v;
+    }
+
+    static void put_signed(std::string& out, int64_t v)
+    {
+        put_varint(out, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+    }
+
+    static void put_string(std::string& out, const std::string& s)
+    {
+        put_varint(out, s.size());
+        out += s;
+    }
+
+    static void put_keys(std::string& out, const std::vector<uint32_t>& keys)
+    {
+        put_varint(out, keys.size());
+        out.append((const char*)keys.data(), keys.size()*4);
+    }
+
+    // bounds checked; any read past the end leaves ok false
+    struct CatalogReader
+    {
+        CatalogReader(const std::string& data)
+            : p((const uint8_t*)data.data()), end(p + data.size()), ok(true)
+        {}
+
+        uint64_t varint()
+        {
+            uint64_t v = 0;
+            for(int shift = 0; shift < 64; shift += 7)
+            {
+                if (p == end)
+                    break;
+                uint8_t b = *p++;
+                v |= (uint64_t)(b & 0x7f) << shift;
+                if (!(b & 0x80))
+                    return v;
+            }
+            ok = false;
+            return 0;
+        }
+
+        int64_t signed_varint()
+        {
+            uint64_t v = varint();
+            return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+        }
+
+        bool bytes(void* dst, uint64_t size)
+        {
+            if (!ok || size > (uint64_t)(end - p))
+                return ok = false;
+            std::memcpy(dst, p, size);
+            p += size;
+            return true;
+        }
+
+        bool string(std::string& s)
+        {
+            uint64_t size = varint();
+            if (!ok || size > (uint64_t)(end - p))
+                return ok = false;
+            s.assign((const char*)p, size);
+            p += size;
+            return true;
+        }
+
+        bool keys(std::vector<uint32_t>& keys)
+        {
+            uint64_t count = varint();
+            if (!ok || count > (uint64_t)(end - p)/4)
+                return ok = false;
+            keys.resize(count);
+            return bytes(keys.data(), count*4);
+        }
+
+        const uint8_t* p;
+        const uint8_t* end;
+        bool ok;
+    };
+
+    bool Catalog::Entry::has_key(uint32_t key) const
+    {
+        if (std::binary_search(keys.begin(), keys.end(), key))
+            return true;
+        for(auto& l:layers)
+            if (std::binary_search(l.keys.begin(), l.keys.end(), key))
+                return true;
+        return false;
+    }
+
+    uint32_t Catalog::key(const char* s)
+    {
+        uint32_t k = 0;
+        std::memcpy(&k, s, std::min<size_t>(strlen(s), 4));
+        return k;
+    }
+
+    bool Catalog::load(const std::string& index_path)
+    {
+        std::ifstream f(index_path, std::ios::binary);
+        if (!f)
+            return false;
+        std::string data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        CatalogReader r(data);
+        uint32_t header[2];
+        if (!r.bytes(header, sizeof(header)) || header[0] != catalog_magic || header[1] != catalog_version)
+            return false;
+        uint64_t count = r.varint();
+        std::vector<Entry> entries;
+        std::string previous;
+        for(uint64_t i = 0; i < count && r.ok; i ++)
+        {
+            Entry e;
+            uint64_t shared = r.varint();
+            std::string suffix;
+            if (!r.string(suffix) || shared > previous.size())
+                return false;
+            e.path = previous.substr(0, shared) + suffix;
+            e.dev = r.varint();
+            e.ino = r.varint();
+            e.size = r.varint();
+            e.mtime_ns = r.signed_varint();
+            e.ok = r.varint() != 0;
+            e.version = r.varint();
+            e.channels = r.varint();
+            e.width = r.varint();
+            e.height = r.varint();
+            e.depth = r.varint();
+            e.color_mode = r.varint();
+            r.keys(e.keys);
+            uint64_t layers = r.varint();
+            if (layers > (uint64_t)(r.end - r.p))
+                return false;
+            e.layers.resize(layers);
+            for(auto& l:e.layers)
+            {
+                r.string(l.name);
+                l.bounds.top = r.signed_varint();
+                l.bounds.left = r.signed_varint();
+                l.bounds.bottom = r.signed_varint();
+                l.bounds.right = r.signed_varint();
+                r.bytes(&l.blend_key, 4);
+                l.opacity = r.varint();
+                l.flags = r.varint();
+                l.section_type = r.varint();
+                r.keys(l.keys);
+            }
+            previous = e.path;
+            entries.push_back(std::move(e));
+        }
+        if (!r.ok)
+            return false;
+        entries_.swap(entries);
+        build_index();
+        return true;
+    }
+
+    bool Catalog::save(const std::string& index_path) const
+    {
+        std::string out;
+        uint32_t header[2] = {catalog_magic, catalog_version};
+        out.append((const char*)header, sizeof(header));
+        put_varint(out, entries_.size());
+        const std::string* previous = nullptr;
+        for(auto& e:entries_)
+        {
+            size_t shared = 0;
+            if (previous)
+                while(shared < previous->size() && shared < e.path.size() && (*previous)[shared] == e.path[shared])
+                    shared ++;
+            put_varint(out, shared);
+            put_string(out, e.path.substr(shared));
+            put_varint(out, e.dev);
+            put_varint(out, e.ino);
+            put_varint(out, e.size);
+            put_signed(out, e.mtime_ns);
+            put_varint(out, e.ok);
+            put_varint(out, e.version);
+            put_varint(out, e.channels);
+            put_varint(out, e.width);
+            put_varint(out, e.height);
+            put_varint(out, e.depth);
+            put_varint(out, e.color_mode);
+            put_keys(out, e.keys);
+            put_varint(out, e.layers.size());
+            for(auto& l:e.layers)
+            {
+                put_string(out, l.name);
+                put_signed(out, l.bounds.top);
+                put_signed(out, l.bounds.left);
+                put_signed(out, l.bounds.bottom);
+                put_signed(out, l.bounds.right);
+                out.append((const char*)&l.blend_key, 4);
+                put_varint(out, l.opacity);
+                put_varint(out, l.flags);
+                put_varint(out, l.section_type);
+                put_keys(out, l.keys);
+            }
+            previous = &e.path;
+        }
+
+        std::string tmp = index_path + ".tmp." + std::to_string(::getpid());
+        {
+            std::ofstream f(tmp, std::ios::binary);
+            if (!f.write(out.data(), out.size()) || !f.flush())
+            {
+                ::unlink(tmp.c_str());
+                return false;
+            }
+        }
+        if (::rename(tmp.c_str(), index_path.c_str()) != 0)
+        {
+            ::unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    static bool catalog_extension(const char* name)
+    {
+        size_t n = strlen(name);
+        if (n < 4 || name[n-4] != '.')
+            return false;
+        return strcasecmp(name + n - 3, "psd") == 0;
+    }
+
+    // the tree is walked by all threads at once, sharing a stack of
+    // directories; the walk ends when the stack is empty and nobody is
+    // still reading a directory that could add to it
+    class CatalogWalker
+    {
+    public:
+        CatalogWalker(const std::string& root)
+            : dirs_(1, root), busy_(0)
+        {}
+
+        void run(std::vector<Catalog::Entry>& found)
+        {
+            std::string dir;
+            while(next(dir))
+            {
+                std::vector<std::string> subdirs;
+                if (DIR* d = ::opendir(dir.empty() ? "/" : dir.c_str()))
+                {
+                    while(dirent* de = ::readdir(d))
+                    {
+                        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                            continue;
+                        std::string path = dir + "/" + de->d_name;
+                        if (de->d_type == DT_DIR)
+                        {
+                            subdirs.push_back(path);
+                            continue;
+                        }
+                        // some file systems do not fill in d_type
+                        bool unknown = de->d_type == DT_UNKNOWN;
+                        if ((de->d_type != DT_REG && !unknown) || (!unknown && !catalog_extension(de->d_name)))
+                            continue;
+                        struct stat st;
+                        if (::lstat(path.c_str(), &st) != 0)
+                            continue;
+                        if (S_ISDIR(st.st_mode))
+                        {
+                            subdirs.push_back(path);
+                            continue;
+                        }
+                        if (!S_ISREG(st.st_mode) || !catalog_extension(de->d_name))
+                            continue;
+                        Catalog::Entry e;
+                        e.path = path;
+                        e.dev = st.st_dev;
+                        e.ino = st.st_ino;
+                        e.size = st.st_size;
+                        e.mtime_ns = (int64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+                        found.push_back(std::move(e));
+                    }
+                    ::closedir(d);
+                }
+                done(subdirs);
+            }
+        }
+
+    private:
+        bool next(std::string& dir)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return !dirs_.empty() || !busy_; });
+            if (dirs_.empty())
+                return false;
+            dir = std::move(dirs_.back());
+            dirs_.pop_back();
+            busy_ ++;
+            return true;
+        }
+
+        void done(std::vector<std::string>& subdirs)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for(auto& s:subdirs)
+                dirs_.push_back(std::move(s));
+            busy_ --;
+            cv_.notify_all();
+        }
+
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::vector<std::string> dirs_;
+        int busy_;
+    };
+
+    static void catalog_parse(Catalog::Entry& e)
+    {
+        e.ok = false;
+        e.keys.clear();
+        e.layers.clear();
+        std::ifstream f(e.path, std::ios::binary);
+        psd doc;
+        psd::LoadOptions options;
+        options.layer_images = false;
+        options.merged_image = false;
+        if (!f || !doc.load(f, options))
+            return;
+        e.ok = true;
+        e.version = doc.header.version;
+        e.channels = doc.header.num_channels;
+        e.width = doc.header.width;
+        e.height = doc.header.height;
+        e.depth = doc.header.bit_depth;
+        e.color_mode = doc.header.color_mode;
+        for(auto& block:doc.additional_layer_blocks())
+            e.keys.push_back(block.first.sig);
+        std::sort(e.keys.begin(), e.keys.end());
+        e.keys.erase(std::unique(e.keys.begin(), e.keys.end()), e.keys.end());
+        for(auto& l:doc.layers())
+        {
+            Catalog::Layer cl;
+            cl.name = l.utf8name;
+            cl.bounds = l.bounds();
+            uint32_t blend = l.blend_key;
+            char blend_key[4] = {(char)(blend >> 24), (char)(blend >> 16), (char)(blend >> 8), (char)blend};
+            std::memcpy(&cl.blend_key, blend_key, 4);
+            cl.opacity = l.opacity;
+            cl.flags = l.bit_flags;
+            cl.section_type = l.section_type;
+            for(auto& ed:l.additional_extra_data)
+                cl.keys.push_back(ed.key.sig);
+            std::sort(cl.keys.begin(), cl.keys.end());
+            cl.keys.erase(std::unique(cl.keys.begin(), cl.keys.end()), cl.keys.end());
+            e.layers.push_back(std::move(cl));
+        }
+    }
+
+    Catalog::ScanStats Catalog::scan(const std::string& root, unsigned threads)
+    {
+        ScanStats stats;
+        if (!threads)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        char resolved[PATH_MAX];
+        std::string base = ::realpath(root.c_str(), resolved) ? resolved : root;
+        while(base.size() > 1 && base.back() == '/')
+            base.pop_back();
+        std::string prefix = base == "/" ? base : base + "/";
+
+        std::vector<std::vector<Entry>> found(threads);
+        {
+            CatalogWalker walker(base == "/" ? std::string() : base);
+            std::vector<std::thread> workers;
+            for(unsigned t = 0; t < threads; t ++)
+                workers.emplace_back([&walker, &found, t] { walker.run(found[t]); });
+            for(auto& w:workers)
+                w.join();
+        }
+        std::vector<Entry> scanned;
+        for(auto& f:found)
+            for(auto& e:f)
+                scanned.push_back(std::move(e));
+        std::sort(scanned.begin(), scanned.end(), [](const Entry& a, const Entry& b) { return a.path < b.path; });
+        stats.files = scanned.size();
+
+        // carry over what is unchanged; entries_ and scanned are both sorted
+        std::vector<Entry> merged;
+        std::vector<bool> reused(scanned.size(), false);
+        size_t j = 0;
+        for(auto& old:entries_)
+        {
+            if (old.path.compare(0, prefix.size(), prefix) != 0)
+            {
+                merged.push_back(std::move(old));
+                continue;
+            }
+            while(j < scanned.size() && scanned[j].path < old.path)
+                j ++;
+            if (j == scanned.size() || scanned[j].path != old.path)
+            {
+                stats.removed ++;
+                continue;
+            }
+            Entry& e = scanned[j];
+            if (e.dev == old.dev && e.ino == old.ino && e.size == old.size && e.mtime_ns == old.mtime_ns)
+            {
+                e = std::move(old);
+                reused[j] = true;
+                stats.reused ++;
+            }
+        }
+
+        std::vector<size_t> pending;
+        for(size_t i = 0; i < scanned.size(); i ++)
+            if (!reused[i])
+                pending.push_back(i);
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> workers;
+        for(unsigned t = 0; t < std::min<size_t>(threads, pending.size()); t ++)
+        {
+            workers.emplace_back([&]
+            {
+                for(size_t i = next++; i < pending.size(); i = next++)
+                    catalog_parse(scanned[pending[i]]);
+            });
+        }
+        for(auto& w:workers)
+            w.join();
+        stats.parsed = pending.size();
+        for(size_t i:pending)
+            stats.failed += !scanned[i].ok;
+
+        for(auto& e:scanned)
+            merged.push_back(std::move(e));
+        std::sort(merged.begin(), merged.end(), [](const Entry& a, const Entry& b) { return a.path < b.path; });
+        entries_.swap(merged);
+        build_index();
+        return stats;
+    }
+
+    static std::string lower_ascii(std::string s)
+    {
+        for(auto& c:s)
+            if (c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+        return s;
+    }
+
+    static uint32_t trigram(const char* p)
+    {
+        return (uint32_t)(uint8_t)p[0] << 16 | (uint32_t)(uint8_t)p[1] << 8 | (uint8_t)p[2];
+    }
+
+    void Catalog::build_index()
+    {
+        names_.clear();
+        name_entries_.clear();
+        trigrams_.clear();
+        std::unordered_map<std::string, uint32_t> ids;
+        for(uint32_t i = 0; i < entries_.size(); i ++)
+        {
+            for(auto& l:entries_[i].layers)
+            {
+                auto it = ids.emplace(lower_ascii(l.name), (uint32_t)names_.size());
+                if (it.second)
+                {
+                    names_.push_back(it.first->first);
+                    name_entries_.emplace_back();
+                }
+                auto& users = name_entries_[it.first->second];
+                if (users.empty() || users.back() != i)
+                    users.push_back(i);
+            }
+        }
+        for(uint32_t n = 0; n < names_.size(); n ++)
+        {
+            const std::string& s = names_[n];
+            for(size_t k = 0; k + 3 <= s.size(); k ++)
+            {
+                auto& names = trigrams_[trigram(&s[k])];
+                if (names.empty() || names.back() != n)
+                    names.push_back(n);
+            }
+        }
+    }
+
+    std::vector<const Catalog::Entry*> Catalog::find(const Query& query) const
+    {
+        // entries with a matching layer name; the names checked are those
+        // holding the query's rarest three byte sequence, or all of them
+        // for shorter queries
+        std::string name = lower_ascii(query.layer_name);
+        std::vector<bool> named;
+        if (!name.empty())
+        {
+            named.assign(entries_.size(), false);
+            const std::vector<uint32_t>* candidates = nullptr;
+            for(size_t k = 0; k + 3 <= name.size(); k ++)
+            {
+                auto it = trigrams_.find(trigram(&name[k]));
+                if (it == trigrams_.end())
+                    return std::vector<const Entry*>();
+                if (!candidates || it->second.size() < candidates->size())
+                    candidates = &it->second;
+            }
+            size_t count = candidates ? candidates->size() : names_.size();
+            for(size_t c = 0; c < count; c ++)
+            {
+                uint32_t n = candidates ? (*candidates)[c] : c;
+                if (names_[n].find(name) != std::string::npos)
+                    for(uint32_t i:name_entries_[n])
+                        named[i] = true;
+            }
+        }
+
+        std::vector<const Entry*> result;
+        for(size_t i = 0; i < entries_.size(); i ++)
+        {
+            const Entry& e = entries_[i];
+            if ((!named.empty() && !named[i]) || !e.ok || e.width < query.min_width || e.width > query.max_width ||
+                e.height < query.min_height || e.height > query.max_height ||
+                (query.color_mode >= 0 && e.color_mode != query.color_mode) ||
+                (query.depth >= 0 && e.depth != query.depth))
+                continue;
+            bool match = true;
+            for(uint32_t k:query.keys)
+                match = match && e.has_key(k);
+            if (match)
+                result.push_back(&e);
+        }
+        return result;
+    }
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "psd.h"
+
+namespace psd
+{
+    // Searchable catalog of the .psd files under a directory tree (the
+    // library does not read .psb). Only headers and layer records are read;
+    // files whose device, inode, size and mtime are unchanged since the
+    // last scan are not opened again. The catalog is stored as one compact
+    // binary file local to the machine.
+    class Catalog
+    {
+    public:
+        struct Layer
+        {
+            Layer()
+                : blend_key(0), opacity(255), flags(0), section_type(0)
+            {}
+            std::string name; // utf8
+            Rect bounds;
+            uint32_t blend_key;
+            uint8_t opacity;
+            uint8_t flags;
+            uint16_t section_type;
+            std::vector<uint32_t> keys; // tagged block keys, sorted
+        };
+
+        struct Entry
+        {
+            Entry()
+                : dev(0), ino(0), size(0), mtime_ns(0), ok(false), version(0), channels(0),
+                  width(0), height(0), depth(0), color_mode(0)
+            {}
+            std::string path;
+            uint64_t dev;
+            uint64_t ino;
+            uint64_t size;
+            int64_t mtime_ns;
+            bool ok; // false when the file could not be parsed
+            uint16_t version;
+            uint16_t channels;
+            uint32_t width;
+            uint32_t height;
+            uint16_t depth;
+            uint16_t color_mode;
+            std::vector<uint32_t> keys; // document level tagged block keys, sorted
+            std::vector<Layer> layers;
+
+            // key on the document or on any layer
+            bool has_key(uint32_t key) const;
+        };
+
+        // every set field must match
+        struct Query
+        {
+            Query()
+                : min_width(0), max_width(UINT32_MAX), min_height(0), max_height(UINT32_MAX),
+                  color_mode(-1), depth(-1)
+            {}
+            std::string layer_name; // case insensitive substring of any layer name
+            uint32_t min_width;
+            uint32_t max_width;
+            uint32_t min_height;
+            uint32_t max_height;
+            int color_mode;
+            int depth;
+            std::vector<uint32_t> keys; // all must be present
+        };
+
+        struct ScanStats
+        {
+            ScanStats()
+                : files(0), parsed(0), reused(0), failed(0), removed(0)
+            {}
+            uint64_t files;
+            uint64_t parsed;
+            uint64_t reused;
+            uint64_t failed;
+            uint64_t removed;
+        };
+
+        bool load(const std::string& index_path);
+        // written to a temporary file and renamed into place
+        bool save(const std::string& index_path) const;
+
+        // brings the catalog in line with the tree below root; entries outside
+        // root are left alone
+        ScanStats scan(const std::string& root, unsigned threads = 0);
+
+        std::vector<const Entry*> find(const Query& query) const;
+        const std::vector<Entry>& entries() const { return entries_; }
+
+        // "lsct" -> key
+        static uint32_t key(const char* s);
+
+    private:
+        void build_index();
+
+        std::vector<Entry> entries_; // sorted by path
+        // lowercased distinct layer names, the entries using each, and the
+        // names containing each three byte sequence, for substring queries
+        std::vector<std::string> names_;
+        std::vector<std::vector<uint32_t>> name_entries_;
+        std::unordered_map<uint32_t, std::vector<uint32_t>> trigrams_;
+    };
+}
@@ -0,0 +1,1740 @@
+#include "composite.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace psd
+{
+    static inline uint32_t tag(const char* s)
+    {
+        return *(const uint32_t*)s;
+    }
+
+    static inline uint8_t clamp8(float v)
+    {
+        if (v <= 0) return 0;
+        if (v >= 255) return 255;
+        return (uint8_t)(v + 0.5f);
+    }
+
+    void Image::resize(uint32_t w, uint32_t h)
+    {
+        this->w = w;
+        this->h = h;
+        pixels.assign((size_t)w*h*4, 0);
+    }
+
+    void ChannelLUT::identity()
+    {
+        for(int c = 0; c < 3; c ++)
+            for(int i = 0; i < 256; i ++)
+                lut[c][i] = i;
+    }
+
+    void ChannelLUT::then(const ChannelLUT& next)
+    {
+        for(int c = 0; c < 3; c ++)
+            for(int i = 0; i < 256; i ++)
+                lut[c][i] = next.lut[c][lut[c][i]];
+    }
+
+    void ChannelLUT::apply(uint8_t* rgba, size_t count) const
+    {
+        const uint8_t* r = lut[0];
+        const uint8_t* g = lut[1];
+        const uint8_t* b = lut[2];
+        size_t i = 0;
+        for(; i + 4 <= count; i += 4, rgba += 16)
+        {
+            rgba[0] = r[rgba[0]]; rgba[1] = g[rgba[1]]; rgba[2] = b[rgba[2]];
+            rgba[4] = r[rgba[4]]; rgba[5] = g[rgba[5]]; rgba[6] = b[rgba[6]];
+            rgba[8] = r[rgba[8]]; rgba[9] = g[rgba[9]]; rgba[10] = b[rgba[10]];
+            rgba[12] = r[rgba[12]]; rgba[13] = g[rgba[13]]; rgba[14] = b[rgba[14]];
+        }
+        for(; i < count; i ++, rgba += 4)
+        {
+            rgba[0] = r[rgba[0]]; rgba[1] = g[rgba[1]]; rgba[2] = b[rgba[2]];
+        }
+    }
+
+    // levels record: input floor, input ceiling, output floor, output ceiling, gamma*100
+    static void levels_lut(const char* rec, uint8_t* lut)
+    {
+        float in_lo = (uint16_t)*(be<uint16_t>*)(rec+0);
+        float in_hi = (uint16_t)*(be<uint16_t>*)(rec+2);
+        float out_lo = (uint16_t)*(be<uint16_t>*)(rec+4);
+        float out_hi = (uint16_t)*(be<uint16_t>*)(rec+6);
+        float gamma = (uint16_t)*(be<uint16_t>*)(rec+8) / 100.0f;
+        if (in_hi <= in_lo)
+            in_hi = in_lo + 1;
+        if (gamma <= 0)
+            gamma = 1;
+        for(int i = 0; i < 256; i ++)
+        {
+            float x = (i - in_lo) / (in_hi - in_lo);
+            x = std::min(1.0f, std::max(0.0f, x));
+            x = std::pow(x, 1.0f/gamma);
+            lut[i] = clamp8(out_lo + x*(out_hi - out_lo));
+        }
+    }
+
+    // natural cubic spline through (input, output) points
+    static void curve_lut(std::vector<std::pair<int, int>> points, uint8_t* lut)
+    {
+        std::sort(points.begin(), points.end());
+        points.erase(std::unique(points.begin(), points.end(),
+            [](const std::pair<int, int>& a, const std::pair<int, int>& b) { return a.first == b.first; }), points.end());
+        size_t n = points.size();
+        if (n < 2)
+        {
+            for(int i = 0; i < 256; i ++)
+                lut[i] = i;
+            return;
+        }
+        std::vector<float> y2(n, 0), u(n, 0);
+        for(size_t i = 1; i + 1 < n; i ++)
+        {
+            float x0 = points[i-1].first, x1 = points[i].first, x2 = points[i+1].first;
+            float v0 = points[i-1].second, v1 = points[i].second, v2 = points[i+1].second;
+            float sig = (x1 - x0) / (x2 - x0);
+            float p = sig*y2[i-1] + 2;
+            y2[i] = (sig - 1) / p;
+            u[i] = (v2 - v1)/(x2 - x1) - (v1 - v0)/(x1 - x0);
+            u[i] = (6*u[i]/(x2 - x0) - sig*u[i-1]) / p;
+        }
+        for(size_t k = n-1; k-- > 0;)
+            y2[k] = y2[k]*y2[k+1] + u[k];
+
+        size_t k = 0;
+        for(int i = 0; i < 256; i ++)
+        {
+            if (i <= points.front().first)
+            {
+                lut[i] = clamp8(points.front().second);
+                continue;
+            }
+            if (i >= points.back().first)
+            {
+                lut[i] = clamp8(points.back().second);
+                continue;
+            }
+            while(points[k+1].first < i)
+                k ++;
+            float h = points[k+1].first - points[k].first;
+            float a = (points[k+1].first - i) / h;
+            float b = (i - points[k].first) / h;
+            float y = a*points[k].second + b*points[k+1].second +
+                ((a*a*a - a)*y2[k] + (b*b*b - b)*y2[k+1])*h*h/6;
+            lut[i] = clamp8(y);
+        }
+    }
+
+    // channel 0 is the composite curve, 1.. the color channels; each color
+    // channel goes through its own table and then the composite one
+    static void combine_channel_tables(uint8_t tables[4][256], ChannelLUT& lut)
+    {
+        for(int c = 0; c < 3; c ++)
+            for(int i = 0; i < 256; i ++)
+                lut.lut[c][i] = tables[0][tables[c+1][i]];
+    }
+
+    static bool read_levels(ExtraData& ed, ChannelLUT& lut)
+    {
+        if (ed.data.size() < 2 + 10*4)
+            return false;
+        uint8_t tables[4][256];
+        for(int i = 0; i < 4; i ++)
+            levels_lut(&ed.data[2 + i*10], tables[i]);
+        combine_channel_tables(tables, lut);
+        return true;
+    }
+
+    static bool read_curve(const char*& p, const char* end, bool is_map, uint8_t* lut)
+    {
+        if (is_map)
+        {
+            if (end - p < 256)
+                return false;
+            std::copy(p, p + 256, lut);
+            p += 256;
+            return true;
+        }
+        if (end - p < 2)
+            return false;
+        uint16_t count = *(be<uint16_t>*)p;
+        p += 2;
+        if (end - p < count*4)
+            return false;
+        std::vector<std::pair<int, int>> points;
+        for(uint16_t i = 0; i < count; i ++, p += 4)
+            points.emplace_back((uint16_t)*(be<uint16_t>*)(p+2), (uint16_t)*(be<uint16_t>*)p);
+        curve_lut(points, lut);
+        return true;
+    }
+
+    static bool read_curves(ExtraData& ed, ChannelLUT& lut)
+    {
+        if (ed.data.size() < 7)
+            return false;
+        const char* p = &ed.data[0];
+        const char* end = p + ed.data.size();
+        bool is_map = p[0] != 0;
+        uint16_t version = *(be<uint16_t>*)(p+1);
+        uint32_t bits = *(be<uint32_t>*)(p+3);
+        p += 7;
+
+        uint8_t tables[4][256];
+        for(int c = 0; c < 4; c ++)
+            for(int i = 0; i < 256; i ++)
+                tables[c][i] = i;
+        uint8_t scratch[256];
+
+        uint32_t count = version == 1 ? 32 : bits;
+        for(uint32_t i = 0; i < count; i ++)
+        {
+            if (version == 1 && (bits & (1u << i)) == 0)
+                continue;
+            if (!read_curve(p, end, is_map, i < 4 ? tables[i] : scratch))
+                return false;
+        }
+
+        // 'Crv ' extension carries explicit channel IDs and replaces the above
+        if (end - p >= 4+2+4 && tag(p) == tag("Crv "))
+        {
+            p += 4+2;
+            count = *(be<uint32_t>*)p;
+            p += 4;
+            for(uint32_t i = 0; i < count && end - p >= 2; i ++)
+            {
+                uint16_t channel = *(be<uint16_t>*)p;
+                p += 2;
+                if (!read_curve(p, end, is_map, channel < 4 ? tables[channel] : scratch))
+                    return false;
+            }
+        }
+        combine_channel_tables(tables, lut);
+        return true;
+    }
+
+    static bool read_brightness_contrast(Layer& layer, ChannelLUT& lut)
+    {
+        ExtraData* ed = layer.get_extra_data(Signature("brit"));
+        if (ed == nullptr || ed->data.size() < 6)
+            return false;
+        float brightness = (int16_t)*(be<int16_t>*)&ed->data[0];
+        float contrast = (int16_t)*(be<int16_t>*)&ed->data[2];
+        float mean = (int16_t)*(be<int16_t>*)&ed->data[4];
+        if (mean <= 0 || mean >= 255)
+            mean = 127.5f;
+
+        // newer files keep the dialog values in the content generator descriptor
+        Descriptor d = layer.get_descriptor(Signature("CgEd"));
+        if (d.valid())
+        {
+            brightness = d.get("Brgh").as_double(brightness);
+            contrast = d.get("Cntr").as_double(contrast);
+        }
+        for(int i = 0; i < 256; i ++)
+        {
+            float v = (i + brightness - mean) * (100 + contrast) / 100 + mean;
+            lut.lut[0][i] = lut.lut[1][i] = lut.lut[2][i] = clamp8(v);
+        }
+        return true;
+    }
+
+    bool Adjustment::read(Layer& layer)
+    {
+        kind = None;
+        ExtraData* ed;
+        if ((ed = layer.get_extra_data(Signature("levl"))) != nullptr)
+        {
+            if (read_levels(*ed, lut))
+                kind = Levels;
+        }
+        else if ((ed = layer.get_extra_data(Signature("curv"))) != nullptr)
+        {
+            if (read_curves(*ed, lut))
+                kind = Curves;
+        }
+        else if (layer.get_extra_data(Signature("brit")) != nullptr)
+        {
+            if (read_brightness_contrast(layer, lut))
+                kind = BrightnessContrast;
+        }
+        else if ((ed = layer.get_extra_data(Signature("hue2"))) != nullptr)
+        {
+            if (ed->data.size() >= 16)
+            {
+                const char* p = &ed->data[0];
+                colorize = p[2] != 0;
+                colorize_hue = *(be<int16_t>*)(p+4);
+                colorize_saturation = *(be<int16_t>*)(p+6);
+                colorize_lightness = *(be<int16_t>*)(p+8);
+                hue = *(be<int16_t>*)(p+10);
+                saturation = *(be<int16_t>*)(p+12);
+                lightness = *(be<int16_t>*)(p+14);
+                kind = HueSaturation;
+            }
+        }
+        else if ((ed = layer.get_extra_data(Signature("mixr"))) != nullptr)
+        {
+            if (ed->data.size() >= 4 + 3*10)
+            {
+                const char* p = &ed->data[0];
+                monochrome = *(be<uint16_t>*)(p+2) != 0;
+                for(int c = 0; c < 3; c ++)
+                    for(int k = 0; k < 5; k ++)
+                        mixer[c][k] = *(be<int16_t>*)(p + 4 + c*10 + k*2);
+                kind = ChannelMixer;
+            }
+        }
+        return kind != None;
+    }
+
+    static void rgb_to_hsl(float r, float g, float b, float& h, float& s, float& l)
+    {
+        float mx = std::max(r, std::max(g, b));
+        float mn = std::min(r, std::min(g, b));
+        l = (mx + mn) / 2;
+        if (mx == mn)
+        {
+            h = s = 0;
+            return;
+        }
+        float d = mx - mn;
+        s = l > 0.5f ? d / (2 - mx - mn) : d / (mx + mn);
+        if (mx == r)
+            h = (g - b) / d + (g < b ? 6 : 0);
+        else if (mx == g)
+            h = (b - r) / d + 2;
+        else
+            h = (r - g) / d + 4;
+        h /= 6;
+    }
+
+    static float hue_to_rgb(float p, float q, float t)
+    {
+        if (t < 0) t += 1;
+        if (t > 1) t -= 1;
+        if (t < 1.0f/6) return p + (q - p)*6*t;
+        if (t < 1.0f/2) return q;
+        if (t < 2.0f/3) return p + (q - p)*(2.0f/3 - t)*6;
+        return p;
+    }
+
+    static void hsl_to_rgb(float h, float s, float l, float& r, float& g, float& b)
+    {
+        if (s == 0)
+        {
+            r = g = b = l;
+            return;
+        }
+        float q = l < 0.5f ? l*(1 + s) : l + s - l*s;
+        float p = 2*l - q;
+        r = hue_to_rgb(p, q, h + 1.0f/3);
+        g = hue_to_rgb(p, q, h);
+        b = hue_to_rgb(p, q, h - 1.0f/3);
+    }
+
+    static float adjust_lightness(float l, int16_t lightness)
+    {
+        if (lightness > 0)
+            return l + (1 - l)*lightness/100.0f;
+        return l*(1 + lightness/100.0f);
+    }
+
+    void Adjustment::apply(uint8_t* rgba, size_t count) const
+    {
+        if (is_lut())
+        {
+            lut.apply(rgba, count);
+            return;
+        }
+        for(size_t i = 0; i < count; i ++, rgba += 4)
+        {
+            float r = rgba[0]/255.0f, g = rgba[1]/255.0f, b = rgba[2]/255.0f;
+            if (kind == HueSaturation)
+            {
+                float h, s, l;
+                rgb_to_hsl(r, g, b, h, s, l);
+                if (colorize)
+                {
+                    h = colorize_hue/360.0f;
+                    s = colorize_saturation/100.0f;
+                    l = adjust_lightness(l, colorize_lightness);
+                }
+                else
+                {
+                    h += hue/360.0f;
+                    h -= std::floor(h);
+                    s = std::min(1.0f, std::max(0.0f, s*(1 + saturation/100.0f)));
+                    l = adjust_lightness(l, lightness);
+                }
+                hsl_to_rgb(h, s, l, r, g, b);
+                rgba[0] = clamp8(r*255);
+                rgba[1] = clamp8(g*255);
+                rgba[2] = clamp8(b*255);
+            }
+            else if (kind == ChannelMixer)
+            {
+                float out[3];
+                for(int c = 0; c < 3; c ++)
+                {
+                    const int16_t* m = mixer[monochrome ? 0 : c];
+                    out[c] = (m[0]*r + m[1]*g + m[2]*b)/100.0f + m[4]/100.0f;
+                }
+                rgba[0] = clamp8(out[0]*255);
+                rgba[1] = clamp8(out[1]*255);
+                rgba[2] = clamp8(out[2]*255);
+            }
+        }
+    }
+
+    static const uint32_t mul = tag("mul "), scrn = tag("scrn"), over = tag("over"),
+        dark = tag("dark"), lite = tag("lite"), diff = tag("diff"), smud = tag("smud"),
+        lddg = tag("lddg"), lbrn = tag("lbrn"), cdodge = tag("div "), cburn = tag("idiv"),
+        hLit = tag("hLit"), sLit = tag("sLit"), fsub = tag("fsub"), fdiv = tag("fdiv");
+
+    // separable blend modes, b = backdrop, s = source, both 0..1
+    static inline float blend_channel(uint32_t mode, float b, float s)
+    {
+        if (mode == mul) return b*s;
+        if (mode == scrn) return b + s - b*s;
+        if (mode == over) return b <= 0.5f ? 2*b*s : 1 - 2*(1-b)*(1-s);
+        if (mode == dark) return std::min(b, s);
+        if (mode == lite) return std::max(b, s);
+        if (mode == diff) return std::fabs(b - s);
+        if (mode == smud) return b + s - 2*b*s;
+        if (mode == lddg) return std::min(1.0f, b + s);
+        if (mode == lbrn) return std::max(0.0f, b + s - 1);
+        if (mode == cdodge) return b == 0 ? 0 : (s >= 1 ? 1 : std::min(1.0f, b/(1 - s)));
+        if (mode == cburn) return b >= 1 ? 1 : (s <= 0 ? 0 : 1 - std::min(1.0f, (1 - b)/s));
+        if (mode == hLit) return s <= 0.5f ? 2*b*s : 1 - 2*(1-b)*(1-s);
+        if (mode == sLit)
+        {
+            if (s <= 0.5f)
+                return b - (1 - 2*s)*b*(1 - b);
+            float d = b <= 0.25f ? ((16*b - 12)*b + 4)*b : std::sqrt(b);
+            return b + (2*s - 1)*(d - b);
+        }
+        if (mode == fsub) return std::max(0.0f, b - s);
+        if (mode == fdiv) return s <= 0 ? 1 : std::min(1.0f, b/s);
+        return s;
+    }
+
+    // source over the backdrop pixel d, with alpha sa in 0..1
+    static inline void blend_pixel(uint8_t* d, const uint8_t* s, float sa, uint32_t mode, bool normal)
+    {
+        if (sa <= 0)
+            return;
+        float ab = d[3]/255.0f;
+        float ao = sa + ab*(1 - sa);
+        for(int c = 0; c < 3; c ++)
+        {
+            float cs = s[c]/255.0f;
+            float cb = d[c]/255.0f;
+            float cr = normal ? cs : (1 - ab)*cs + ab*blend_channel(mode, cb, cs);
+            d[c] = clamp8((sa*cr + (1 - sa)*ab*cb)/ao*255);
+        }
+        d[3] = clamp8(ao*255);
+    }
+
+    static inline int32_t read_be32(const char* p)
+    {
+        return (int32_t)((uint32_t)(uint8_t)p[0] << 24 | (uint32_t)(uint8_t)p[1] << 16 | (uint32_t)(uint8_t)p[2] << 8 | (uint8_t)p[3]);
+    }
+
+    static inline int16_t read_be16(const char* p)
+    {
+        return (int16_t)((uint8_t)p[0] << 8 | (uint8_t)p[1]);
+    }
+
+    // cubic from a to d, flattened into about one segment per 2 pixels of control polygon
+    static void flatten(std::vector<float>& points, float ax, float ay, float bx, float by, float cx, float cy, float dx, float dy)
+    {
+        float length = std::hypot(bx - ax, by - ay) + std::hypot(cx - bx, cy - by) + std::hypot(dx - cx, dy - cy);
+        int n = std::min(256, std::max(1, (int)std::ceil(length/2)));
+        if (bx == ax && by == ay && cx == dx && cy == dy)
+            n = 1;
+        for(int i = 1; i <= n; i ++)
+        {
+            float t = (float)i/n, u = 1 - t;
+            float w0 = u*u*u, w1 = 3*u*u*t, w2 = 3*u*t*t, w3 = t*t*t;
+            points.push_back(w0*ax + w1*bx + w2*cx + w3*dx);
+            points.push_back(w0*ay + w1*by + w2*cy + w3*dy);
+        }
+    }
+
+    bool VectorMask::read(Layer& layer, uint32_t doc_w, uint32_t doc_h)
+    {
+        *this = VectorMask();
+        ExtraData* ed = layer.get_extra_data(Signature("vmsk"));
+        if (ed == nullptr)
+            ed = layer.get_extra_data(Signature("vsms"));
+        if (ed == nullptr || ed->data.size() < 8)
+            return false;
+        const char* p = ed->data.data();
+        uint32_t flags = read_be32(p + 4);
+        invert = (flags & 1) != 0;
+        disabled = (flags & 4) != 0;
+
+        // 26 byte records: a selector, then a subpath length or a knot of
+        // three points (preceding control, anchor, leaving control), each
+        // y then x in 8.24 fixed point fractions of the document size
+        struct Knot { float x[3], y[3]; };
+        std::vector<Knot> knots;
+        int16_t operation = Combine;
+        size_t expected = 0;
+        auto finish = [&]
+        {
+            if (knots.empty())
+                return;
+            Subpath sub;
+            sub.operation = operation;
+            sub.points.push_back(knots[0].x[1]);
+            sub.points.push_back(knots[0].y[1]);
+            for(size_t i = 0; i < knots.size(); i ++)
+            {
+                const Knot& a = knots[i];
+                const Knot& b = knots[(i + 1) % knots.size()];
+                flatten(sub.points, a.x[1], a.y[1], a.x[2], a.y[2], b.x[0], b.y[0], b.x[1], b.y[1]);
+            }
+            float x0 = sub.points[0], x1 = x0, y0 = sub.points[1], y1 = y0;
+            for(size_t i = 0; i < sub.points.size(); i += 2)
+            {
+                x0 = std::min(x0, sub.points[i]);
+                x1 = std::max(x1, sub.points[i]);
+                y0 = std::min(y0, sub.points[i+1]);
+                y1 = std::max(y1, sub.points[i+1]);
+            }
+            sub.bounds = Rect((int32_t)std::floor(y0), (int32_t)std::floor(x0), (int32_t)std::ceil(y1) + 1, (int32_t)std::ceil(x1) + 1);
+            subpaths.push_back(std::move(sub));
+            knots.clear();
+        };
+        for(size_t offset = 8; offset + 26 <= ed->data.size(); offset += 26)
+        {
+            const char* r = p + offset;
+            int16_t selector = read_be16(r);
+            switch(selector)
+            {
+                case 0: // closed subpath length
+                case 3: // open subpath length, filled as if closed
+                    finish();
+                    expected = (uint16_t)read_be16(r + 2);
+                    operation = read_be16(r + 4);
+                    break;
+                case 1: case 2: case 4: case 5: // knots, linked or not
+                    if (knots.size() < expected)
+                    {
+                        Knot k;
+                        for(int i = 0; i < 3; i ++)
+                        {
+                            k.y[i] = read_be32(r + 2 + i*8) / 16777216.0f * doc_h;
+                            k.x[i] = read_be32(r + 2 + i*8 + 4) / 16777216.0f * doc_w;
+                        }
+                        knots.push_back(k);
+                    }
+                    break;
+                case 8: // initial fill rule
+                    initial_fill = read_be16(r + 2) != 0;
+                    break;
+            }
+        }
+        finish();
+        return true;
+    }
+
+    // Adds the signed area of the edge p0-p1 to acc, a w+2 wide grid of
+    // per pixel deltas whose running sum along a row is the coverage. The
+    // edge must lie within 0 <= x <= w; rows outside 0..h are skipped.
+    static void accumulate_edge(std::vector<float>& acc, uint32_t w, uint32_t h, float x0, float y0, float x1, float y1)
+    {
+        if (y0 == y1)
+            return;
+        float dir = 1;
+        if (y0 > y1)
+        {
+            std::swap(x0, x1);
+            std::swap(y0, y1);
+            dir = -1;
+        }
+        float dxdy = (x1 - x0)/(y1 - y0);
+        float x = x0;
+        int32_t ystart = std::max(0, (int32_t)std::floor(y0));
+        if (y0 < 0)
+            x -= y0*dxdy;
+        int32_t yend = std::min((int32_t)h, (int32_t)std::ceil(y1));
+        size_t stride = w + 2;
+        for(int32_t y = ystart; y < yend; y ++)
+        {
+            float* line = &acc[(size_t)y*stride];
+            float dy = std::min((float)(y + 1), y1) - std::max((float)y, y0);
+            float xnext = x + dxdy*dy;
+            float d = dy*dir;
+            float xa = std::min(x, xnext), xb = std::max(x, xnext);
+            float xa_floor = std::floor(xa);
+            int32_t xai = (int32_t)xa_floor;
+            float xb_ceil = std::ceil(xb);
+            int32_t xbi = (int32_t)xb_ceil;
+            if (xbi <= xai + 1)
+            {
+                // within one pixel: split by the mean x
+                float xm = 0.5f*(x + xnext) - xa_floor;
+                line[xai] += d - d*xm;
+                line[xai + 1] += d*xm;
+            }
+            else
+            {
+                float s = 1/(xb - xa);
+                float xaf = xa - xa_floor;
+                float a0 = 0.5f*s*(1 - xaf)*(1 - xaf);
+                float xbf = xb - xb_ceil + 1;
+                float am = 0.5f*s*xbf*xbf;
+                line[xai] += d*a0;
+                if (xbi == xai + 2)
+                    line[xai + 1] += d*(1 - a0 - am);
+                else
+                {
+                    float a1 = s*(1.5f - xaf);
+                    line[xai + 1] += d*(a1 - a0);
+                    for(int32_t xi = xai + 2; xi < xbi - 1; xi ++)
+                        line[xi] += d*s;
+                    float a2 = a1 + (xbi - xai - 3)*s;
+                    line[xbi - 1] += d*(1 - a2 - am);
+                }
+                line[xbi] += d*am;
+            }
+            x = xnext;
+        }
+    }
+
+    // edge clipped to 0 <= x <= w: parts to the left run down the left
+    // border, where they still cover every pixel right of them; parts to the
+    // right cover nothing and are dropped
+    static void clip_edge(std::vector<float>& acc, uint32_t w, uint32_t h, float x0, float y0, float x1, float y1)
+    {
+        float fw = (float)w;
+        if (x0 > x1)
+        {
+            std::swap(x0, x1);
+            std::swap(y0, y1);
+        }
+        if (x1 <= 0)
+        {
+            accumulate_edge(acc, w, h, 0, y0, 0, y1);
+            return;
+        }
+        if (x0 >= fw)
+            return;
+        if (x0 < 0)
+        {
+            float ym = y0 + (y1 - y0)*(0 - x0)/(x1 - x0);
+            accumulate_edge(acc, w, h, 0, y0, 0, ym);
+            x0 = 0;
+            y0 = ym;
+        }
+        if (x1 > fw)
+        {
+            float ym = y0 + (y1 - y0)*(fw - x0)/(x1 - x0);
+            x1 = fw;
+            y1 = ym;
+        }
+        accumulate_edge(acc, w, h, x0, y0, x1, y1);
+    }
+
+    void VectorMask::rasterize(const Rect& region, uint8_t* out) const
+    {
+        uint32_t w = std::max(0, region.right - region.left), h = std::max(0, region.bottom - region.top);
+        if (!w || !h)
+            return;
+        std::vector<float> coverage((size_t)w*h, initial_fill ? 1.0f : 0.0f);
+        std::vector<float> acc;
+        for(auto& sub:subpaths)
+        {
+            Rect r = sub.bounds.intersected(region);
+            if (sub.operation == Intersect)
+            {
+                // nothing survives outside the subpath
+                for(uint32_t y = 0; y < h; y ++)
+                    for(uint32_t x = 0; x < w; x ++)
+                        if (r.empty() || (int32_t)y + region.top < r.top || (int32_t)y + region.top >= r.bottom ||
+                            (int32_t)x + region.left < r.left || (int32_t)x + region.left >= r.right)
+                            coverage[(size_t)y*w + x] = 0;
+            }
+            if (r.empty())
+                continue;
+
+            // only the rows and columns the subpath touches
+            uint32_t sw = r.right - r.left, sh = r.bottom - r.top;
+            acc.assign((size_t)(sw + 2)*sh, 0.0f);
+            const std::vector<float>& pts = sub.points;
+            size_t n = pts.size()/2;
+            for(size_t i = 0; i < n; i ++)
+            {
+                size_t j = (i + 1) % n;
+                clip_edge(acc, sw, sh, pts[i*2] - r.left, pts[i*2+1] - r.top, pts[j*2] - r.left, pts[j*2+1] - r.top);
+            }
+            for(uint32_t y = 0; y < sh; y ++)
+            {
+                const float* line = &acc[(size_t)y*(sw + 2)];
+                float* dst = &coverage[(size_t)(r.top - region.top + y)*w + (r.left - region.left)];
+                float sum = 0;
+                for(uint32_t x = 0; x < sw; x ++)
+                {
+                    sum += line[x];
+                    float c = std::min(1.0f, std::fabs(sum));
+                    float& v = dst[x];
+                    switch(sub.operation)
+                    {
+                        case Xor: v = v + c - 2*v*c; break;
+                        case Subtract: v = v*(1 - c); break;
+                        case Intersect: v = v*c; break;
+                        default: v = v + c - v*c; break;
+                    }
+                }
+            }
+        }
+        for(size_t i = 0; i < coverage.size(); i ++)
+            out[i] = clamp8((invert ? 1 - coverage[i] : coverage[i])*255);
+    }
+
+    static bool slice_is(Slice s, const char* text)
+    {
+        return s.size == std::strlen(text) && std::memcmp(s.data, text, s.size) == 0;
+    }
+
+    // BlnM enum values of effects to the blend keys of layer records
+    static uint32_t effect_blend_mode(Slice value)
+    {
+        static const char* modes[][2] = {
+            {"Nrml", "norm"}, {"Dslv", "diss"}, {"Mltp", "mul "}, {"Scrn", "scrn"},
+            {"Ovrl", "over"}, {"Drkn", "dark"}, {"Lghn", "lite"}, {"Dfrn", "diff"},
+            {"Xclu", "smud"}, {"linearDodge", "lddg"}, {"linearBurn", "lbrn"},
+            {"CDdg", "div "}, {"CBrn", "idiv"}, {"HrdL", "hLit"}, {"SftL", "sLit"},
+            {"blendSubtraction", "fsub"}, {"blendDivide", "fdiv"},
+        };
+        for(auto& m:modes)
+            if (slice_is(value, m[0]))
+                return tag(m[1]);
+        return tag("norm");
+    }
+
+    // the effect's key, or in newer files the first enabled entry of its list
+    static Descriptor effect_descriptor(const Descriptor& fx, const char* key, const char* multi)
+    {
+        DescriptorValue v = fx.get(key);
+        if (v.valid())
+            return v.as_descriptor();
+        DescriptorValue list = fx.get(multi);
+        for(uint32_t i = 0; i < list.list_size(); i ++)
+        {
+            Descriptor d = list.at(i).as_descriptor();
+            if (d.get("enab").as_bool())
+                return d;
+        }
+        return Descriptor();
+    }
+
+    static bool read_effect(const Descriptor& d, float scale, LayerEffects::Effect& e)
+    {
+        if (!d.valid() || !d.get("enab").as_bool())
+            return false;
+        e.enabled = true;
+        e.mode = effect_blend_mode(d.get("Md  ").enum_value());
+        e.opacity = clamp8(d.get("Opct").as_double(100)*2.55);
+        Descriptor color = d.get("Clr ").as_descriptor();
+        if (slice_is(color.class_id(), "Grsc"))
+        {
+            uint8_t gray = clamp8(255 - color.get("Gry ").as_double()*2.55);
+            e.color[0] = e.color[1] = e.color[2] = gray;
+        }
+        else
+        {
+            e.color[0] = clamp8(color.get("Rd  ").as_double());
+            e.color[1] = clamp8(color.get("Grn ").as_double());
+            e.color[2] = clamp8(color.get("Bl  ").as_double());
+        }
+        e.size = std::max(0.0, d.get("blur").as_double())*scale;
+        e.spread = std::min(1.0, std::max(0.0, d.get("Ckmt").as_double()/100));
+        return true;
+    }
+
+    bool LayerEffects::read(Layer& layer, int32_t global_angle)
+    {
+        *this = LayerEffects();
+        Signature sig("lmfx");
+        ExtraData* ed = layer.get_extra_data(sig);
+        if (ed == nullptr)
+        {
+            sig = Signature("lfx2");
+            ed = layer.get_extra_data(sig);
+        }
+        if (ed == nullptr)
+            return false;
+        Descriptor fx = layer.get_descriptor(sig);
+        if (!fx.valid() || !fx.get("masterFXSwitch").as_bool(true))
+            return false;
+        float scale = fx.get("Scl ").as_double(100)/100;
+
+        Descriptor d = effect_descriptor(fx, "DrSh", "dropShadowMulti");
+        if (read_effect(d, scale, drop_shadow))
+        {
+            double angle = d.get("uglg").as_bool(true) ? global_angle : d.get("lagl").as_double(120);
+            double distance = d.get("Dstn").as_double()*scale;
+            // the light comes from angle, counterclockwise from the right
+            shadow_x = (int32_t)std::lround(-distance*std::cos(angle*M_PI/180));
+            shadow_y = (int32_t)std::lround(distance*std::sin(angle*M_PI/180));
+            knockout = d.get("layerConceals").as_bool(true);
+        }
+        read_effect(fx.get("OrGl").as_descriptor(), scale, outer_glow);
+        read_effect(effect_descriptor(fx, "SoFi", "solidFillMulti"), scale, color_overlay);
+        d = effect_descriptor(fx, "FrFX", "frameFXMulti");
+        if (read_effect(d, scale, stroke))
+        {
+            stroke.size = std::max(0.0, d.get("Sz  ").as_double(3))*scale;
+            Slice position = d.get("Styl").enum_value();
+            stroke_position = slice_is(position, "InsF") ? Inside : slice_is(position, "CtrF") ? Center : Outside;
+        }
+        key = hash64(ed->data.data(), ed->data.size(), (uint64_t)global_angle);
+        return !empty();
+    }
+
+    bool LayerEffects::blends_normally() const
+    {
+        for(const Effect* e:{&drop_shadow, &outer_glow, &color_overlay, &stroke})
+            if (e->enabled && e->mode != tag("norm") && e->mode != tag("diss"))
+                return false;
+        return true;
+    }
+
+    int32_t LayerEffects::reach() const
+    {
+        float r = 0;
+        if (drop_shadow.enabled)
+            r = std::max<float>(r, drop_shadow.size + std::max(std::abs(shadow_x), std::abs(shadow_y)));
+        if (outer_glow.enabled)
+            r = std::max(r, outer_glow.size);
+        if (stroke.enabled && stroke_position != Inside)
+            r = std::max(r, stroke_position == Center ? stroke.size/2 : stroke.size);
+        return (int32_t)std::ceil(r) + 1;
+    }
+
+    // Euclidean distance transform of one line: d[q] = min over p of
+    // (q - p)^2 + f[p], as the lower envelope of parabolas (Felzenszwalb and
+    // Huttenlocher), linear in n
+    static void distance_line(const float* f, float* d, uint32_t n, int32_t* v, float* z)
+    {
+        const float inf = 1e20f;
+        uint32_t k = 0;
+        v[0] = 0;
+        z[0] = -inf;
+        z[1] = inf;
+        for(uint32_t q = 1; q < n; q ++)
+        {
+            float s;
+            for(;;)
+            {
+                int32_t p = v[k];
+                s = ((f[q] + (float)q*q) - (f[p] + (float)p*p)) / (2.0f*q - 2.0f*p);
+                if (s > z[k])
+                    break;
+                k --;
+            }
+            k ++;
+            v[k] = q;
+            z[k] = s;
+            z[k+1] = inf;
+        }
+        k = 0;
+        for(uint32_t q = 0; q < n; q ++)
+        {
+            while(z[k+1] < q)
+                k ++;
+            float t = (float)q - v[k];
+            d[q] = t*t + f[v[k]];
+        }
+    }
+
+    // distance from every pixel to the nearest pixel inside the shape (or
+    // outside it), the shape being where coverage reaches one half
+    static void distance_map(const std::vector<uint8_t>& shape, uint32_t w, uint32_t h, bool to_inside, std::vector<float>& out)
+    {
+        const float inf = 1e20f;
+        uint32_t n = std::max(w, h);
+        std::vector<float> f(n), d(n), z(n + 1);
+        std::vector<int32_t> v(n);
+        out.resize((size_t)w*h);
+        for(size_t i = 0; i < out.size(); i ++)
+            out[i] = (shape[i] >= 128) == to_inside ? 0 : inf;
+        for(uint32_t x = 0; x < w; x ++)
+        {
+            for(uint32_t y = 0; y < h; y ++)
+                f[y] = out[(size_t)y*w + x];
+            distance_line(f.data(), d.data(), h, v.data(), z.data());
+            for(uint32_t y = 0; y < h; y ++)
+                out[(size_t)y*w + x] = d[y];
+        }
+        for(uint32_t y = 0; y < h; y ++)
+        {
+            float* row = &out[(size_t)y*w];
+            std::copy(row, row + w, f.begin());
+            distance_line(f.data(), row, w, v.data(), z.data());
+            for(uint32_t x = 0; x < w; x ++)
+                row[x] = std::sqrt(row[x]);
+        }
+    }
+
+    // coverage of a band width pixels wide from the edge, for a pixel
+    // distance away from the nearest pixel across the edge
+    static inline float band(float width, float distance)
+    {
+        return std::min(1.0f, std::max(0.0f, width + 1 - distance));
+    }
+
+    // sum*(1/divisor) rounded, exact for sums up to 255*divisor
+    struct Divider
+    {
+        explicit Divider(uint32_t divisor)
+            : half(divisor/2), inverse(((1ull << 32) + divisor - 1)/divisor)
+        {}
+        uint8_t operator()(uint32_t sum) const { return (uint8_t)(((uint64_t)(sum + half)*inverse) >> 32); }
+        uint32_t half;
+        uint64_t inverse;
+    };
+
+    // running sum box blur of radius r along rows, zero past the ends
+    static void box_rows(std::vector<uint8_t>& a, uint32_t w, uint32_t h, uint32_t r)
+    {
+        Divider div(2*r + 1);
+        std::vector<uint8_t> line(w);
+        for(uint32_t y = 0; y < h; y ++)
+        {
+            uint8_t* row = &a[(size_t)y*w];
+            std::copy(row, row + w, line.begin());
+            uint32_t sum = 0;
+            for(uint32_t x = 0; x < std::min(r, w); x ++)
+                sum += line[x];
+            for(uint32_t x = 0; x < w; x ++)
+            {
+                if (x + r < w)
+                    sum += line[x + r];
+                row[x] = div(sum);
+                if (x >= r)
+                    sum -= line[x - r];
+            }
+        }
+    }
+
+    // the same down the columns, a whole row at a time so the inner loops
+    // run over contiguous bytes and vectorize
+    static void box_columns(std::vector<uint8_t>& a, uint32_t w, uint32_t h, uint32_t r)
+    {
+        Divider div(2*r + 1);
+        std::vector<uint8_t> src(a);
+        std::vector<uint32_t> sum(w, 0);
+        for(uint32_t y = 0; y < std::min(r, h); y ++)
+        {
+            const uint8_t* s = &src[(size_t)y*w];
+            for(uint32_t x = 0; x < w; x ++)
+                sum[x] += s[x];
+        }
+        for(uint32_t y = 0; y < h; y ++)
+        {
+            if (y + r < h)
+            {
+                const uint8_t* s = &src[(size_t)(y + r)*w];
+                for(uint32_t x = 0; x < w; x ++)
+                    sum[x] += s[x];
+            }
+            uint8_t* d = &a[(size_t)y*w];
+            for(uint32_t x = 0; x < w; x ++)
+                d[x] = div(sum[x]);
+            if (y >= r)
+            {
+                const uint8_t* s = &src[(size_t)(y - r)*w];
+                for(uint32_t x = 0; x < w; x ++)
+                    sum[x] -= s[x];
+            }
+        }
+    }
+
+    // three box passes each way approximate a Gaussian reaching size
+    // pixels; the cost per pixel does not depend on the size
+    static void blur(std::vector<uint8_t>& a, uint32_t w, uint32_t h, float size)
+    {
+        uint32_t n = (uint32_t)std::lround(size);
+        for(uint32_t i = 0; i < 3; i ++)
+            if ((n + i)/3)
+                box_rows(a, w, h, (n + i)/3);
+        for(uint32_t i = 0; i < 3; i ++)
+            if ((n + i)/3)
+                box_columns(a, w, h, (n + i)/3);
+    }
+
+    // layer or group mask (-2) and vector mask, sampled in document
+    // coordinates; the vector mask is rasterized for area only
+    struct MaskSampler
+    {
+        MaskSampler(Layer* layer, const Rect& area, const Header& header)
+            : data(nullptr), default_color(255), area(area)
+        {
+            if (layer == nullptr)
+                return;
+            VectorMask vector_mask;
+            if (vector_mask.read(*layer, header.width, header.height) && !vector_mask.empty() && !area.empty())
+            {
+                vector.resize((size_t)(area.right - area.left)*(area.bottom - area.top));
+                vector_mask.rasterize(area, vector.data());
+            }
+            if (layer->mask.length < 4*4+2 || (layer->mask.flags & 2))
+                return;
+            default_color = layer->mask.default_color;
+            data = layer->get_channel_info_by_id(-2);
+            layer->channel_bounds(-2, top, left, bottom, right);
+        }
+
+        bool active() const { return data != nullptr || default_color != 255 || !vector.empty(); }
+
+        uint8_t at(int32_t x, int32_t y) const
+        {
+            uint8_t m = pixel(x, y);
+            if (vector.empty() || x < area.left || x >= area.right || y < area.top || y >= area.bottom)
+                return m;
+            return m * vector[(size_t)(y - area.top)*(area.right - area.left) + x - area.left] / 255;
+        }
+
+        uint8_t pixel(int32_t x, int32_t y) const
+        {
+            if (data == nullptr || x < left || x >= right || y < top || y >= bottom)
+                return default_color;
+            auto& row = data->data[y - top];
+            if ((size_t)(x - left) >= row.size())
+                return default_color;
+            return (uint8_t)row[x - left];
+        }
+
+        ImageData* data;
+        uint8_t default_color;
+        int32_t top, left, bottom, right;
+        Rect area;
+        std::vector<uint8_t> vector;
+    };
+
+    // blend if ranges as coverage tables over this layer's and the
+    // underlying values, looked up inside the blend loops; layers with the
+    // default full ranges build no tables and skip the lookups
+    struct BlendIf
+    {
+        BlendIf(Layer* layer, bool gray)
+            : count(0)
+        {
+            if (layer == nullptr || layer->blending_ranges.is_default())
+                return;
+            auto& ranges = layer->blending_ranges;
+            // the composite gray range does not apply to grayscale documents
+            for(size_t i = gray ? 1 : 0; i < std::min<size_t>(ranges.count(), 4); i ++)
+            {
+                add(ranges.source(i), i, false);
+                add(ranges.destination(i), i, true);
+            }
+        }
+
+        void add(const Layer::LayerBlendingRanges::Range& r, size_t channel, bool destination)
+        {
+            if (r.full())
+                return;
+            Table& t = tables[count ++];
+            t.channel = (int32_t)channel - 1;
+            t.destination = destination;
+            for(int v = 0; v < 256; v ++)
+            {
+                float c = 1;
+                if (v < r.black_low || v > r.white_high)
+                    c = 0;
+                else if (v < r.black_high)
+                    c = (v - r.black_low)/(float)(r.black_high - r.black_low);
+                else if (v > r.white_low)
+                    c = (r.white_high - v)/(float)(r.white_high - r.white_low);
+                t.lut[v] = clamp8(c*255);
+            }
+        }
+
+        bool active() const { return count > 0; }
+
+        // s is this layer's pixel, d the backdrop's
+        float at(const uint8_t* s, const uint8_t* d) const
+        {
+            float c = 1;
+            for(size_t i = 0; i < count && c > 0; i ++)
+            {
+                const uint8_t* p = tables[i].destination ? d : s;
+                int32_t ch = tables[i].channel;
+                uint8_t v = ch >= 0 ? p[ch] : (uint8_t)((77*p[0] + 151*p[1] + 28*p[2] + 128) >> 8);
+                c *= tables[i].lut[v]/255.0f;
+            }
+            return c;
+        }
+
+        struct Table
+        {
+            int32_t channel; // -1 for the composite gray
+            bool destination;
+            uint8_t lut[256];
+        };
+        Table tables[8];
+        size_t count;
+    };
+
+    // grayscale documents show the luminance of an effect's color
+    static void effect_color(const LayerEffects::Effect& e, bool gray, uint8_t* out)
+    {
+        for(int c = 0; c < 3; c ++)
+            out[c] = e.color[c];
+        if (gray)
+            out[0] = out[1] = out[2] = clamp8(0.299f*e.color[0] + 0.587f*e.color[1] + 0.114f*e.color[2]);
+    }
+
+    static bool channel_ok(ImageData* id, int32_t w, int32_t h)
+    {
+        if (id == nullptr || id->data.size() != (size_t)h)
+            return false;
+        for(auto& row:id->data)
+            if (row.size() < (size_t)w)
+                return false;
+        return true;
+    }
+
+    Compositor::Compositor(psd& doc)
+        : doc_(doc), global_angle_(120), origin_x_(0), origin_y_(0), active_(-1), active_pos_(0), cached_(false), above_cached_(false), tile_size_(0)
+    {
+    }
+
+    void Compositor::set_tile_size(uint32_t tile_size)
+    {
+        if (tile_size != tile_size_)
+            tiled_.clear();
+        tile_size_ = tile_size;
+    }
+
+    const TiledImage* Compositor::tiled_layer(Layer& l, ImageData* const* color, ImageData* alpha)
+    {
+        if (tile_size_ == 0)
+            return nullptr;
+        uint64_t versions[4] = {color[0]->version, color[1]->version, color[2]->version, alpha ? alpha->version : 0};
+        uint64_t key = hash64(versions, sizeof(versions));
+        TiledLayer& tiled = tiled_[&l];
+        if (tiled.key != key)
+        {
+            tiled.key = key;
+            tiled.usable = tiled.tiles.from_layer(l, tile_size_) &&
+                (alpha == nullptr) == (tiled.tiles.channel_index(-1) < 0);
+        }
+        return tiled.usable ? &tiled.tiles : nullptr;
+    }
+
+    Rect Compositor::canvas_rect(const Image& canvas) const
+    {
+        return Rect(origin_y_, origin_x_, origin_y_ + canvas.h, origin_x_ + canvas.w);
+    }
+
+    bool Compositor::prepare()
+    {
+        uint16_t mode = doc_.header.color_mode;
+        if (mode != (uint16_t)ColorMode::RGB && mode != (uint16_t)ColorMode::Grayscale)
+        {
+            std::cerr << "Compositor: unsupported color mode " << mode << std::endl;
+            return false;
+        }
+        if (doc_.header.bit_depth != 8)
+        {
+            std::cerr << "Compositor: unsupported bit depth " << doc_.header.bit_depth << std::endl;
+            return false;
+        }
+        auto& info = doc_.layer_info;
+        if (info.groups.empty())
+            info.build_groups();
+        folder_groups_.assign(info.layers.size(), -1);
+        for(size_t g = 1; g < info.groups.size(); g ++)
+            if (info.groups[g].layer >= 0)
+                folder_groups_[info.groups[g].layer] = g;
+        ImageResourceBlock* angle = doc_.get_image_resource(1037);
+        if (angle != nullptr && angle->buffer.size() >= 4)
+            global_angle_ = read_be32(angle->buffer.data());
+        return true;
+    }
+
+    bool Compositor::render(Image& out)
+    {
+        return render(out, Rect(0, 0, doc_.header.height, doc_.header.width));
+    }
+
+    bool Compositor::render(Image& out, const Rect& region)
+    {
+        if (!prepare())
+            return false;
+        Rect r = region.intersected(Rect(0, 0, doc_.header.height, doc_.header.width));
+        origin_x_ = r.left;
+        origin_y_ = r.top;
+        if (active_ < 0)
+        {
+            out.resize(r.right - r.left, r.bottom - r.top);
+            return render_group(0, out);
+        }
+        if (!cached_ && !build_caches())
+            return false;
+
+        out.w = r.right - r.left;
+        out.h = r.bottom - r.top;
+        out.pixels.resize((size_t)out.w*out.h*4);
+        for(uint32_t y = 0; y < out.h; y ++)
+            std::memcpy(out.row(y), below_.row(r.top + y) + r.left*4, out.w*4);
+        Layer& l = doc_.layer_info.layers[active_];
+        if ((l.bit_flags & LayerTable::Hidden) == 0 && !render_layer(l, out, nullptr))
+            return false;
+        if (!above_cached_)
+            return render_group(0, out, active_pos_ + 1);
+        if (above_.pixels.empty())
+            return true;
+        Image above;
+        const Image* src = &above_;
+        if (out.w != above_.w || out.h != above_.h)
+        {
+            above.w = out.w;
+            above.h = out.h;
+            above.pixels.resize(out.pixels.size());
+            for(uint32_t y = 0; y < out.h; y ++)
+                std::memcpy(above.row(y), above_.row(r.top + y) + r.left*4, out.w*4);
+            src = &above;
+        }
+        blend_image(*src, out, tag("norm"), 255, nullptr, nullptr);
+        return true;
+    }
+
+    bool Compositor::set_active_layer(int32_t layer)
+    {
+        invalidate();
+        active_ = -1;
+        if (!prepare() || layer < 0 || (size_t)layer >= doc_.layer_info.layers.size())
+            return false;
+        auto& info = doc_.layer_info;
+        auto& children = info.groups[0].children;
+        auto it = std::find(children.begin(), children.end(), layer);
+        if (it == children.end())
+            return false;
+        size_t pos = it - children.begin();
+        Layer& l = info.layers[layer];
+        Adjustment adjustment;
+        if (folder_groups_[layer] >= 0 || l.clipping != 0 || adjustment.read(l))
+            return false;
+        if (pos + 1 < children.size() && info.layers[children[pos+1]].clipping != 0)
+            return false;
+        active_ = layer;
+        active_pos_ = pos;
+        return true;
+    }
+
+    void Compositor::invalidate()
+    {
+        cached_ = false;
+        above_cached_ = false;
+        below_ = Image();
+        above_ = Image();
+    }
+
+    bool Compositor::build_caches()
+    {
+        auto& info = doc_.layer_info;
+        auto& children = info.groups[0].children;
+        int32_t x = origin_x_, y = origin_y_;
+        origin_x_ = origin_y_ = 0;
+
+        below_.resize(doc_.header.width, doc_.header.height);
+        if (!render_group(0, below_, 0, active_pos_))
+            return false;
+
+        // source over is associative, so normally blended layers above can
+        // be flattened first, the way an isolated group is
+        above_cached_ = true;
+        bool any = false;
+        for(size_t k = active_pos_ + 1; k < children.size() && above_cached_; k ++)
+        {
+            Layer& l = info.layers[children[k]];
+            if (l.bit_flags & LayerTable::Hidden)
+                continue;
+            any = true;
+            Adjustment adjustment;
+            int32_t g = folder_groups_[children[k]];
+            uint32_t mode = g >= 0 ? info.groups[g].blend_key.sig : l.blend_key.x;
+            LayerEffects effects;
+            if ((g >= 0 && info.groups[g].pass_through) || adjustment.read(l) ||
+                (mode != tag("norm") && mode != tag("diss")) ||
+                (effects.read(l, global_angle_) && !effects.blends_normally()) ||
+                !l.blending_ranges.is_default())
+                above_cached_ = false;
+        }
+        if (above_cached_ && any)
+        {
+            above_.resize(doc_.header.width, doc_.header.height);
+            if (!render_group(0, above_, active_pos_ + 1))
+                return false;
+        }
+        origin_x_ = x;
+        origin_y_ = y;
+        cached_ = true;
+        return true;
+    }
+
+    bool Compositor::render_group(int32_t group, Image& canvas, size_t first, size_t last)
+    {
+        auto& info = doc_.layer_info;
+        auto& children = info.groups[group].children;
+        last = std::min(last, children.size());
+
+        std::vector<uint8_t> clip; // coverage of the current clipping base
+        bool base_visible = true;
+
+        for(size_t k = first; k < last; k ++)
+        {
+            int32_t i = children[k];
+            Layer& l = info.layers[i];
+            bool hidden = (l.bit_flags & LayerTable::Hidden) != 0;
+            bool clipped = l.clipping != 0;
+            if (!clipped)
+                base_visible = !hidden;
+            if (hidden || (clipped && !base_visible))
+                continue;
+            const std::vector<uint8_t>* clip_mask = clipped && !clip.empty() ? &clip : nullptr;
+
+            if (folder_groups_[i] >= 0)
+            {
+                int32_t sub = folder_groups_[i];
+                auto& g = info.groups[sub];
+                Image result;
+                if (g.pass_through)
+                    result = canvas;
+                else
+                    result.resize(canvas.w, canvas.h);
+                if (!render_group(sub, result))
+                    return false;
+                if (g.pass_through)
+                {
+                    // group opacity and mask fade between the backdrop and the result
+                    MaskSampler mask(&l, canvas_rect(canvas), doc_.header);
+                    BlendIf blend_if(&l, doc_.header.color_mode == (uint16_t)ColorMode::Grayscale);
+                    for(uint32_t y = 0; y < canvas.h; y ++)
+                    {
+                        uint8_t* d = canvas.row(y);
+                        const uint8_t* s = result.row(y);
+                        for(uint32_t x = 0; x < canvas.w; x ++, d += 4, s += 4)
+                        {
+                            float t = l.opacity/255.0f * mask.at(x + origin_x_, y + origin_y_)/255.0f;
+                            if (clip_mask)
+                                t *= (*clip_mask)[(size_t)y*canvas.w+x]/255.0f;
+                            if (blend_if.active() && t > 0)
+                                t *= blend_if.at(s, d);
+                            for(int c = 0; c < 4; c ++)
+                                d[c] = clamp8(d[c] + (s[c] - d[c])*t);
+                        }
+                    }
+                    if (!clipped)
+                    {
+                        // clipped layers follow the group's own content,
+                        // rendered apart from the backdrop only when needed
+                        clip.clear();
+                        if (k + 1 < last && info.layers[children[k+1]].clipping != 0)
+                        {
+                            Image content;
+                            content.resize(canvas.w, canvas.h);
+                            if (!render_group(sub, content))
+                                return false;
+                            clip_base(l, &content, false, canvas, clip);
+                        }
+                    }
+                }
+                else
+                {
+                    blend_image(result, canvas, g.blend_key.sig, l.opacity, &l, clip_mask);
+                    if (!clipped)
+                        clip_base(l, &result, false, canvas, clip);
+                }
+                continue;
+            }
+
+            Adjustment adjustment;
+            if (adjustment.read(l))
+            {
+                // collect the run of adjustment layers sharing this clipping state
+                std::vector<int32_t> run(1, i);
+                while(k + 1 < last)
+                {
+                    Layer& next = info.layers[children[k+1]];
+                    if (folder_groups_[children[k+1]] >= 0 || (next.clipping != 0) != clipped)
+                        break;
+                    Adjustment a;
+                    if (!a.read(next))
+                        break;
+                    k ++;
+                    if ((next.bit_flags & LayerTable::Hidden) == 0)
+                        run.push_back(children[k]);
+                }
+                apply_adjustments(run, canvas, clip_mask);
+                if (!clipped)
+                {
+                    // the last of the run is the base of what follows
+                    Layer& base = info.layers[children[k]];
+                    base_visible = (base.bit_flags & LayerTable::Hidden) == 0;
+                    clip_base(base, nullptr, true, canvas, clip);
+                }
+                continue;
+            }
+
+            if (!render_layer(l, canvas, clip_mask))
+                return false;
+            if (!clipped)
+                clip_base(l, nullptr, false, canvas, clip);
+        }
+        return true;
+    }
+
+    void Compositor::clip_base(Layer& l, const Image* content, bool unbounded, const Image& canvas, std::vector<uint8_t>& clip)
+    {
+        clip.assign((size_t)canvas.w*canvas.h, 0);
+        Rect area = canvas_rect(canvas);
+        int32_t t, lf, b, r;
+        l.channel_bounds(0, t, lf, b, r);
+        ImageData* alpha = nullptr;
+        if (content == nullptr)
+        {
+            alpha = l.get_channel_info_by_id(-1);
+            if (alpha != nullptr && !channel_ok(alpha, r - lf, b - t))
+                alpha = nullptr;
+            // an adjustment without pixels covers the whole canvas
+            if (!unbounded || alpha != nullptr)
+                area = area.intersected(Rect(t, lf, b, r));
+        }
+        // clipped layers take on the base's opacity, but not that of an adjustment
+        uint32_t opacity = unbounded ? 255 : l.opacity;
+        MaskSampler mask(&l, area, doc_.header);
+        for(int32_t y = area.top; y < area.bottom; y ++)
+            for(int32_t x = area.left; x < area.right; x ++)
+            {
+                uint8_t a = content ? content->row(y - origin_y_)[(x - origin_x_)*4+3] :
+                    alpha ? (uint8_t)alpha->data[y-t][x-lf] : 255;
+                clip[(size_t)(y - origin_y_)*canvas.w + x - origin_x_] = a * mask.at(x, y) * opacity / (255*255);
+            }
+    }
+
+    bool Compositor::render_layer(Layer& l, Image& canvas, const std::vector<uint8_t>* clip)
+    {
+        if (!l.images_loaded())
+        {
+            std::cerr << "Compositor: layer images not loaded: " << l.utf8name << std::endl;
+            return false;
+        }
+        int32_t t, lf, b, r;
+        l.channel_bounds(0, t, lf, b, r);
+        if (r <= lf || b <= t)
+            return true;
+
+        bool gray = doc_.header.color_mode == (uint16_t)ColorMode::Grayscale;
+        ImageData* ch[3];
+        for(int c = 0; c < 3; c ++)
+        {
+            ch[c] = l.get_channel_info_by_id(gray ? 0 : c);
+            if (ch[c] == nullptr)
+                return true;
+        }
+        ImageData* alpha = l.get_channel_info_by_id(-1);
+        if (alpha != nullptr && !channel_ok(alpha, r - lf, b - t))
+            alpha = nullptr;
+        for(int c = 0; c < 3; c ++)
+            if (!channel_ok(ch[c], r - lf, b - t))
+                return true;
+
+        LayerEffects effects;
+        const EffectCoverage* fx = nullptr;
+        float layer_opacity = l.opacity/255.0f;
+        if (effects.read(l, global_angle_))
+        {
+            // effects fade with the layer's opacity but not its fill
+            fx = &effect_coverage(l, effects, Rect(t, lf, b, r), alpha);
+            const std::vector<uint8_t>* knockout = effects.knockout && l.fill_opacity() < 255 ? &fx->shape : nullptr;
+            if (effects.drop_shadow.enabled)
+                blend_effect(*fx, fx->shadow, effects.shadow_x, effects.shadow_y, effects.drop_shadow, layer_opacity, knockout, canvas, clip);
+            if (effects.outer_glow.enabled)
+                blend_effect(*fx, fx->glow, 0, 0, effects.outer_glow, layer_opacity, nullptr, canvas, clip);
+        }
+
+        MaskSampler mask(&l, canvas_rect(canvas).intersected(Rect(t, lf, b, r)), doc_.header);
+        uint32_t mode = l.blend_key.x;
+        bool normal = mode == tag("norm") || mode == tag("diss");
+        float opacity = layer_opacity * l.fill_opacity()/255.0f;
+        const LayerEffects::Effect& overlay = effects.color_overlay;
+        float overlay_opacity = overlay.enabled ? overlay.opacity/255.0f : 0;
+        uint8_t overlay_color[3];
+        effect_color(overlay, gray, overlay_color);
+        BlendIf blend_if(&l, gray);
+
+        // spans of channel samples, from the rows or from one tile at a time
+        const TiledImage* tiles = tiled_layer(l, ch, alpha);
+        int32_t planes[4];
+        for(int c = 0; tiles && c < 4; c ++)
+            planes[c] = tiles->channel_index(c == 3 ? -1 : gray ? 0 : c);
+
+        // loop in document coordinates over the part of the layer on the canvas
+        int32_t y0 = std::max(t, origin_y_), y1 = std::min(b, origin_y_ + (int32_t)canvas.h);
+        int32_t x0 = std::max(lf, origin_x_), x1 = std::min(r, origin_x_ + (int32_t)canvas.w);
+        for(int32_t y = y0; y < y1; y ++)
+        {
+            int32_t sy = y - t;
+            for(int32_t x = x0, n; x < x1; x += n)
+            {
+                int32_t sx = x - lf;
+                const uint8_t* src[4];
+                n = x1 - x;
+                if (tiles)
+                {
+                    uint32_t size = tiles->tile_size();
+                    n = std::min<int32_t>(n, size - sx % size);
+                    // a tile that is not stored has no alpha
+                    if (tiles->tile(sx / size, sy / size) == nullptr)
+                        continue;
+                    for(int c = 0; c < 4; c ++)
+                        src[c] = planes[c] < 0 ? nullptr : tiles->pixel(x, y, planes[c]);
+                }
+                else
+                {
+                    for(int c = 0; c < 3; c ++)
+                        src[c] = (const uint8_t*)&ch[c]->data[sy][sx];
+                    src[3] = alpha ? (const uint8_t*)&alpha->data[sy][sx] : nullptr;
+                }
+                uint8_t* d = canvas.row(y - origin_y_) + (x - origin_x_)*4;
+                for(int32_t i = 0; i < n; i ++, d += 4)
+                {
+                    uint8_t s[3] = {src[0][i], src[1][i], src[2][i]};
+                    float sa = (src[3] ? src[3][i] : 255)/255.0f * opacity;
+                    if (mask.active())
+                        sa *= mask.at(x + i, y)/255.0f;
+                    if (clip)
+                        sa *= (*clip)[(size_t)(y - origin_y_)*canvas.w + x + i - origin_x_]/255.0f;
+                    if (blend_if.active() && sa > 0)
+                        sa *= blend_if.at(s, d);
+                    if (overlay_opacity > 0 && sa > 0)
+                    {
+                        for(int c = 0; c < 3; c ++)
+                        {
+                            float o = blend_channel(overlay.mode, s[c]/255.0f, overlay_color[c]/255.0f)*255;
+                            s[c] = clamp8(s[c] + (o - s[c])*overlay_opacity);
+                        }
+                    }
+                    blend_pixel(d, s, sa, mode, normal);
+                }
+            }
+        }
+
+        if (fx && effects.stroke.enabled)
+            blend_effect(*fx, fx->stroke, 0, 0, effects.stroke, layer_opacity, nullptr, canvas, clip);
+        return true;
+    }
+
+    const Compositor::EffectCoverage& Compositor::effect_coverage(Layer& l, const LayerEffects& effects, const Rect& bounds, ImageData* alpha)
+    {
+        // everything the coverage depends on
+        Hasher hasher(effects.key);
+        int32_t geometry[6] = {bounds.top, bounds.left, bounds.bottom, bounds.right,
+            (int32_t)doc_.header.width, (int32_t)doc_.header.height};
+        hasher.update(geometry, sizeof(geometry));
+        for(int16_t id:{-1, -2})
+        {
+            ImageData* data = l.get_channel_info_by_id(id);
+            uint64_t key = data ? data->version : 0;
+            hasher.update(&key, sizeof(key));
+        }
+        uint8_t mask_state[2] = {l.mask.default_color, l.mask.flags};
+        hasher.update(mask_state, sizeof(mask_state));
+        for(const char* sig:{"vmsk", "vsms"})
+        {
+            ExtraData* ed = l.get_extra_data(Signature(sig));
+            if (ed != nullptr)
+                hasher.update(ed->data.data(), ed->data.size());
+        }
+        uint64_t key = hasher.digest();
+        EffectCoverage& fx = effects_[&l];
+        if (fx.key == key && !fx.shape.empty())
+            return fx;
+
+        // the shape over the layer grown by the effects' reach
+        int32_t reach = effects.reach();
+        Rect area(bounds.top - reach, bounds.left - reach, bounds.bottom + reach, bounds.right + reach);
+        area = area.intersected(Rect(-reach, -reach, doc_.header.height + reach, doc_.header.width + reach));
+        fx = EffectCoverage();
+        fx.key = key;
+        fx.area = area;
+        uint32_t w = area.right - area.left, h = area.bottom - area.top;
+        fx.shape.assign((size_t)w*h, 0);
+        Rect inside = bounds.intersected(area);
+        MaskSampler mask(&l, inside, doc_.header);
+        for(int32_t y = inside.top; y < inside.bottom; y ++)
+        {
+            uint8_t* d = &fx.shape[(size_t)(y - area.top)*w + inside.left - area.left];
+            for(int32_t x = inside.left; x < inside.right; x ++, d ++)
+            {
+                uint8_t a = alpha ? (uint8_t)alpha->data[y - bounds.top][x - bounds.left] : 255;
+                *d = mask.active() ? a * mask.at(x, y) / 255 : a;
+            }
+        }
+
+        std::vector<float> outside_distance, inside_distance;
+        bool spread = (effects.drop_shadow.enabled && effects.drop_shadow.spread > 0) ||
+            (effects.outer_glow.enabled && effects.outer_glow.spread > 0);
+        if (spread || (effects.stroke.enabled && effects.stroke_position != LayerEffects::Inside))
+            distance_map(fx.shape, w, h, true, outside_distance);
+        if (effects.stroke.enabled && effects.stroke_position != LayerEffects::Outside)
+            distance_map(fx.shape, w, h, false, inside_distance);
+
+        // shadow and glow: the shape grown by the spread, then blurred by the rest of the size
+        auto soften = [&](const LayerEffects::Effect& e, std::vector<uint8_t>& out)
+        {
+            out = fx.shape;
+            float grow = e.size*e.spread;
+            if (grow > 0)
+                for(size_t i = 0; i < out.size(); i ++)
+                    out[i] = std::max(out[i], clamp8(band(grow, outside_distance[i])*255));
+            blur(out, w, h, e.size - grow);
+        };
+        if (effects.drop_shadow.enabled)
+            soften(effects.drop_shadow, fx.shadow);
+        if (effects.outer_glow.enabled)
+            soften(effects.outer_glow, fx.glow);
+
+        if (effects.stroke.enabled)
+        {
+            float size = effects.stroke.size;
+            fx.stroke.resize(fx.shape.size());
+            for(size_t i = 0; i < fx.shape.size(); i ++)
+            {
+                float a = fx.shape[i]/255.0f;
+                bool in = fx.shape[i] >= 128;
+                float c;
+                if (effects.stroke_position == LayerEffects::Outside)
+                    c = (in ? 1 : band(size, outside_distance[i]))*(1 - a);
+                else if (effects.stroke_position == LayerEffects::Inside)
+                    c = (in ? band(size, inside_distance[i]) : 1)*a;
+                else
+                    c = in ? band(size/2, inside_distance[i]) : band(size/2, outside_distance[i]);
+                fx.stroke[i] = clamp8(c*255);
+            }
+        }
+        return fx;
+    }
+
+    void Compositor::blend_effect(const EffectCoverage& fx, const std::vector<uint8_t>& coverage, int32_t dx, int32_t dy,
+        const LayerEffects::Effect& effect, float opacity, const std::vector<uint8_t>* knockout,
+        Image& canvas, const std::vector<uint8_t>* clip)
+    {
+        uint8_t color[3];
+        effect_color(effect, doc_.header.color_mode == (uint16_t)ColorMode::Grayscale, color);
+        bool normal = effect.mode == tag("norm") || effect.mode == tag("diss");
+        opacity *= effect.opacity/255.0f;
+        const Rect& a = fx.area;
+        uint32_t w = a.right - a.left;
+        Rect r = Rect(a.top + dy, a.left + dx, a.bottom + dy, a.right + dx).intersected(canvas_rect(canvas));
+        for(int32_t y = r.top; y < r.bottom; y ++)
+        {
+            uint8_t* d = canvas.row(y - origin_y_) + (r.left - origin_x_)*4;
+            const uint8_t* c = &coverage[(size_t)(y - dy - a.top)*w + r.left - dx - a.left];
+            for(int32_t x = r.left; x < r.right; x ++, d += 4, c ++)
+            {
+                if (*c == 0)
+                    continue;
+                float sa = *c/255.0f * opacity;
+                if (knockout && y >= a.top && y < a.bottom && x >= a.left && x < a.right)
+                    sa *= 1 - (*knockout)[(size_t)(y - a.top)*w + x - a.left]/255.0f;
+                if (clip)
+                    sa *= (*clip)[(size_t)(y - origin_y_)*canvas.w + x - origin_x_]/255.0f;
+                blend_pixel(d, color, sa, effect.mode, normal);
+            }
+        }
+    }
+
+    void Compositor::blend_image(const Image& src, Image& canvas, uint32_t mode, uint8_t opacity, Layer* mask_layer, const std::vector<uint8_t>* clip)
+    {
+        MaskSampler mask(mask_layer, canvas_rect(canvas), doc_.header);
+        BlendIf blend_if(mask_layer, doc_.header.color_mode == (uint16_t)ColorMode::Grayscale);
+        bool normal = mode == tag("norm") || mode == tag("diss") || mode == tag("pass");
+        for(uint32_t y = 0; y < canvas.h; y ++)
+        {
+            uint8_t* d = canvas.row(y);
+            const uint8_t* s = src.row(y);
+            for(uint32_t x = 0; x < canvas.w; x ++, d += 4, s += 4)
+            {
+                float sa = s[3]/255.0f * opacity/255.0f;
+                if (mask.active())
+                    sa *= mask.at(x + origin_x_, y + origin_y_)/255.0f;
+                if (clip)
+                    sa *= (*clip)[(size_t)y*canvas.w+x]/255.0f;
+                if (blend_if.active() && sa > 0)
+                    sa *= blend_if.at(s, d);
+                blend_pixel(d, s, sa, mode, normal);
+            }
+        }
+    }
+
+    void Compositor::apply_adjustments(const std::vector<int32_t>& layers, Image& canvas, const std::vector<uint8_t>* clip)
+    {
+        // consecutive per channel adjustments covering the whole canvas are
+        // fused into one table and applied in a single pass
+        ChannelLUT fused;
+        bool pending = false;
+        size_t count = (size_t)canvas.w*canvas.h;
+        if (count == 0)
+            return;
+
+        for(auto i:layers)
+        {
+            Layer& l = doc_.layer_info.layers[i];
+            Adjustment a;
+            a.read(l);
+            MaskSampler mask(&l, canvas_rect(canvas), doc_.header);
+            bool full = l.opacity == 255 && !mask.active() && clip == nullptr;
+
+            if (a.is_lut() && full)
+            {
+                if (!pending)
+                    fused = a.lut;
+                else
+                    fused.then(a.lut);
+                pending = true;
+                continue;
+            }
+            if (pending)
+            {
+                fused.apply(&canvas.pixels[0], count);
+                pending = false;
+            }
+            if (full)
+            {
+                a.apply(&canvas.pixels[0], count);
+                continue;
+            }
+
+            std::vector<uint8_t> row(canvas.w*4);
+            for(uint32_t y = 0; y < canvas.h; y ++)
+            {
+                uint8_t* d = canvas.row(y);
+                std::copy(d, d + canvas.w*4, row.begin());
+                a.apply(&row[0], canvas.w);
+                for(uint32_t x = 0; x < canvas.w; x ++)
+                {
+                    float t = l.opacity/255.0f * mask.at(x + origin_x_, y + origin_y_)/255.0f;
+                    if (clip)
+                        t *= (*clip)[(size_t)y*canvas.w+x]/255.0f;
+                    for(int c = 0; c < 3; c ++)
+                        d[x*4+c] = clamp8(d[x*4+c] + (row[x*4+c] - d[x*4+c])*t);
+                }
+            }
+        }
+        if (pending)
+            fused.apply(&canvas.pixels[0], count);
+    }
+}
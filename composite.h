@@ -0,0 +1,238 @@
+#pragma once
+
+#include "psd.h"
+#include "tiles.h"
+
+namespace psd
+{
+    // 8 bit RGBA, rows top to bottom, straight (not premultiplied) alpha
+    struct Image
+    {
+        Image()
+            : w(0), h(0)
+        {}
+        uint32_t w;
+        uint32_t h;
+        std::vector<uint8_t> pixels;
+
+        void resize(uint32_t w, uint32_t h);
+        uint8_t* row(uint32_t y) { return &pixels[(size_t)y*w*4]; }
+        const uint8_t* row(uint32_t y) const { return &pixels[(size_t)y*w*4]; }
+    };
+
+    // one lookup table per color channel
+    struct ChannelLUT
+    {
+        uint8_t lut[3][256];
+
+        void identity();
+        void then(const ChannelLUT& next); // *this followed by next, as one table
+        void apply(uint8_t* rgba, size_t count) const;
+    };
+
+    // levl, curv, brit, hue2 and mixr adjustment layers
+    struct Adjustment
+    {
+        enum Kind
+        {
+            None,
+            Levels,
+            Curves,
+            BrightnessContrast,
+            HueSaturation,
+            ChannelMixer,
+        };
+
+        Adjustment()
+            : kind(None)
+        {}
+        Kind kind;
+
+        ChannelLUT lut; // Levels, Curves, BrightnessContrast
+
+        bool colorize; // HueSaturation
+        int16_t colorize_hue, colorize_saturation, colorize_lightness;
+        int16_t hue, saturation, lightness;
+
+        bool monochrome; // ChannelMixer
+        int16_t mixer[3][5]; // per output channel: red, green, blue, unused, constant (percent)
+
+        bool read(Layer& layer);
+        bool is_lut() const { return kind == Levels || kind == Curves || kind == BrightnessContrast; }
+        void apply(uint8_t* rgba, size_t count) const;
+    };
+
+    // vmsk/vsms vector mask: Bezier subpaths flattened to polygons in
+    // document pixels, combined in order by their path operations
+    struct VectorMask
+    {
+        enum Operation
+        {
+            Xor = 0,
+            Combine = 1,
+            Subtract = 2,
+            Intersect = 3,
+        };
+
+        struct Subpath
+        {
+            Subpath()
+                : operation(Combine)
+            {}
+            int16_t operation;
+            std::vector<float> points; // x, y pairs, implicitly closed
+            Rect bounds; // pixels touched
+        };
+
+        VectorMask()
+            : invert(false), disabled(false), initial_fill(false)
+        {}
+        bool invert;
+        bool disabled;
+        bool initial_fill; // the fill starts covering everything
+        std::vector<Subpath> subpaths;
+
+        bool read(Layer& layer, uint32_t doc_w, uint32_t doc_h);
+        bool empty() const { return disabled || (subpaths.empty() && !initial_fill && !invert); }
+        // anti-aliased coverage of region, one byte per pixel, rows region
+        // width apart; regions are independent, so tiles can be filled in
+        // parallel or only when they become visible
+        void rasterize(const Rect& region, uint8_t* out) const;
+    };
+
+    // lfx2/lmfx layer effects shaped by the layer's alpha and masks: drop
+    // shadow and outer glow under the layer, color overlay on its pixels
+    // and a stroke over it
+    struct LayerEffects
+    {
+        struct Effect
+        {
+            Effect()
+                : enabled(false), mode(0), opacity(255), size(0), spread(0)
+            {
+                color[0] = color[1] = color[2] = 0;
+            }
+            bool enabled;
+            uint32_t mode; // blend key, raw byte order like Layer::blend_key
+            uint8_t color[3];
+            uint8_t opacity;
+            float size; // blur size or stroke width, pixels
+            float spread; // spread or choke, 0..1
+        };
+
+        enum StrokePosition
+        {
+            Outside,
+            Inside,
+            Center,
+        };
+
+        LayerEffects()
+            : shadow_x(0), shadow_y(0), knockout(true), stroke_position(Outside), key(0)
+        {}
+        Effect drop_shadow;
+        int32_t shadow_x, shadow_y; // offset, pixels
+        bool knockout; // the layer hides the shadow beneath it
+        Effect outer_glow;
+        Effect color_overlay;
+        Effect stroke;
+        StrokePosition stroke_position;
+        uint64_t key; // hash of the effect bytes and the light angle
+
+        // global_angle (resource 1037) is used by shadows that follow the document light
+        bool read(Layer& layer, int32_t global_angle = 120);
+        bool empty() const { return !drop_shadow.enabled && !outer_glow.enabled && !color_overlay.enabled && !stroke.enabled; }
+        bool blends_normally() const;
+        int32_t reach() const; // pixels the effects extend past the layer's shape
+    };
+
+    // Renders the layer stack of a document into an Image. Supports RGB and
+    // grayscale 8 bit documents, groups (isolated and pass-through), clipping,
+    // layer and vector masks, separable blend modes, the common adjustment
+    // layers and layer effects.
+    class Compositor
+    {
+    public:
+        explicit Compositor(psd& doc);
+
+        bool render(Image& out);
+        // only the pixels inside region, in document coordinates; out is
+        // sized to the region and matches the same rectangle of render(out)
+        bool render(Image& out, const Rect& region);
+
+        // Caches for editing one layer: the composite of the stack below it
+        // and, when every visible layer above blends normally, those layers
+        // precomposed, so a render costs the active layer plus one blend.
+        // The precomposed layers round like an isolated group would.
+        // Only pixel layers directly in the document root that are neither
+        // clipped nor a clipping base qualify; returns false otherwise and
+        // renders run the whole stack. Edits to any other layer need
+        // invalidate() or a new set_active_layer().
+        bool set_active_layer(int32_t layer);
+        void invalidate();
+
+        // Keeps each pixel layer's color and alpha as a TiledImage of
+        // tile_size, built on first use and rebuilt when its rows get a new
+        // ImageData::version. Regions then read whole tiles and skip those
+        // whose alpha is empty; worth it when one compositor renders many
+        // regions of the same layers. 0, the default, reads the rows.
+        void set_tile_size(uint32_t tile_size);
+
+    private:
+        // the layer's shape and the coverage of its blurred and stroked
+        // effects over everything they reach, one byte per pixel; kept
+        // until the layer's masks or effects change or its alpha or mask
+        // rows get a new ImageData::version, so pixel edits must be marked
+        struct EffectCoverage
+        {
+            EffectCoverage()
+                : key(0)
+            {}
+            uint64_t key;
+            Rect area;
+            std::vector<uint8_t> shape, shadow, glow, stroke;
+        };
+
+        struct TiledLayer
+        {
+            TiledLayer()
+                : key(0), usable(false)
+            {}
+            uint64_t key; // versions of the channels it was built from
+            bool usable;
+            TiledImage tiles;
+        };
+
+        bool prepare();
+        Rect canvas_rect(const Image& canvas) const; // document rectangle canvas covers
+        bool build_caches();
+        bool render_group(int32_t group, Image& canvas, size_t first = 0, size_t last = SIZE_MAX);
+        bool render_layer(Layer& layer, Image& canvas, const std::vector<uint8_t>* clip);
+        // what layers clipped to base may cover: its alpha, or content's
+        // when given, times its masks and opacity; unbounded for adjustment
+        // layers, which keep full opacity
+        void clip_base(Layer& base, const Image* content, bool unbounded, const Image& canvas, std::vector<uint8_t>& clip);
+        void apply_adjustments(const std::vector<int32_t>& layers, Image& canvas, const std::vector<uint8_t>* clip);
+        void blend_image(const Image& src, Image& canvas, uint32_t mode, uint8_t opacity, Layer* mask_layer, const std::vector<uint8_t>* clip);
+        const TiledImage* tiled_layer(Layer& layer, ImageData* const* color, ImageData* alpha);
+        const EffectCoverage& effect_coverage(Layer& layer, const LayerEffects& effects, const Rect& bounds, ImageData* alpha);
+        void blend_effect(const EffectCoverage& fx, const std::vector<uint8_t>& coverage, int32_t dx, int32_t dy,
+            const LayerEffects::Effect& effect, float opacity, const std::vector<uint8_t>* knockout,
+            Image& canvas, const std::vector<uint8_t>* clip);
+
+        psd& doc_;
+        int32_t global_angle_;
+        int32_t origin_x_, origin_y_; // document position of canvas pixel 0, 0
+        std::vector<int32_t> folder_groups_; // per layer, group index if it is a folder layer, else -1
+
+        int32_t active_; // layer being edited, -1 for none
+        size_t active_pos_; // its index among the root's children
+        bool cached_;
+        bool above_cached_; // false when a layer above does not blend normally
+        Image below_; // root children under the active layer, full size
+        Image above_; // root children over it, precomposed on a transparent canvas
+        std::unordered_map<const Layer*, EffectCoverage> effects_;
+        uint32_t tile_size_;
+        std::unordered_map<const Layer*, TiledLayer> tiled_;
+    };
+}
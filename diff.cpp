@@ -0,0 +1,527 @@
+#include "diff.h"
+#include <cstring>
+
+namespace psd
+{
+    static bool same_record(const Layer& a, const Layer& b)
+    {
+        const Rect ra = a.bounds(), rb = b.bounds();
+        if (ra.top != rb.top || ra.left != rb.left || ra.bottom != rb.bottom || ra.right != rb.right)
+            return false;
+        if (a.blend_key.x != b.blend_key.x || a.opacity != b.opacity ||
+            a.clipping != b.clipping || a.bit_flags != b.bit_flags)
+            return false;
+        if (a.name != b.name || a.utf8name != b.utf8name)
+            return false;
+        if (a.mask.length != b.mask.length)
+            return false;
+        if (a.mask.length && (
+                a.mask.top != b.mask.top || a.mask.left != b.mask.left ||
+                a.mask.bottom != b.mask.bottom || a.mask.right != b.mask.right ||
+                a.mask.default_color != b.mask.default_color || a.mask.flags != b.mask.flags ||
+                a.mask.additional_data != b.mask.additional_data))
+            return false;
+        return a.blending_ranges.data == b.blending_ranges.data;
+    }
+
+    static bool same_extra_data(const Layer& a, const Layer& b)
+    {
+        if (a.additional_extra_data.size() != b.additional_extra_data.size())
+            return false;
+        for(size_t i = 0; i < a.additional_extra_data.size(); i ++)
+        {
+            auto& ea = a.additional_extra_data[i];
+            auto& eb = b.additional_extra_data[i];
+            if (ea.key.sig != eb.key.sig || ea.data != eb.data)
+                return false;
+        }
+        return true;
+    }
+
+    static bool same_resources(psd& a, psd& b)
+    {
+        if (a.image_resources.size() != b.image_resources.size())
+            return false;
+        for(size_t i = 0; i < a.image_resources.size(); i ++)
+        {
+            auto& ra = a.image_resources[i];
+            auto& rb = b.image_resources[i];
+            if (ra.image_resource_id != rb.image_resource_id || ra.name != rb.name || ra.buffer != rb.buffer)
+                return false;
+        }
+        return true;
+    }
+
+    // rows changed in one channel, merged into rectangles
+    static void add_row_range(std::vector<Rect>& rects, int32_t y, int32_t x0, int32_t x1)
+    {
+        if (!rects.empty())
+        {
+            Rect& r = rects.back();
+            if (r.bottom == y && x0 <= r.right && r.left <= x1)
+            {
+                r.bottom = y + 1;
+                r.left = std::min(r.left, x0);
+                r.right = std::max(r.right, x1);
+                return;
+            }
+        }
+        rects.push_back(Rect(y, x0, y + 1, x1));
+    }
+
+    static void merge_rects(std::vector<Rect>& rects)
+    {
+        bool merged = true;
+        while(merged)
+        {
+            merged = false;
+            for(size_t i = 0; i < rects.size() && !merged; i ++)
+            {
+                for(size_t j = i + 1; j < rects.size(); j ++)
+                {
+                    if (rects[i].intersects(rects[j]))
+                    {
+                        rects[i] = rects[i].united(rects[j]);
+                        rects.erase(rects.begin() + j);
+                        merged = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    // false when a PackBits row does not unpack to at least w bytes
+    static bool decode_row(uint16_t method, std::vector<char>& stored, uint32_t w, std::vector<char>& row)
+    {
+        if (method != 1)
+            row.swap(stored);
+        else if (!ImageData::unpack_row(stored, row))
+            return false;
+        return row.size() >= w;
+    }
+
+    static bool diff_channel(std::istream& fa, const Layer& a, size_t slot_a,
+                             std::istream& fb, const Layer& b, size_t slot_b,
+                             std::vector<Rect>& dirty)
+    {
+        int16_t id = a.channel_infos[slot_a].first;
+        int32_t t, l, bt, r;
+        a.channel_bounds(id, t, l, bt, r);
+        if (r <= l || bt <= t)
+            return true;
+        uint32_t w = r - l, h = bt - t;
+
+        // rows are compared as they are read, so neither channel is held whole
+        ImageData::RowReader reader_a, reader_b;
+        fa.clear();
+        fa.seekg(a.channel_pos(slot_a));
+        fb.clear();
+        fb.seekg(b.channel_pos(slot_b));
+        if (!reader_a.open(fa, w, h) || !reader_b.open(fb, w, h))
+        {
+            std::cerr << "diff: cannot read channel " << id << " of " << a.utf8name << std::endl;
+            return false;
+        }
+
+        std::vector<char> stored_a, stored_b, row_a, row_b;
+        for(uint32_t y = 0; y < h; y ++)
+        {
+            if (!reader_a.next(stored_a) || !reader_b.next(stored_b))
+            {
+                std::cerr << "diff: cannot read channel " << id << " of " << a.utf8name << std::endl;
+                return false;
+            }
+            if (reader_a.compression_method == reader_b.compression_method && stored_a == stored_b)
+                continue;
+            // stored bytes differ; decode this row only
+            if (!decode_row(reader_a.compression_method, stored_a, w, row_a) ||
+                !decode_row(reader_b.compression_method, stored_b, w, row_b))
+            {
+                std::cerr << "diff: corrupt row " << y << " in channel " << id << " of " << a.utf8name << std::endl;
+                return false;
+            }
+
+            uint32_t x0 = 0, x1 = w;
+            while(x0 < w && row_a[x0] == row_b[x0])
+                x0 ++;
+            if (x0 == w)
+                continue;
+            while(x1 > x0 && row_a[x1-1] == row_b[x1-1])
+                x1 --;
+            add_row_range(dirty, t + y, l + x0, l + x1);
+        }
+        return true;
+    }
+
+    static bool diff_pixels(std::istream& fa, const Layer& a, std::istream& fb, const Layer& b, LayerChange& change)
+    {
+        bool same_layout = a.channel_infos.size() == b.channel_infos.size();
+        for(size_t i = 0; same_layout && i < a.channel_infos.size(); i ++)
+        {
+            int16_t id = a.channel_infos[i].first;
+            int32_t t0, l0, b0, r0, t1, l1, b1, r1;
+            a.channel_bounds(id, t0, l0, b0, r0);
+            b.channel_bounds(id, t1, l1, b1, r1);
+            if (b.get_channel_slot(id) < 0 || t0 != t1 || l0 != l1 || b0 != b1 || r0 != r1)
+                same_layout = false;
+        }
+        if (!same_layout)
+        {
+            change.kinds |= LayerChange::Pixels;
+            change.dirty.push_back(a.bounds().united(b.bounds()));
+            return true;
+        }
+
+        std::vector<Rect> dirty;
+        for(size_t i = 0; i < a.channel_infos.size(); i ++)
+        {
+            std::vector<Rect> channel_dirty;
+            if (!diff_channel(fa, a, i, fb, b, b.get_channel_slot(a.channel_infos[i].first), channel_dirty))
+                return false;
+            dirty.insert(dirty.end(), channel_dirty.begin(), channel_dirty.end());
+        }
+        if (!dirty.empty())
+        {
+            merge_rects(dirty);
+            change.kinds |= LayerChange::Pixels;
+            change.dirty.insert(change.dirty.end(), dirty.begin(), dirty.end());
+        }
+        return true;
+    }
+
+    // layers of b matched to each layer of a, -1 if none
+    static std::vector<int32_t> match_layers(LayerInfo& a, LayerInfo& b)
+    {
+        std::vector<int32_t> match(a.layers.size(), -1);
+        std::vector<bool> used(b.layers.size(), false);
+        for(size_t i = 0; i < a.layers.size(); i ++)
+        {
+            auto& l = a.layers[i];
+            if (!l.has_layer_id)
+                continue;
+            auto it = b.id_index.find(l.layer_id);
+            if (it != b.id_index.end() && !used[it->second])
+            {
+                match[i] = it->second;
+                used[it->second] = true;
+            }
+        }
+        for(size_t i = 0; i < a.layers.size(); i ++)
+        {
+            if (match[i] >= 0 || a.layers[i].has_layer_id)
+                continue;
+            for(auto j:b.find_layers(a.layers[i].utf8name))
+            {
+                if (!used[j] && !b.layers[j].has_layer_id)
+                {
+                    match[i] = j;
+                    used[j] = true;
+                    break;
+                }
+            }
+        }
+        return match;
+    }
+
+    // matched layers outside the longest run that keeps its order have moved
+    static std::vector<bool> moved_layers(const std::vector<int32_t>& match)
+    {
+        std::vector<int32_t> idx; // indices into match, in order
+        for(size_t i = 0; i < match.size(); i ++)
+            if (match[i] >= 0)
+                idx.push_back(i);
+        std::vector<int32_t> tails, tails_at, prev(idx.size(), -1);
+        for(size_t k = 0; k < idx.size(); k ++)
+        {
+            int32_t v = match[idx[k]];
+            size_t pos = std::lower_bound(tails.begin(), tails.end(), v) - tails.begin();
+            if (pos == tails.size())
+            {
+                tails.push_back(v);
+                tails_at.push_back(k);
+            }
+            else
+            {
+                tails[pos] = v;
+                tails_at[pos] = k;
+            }
+            prev[k] = pos > 0 ? tails_at[pos-1] : -1;
+        }
+        std::vector<bool> moved(match.size(), false);
+        for(auto i:idx)
+            moved[i] = true;
+        for(int32_t k = tails_at.empty() ? -1 : tails_at.back(); k >= 0; k = prev[k])
+            moved[idx[k]] = false;
+        return moved;
+    }
+
+    bool diff(std::istream& fa, std::istream& fb, DocumentDiff& result)
+    {
+        result = DocumentDiff();
+        psd::LoadOptions options;
+        options.layer_images = false;
+        psd a, b;
+        if (!a.load(fa, options) || !b.load(fb, options))
+            return false;
+
+        result.header = std::memcmp(&a.header, &b.header, sizeof(Header)) != 0;
+        result.resources = !same_resources(a, b);
+        auto& ga = a.global_layer_mask_info;
+        auto& gb = b.global_layer_mask_info;
+        result.global_data =
+            ga.length != gb.length ||
+            (ga.length && std::memcmp(&ga.overlay_colorspace, &gb.overlay_colorspace, 2+2*4+2+1) != 0) ||
+            ga.data != gb.data ||
+            a.additional_layer_data != b.additional_layer_data;
+
+        auto match = match_layers(a.layer_info, b.layer_info);
+        auto moved = moved_layers(match);
+        std::vector<bool> matched(b.layers().size(), false);
+
+        for(size_t i = 0; i < match.size(); i ++)
+        {
+            Layer& la = a.layers()[i];
+            LayerChange change;
+            change.old_index = i;
+            change.new_index = match[i];
+            if (match[i] < 0)
+            {
+                change.kinds = LayerChange::Removed;
+                change.dirty.push_back(la.bounds());
+                result.layers.push_back(change);
+                continue;
+            }
+            matched[match[i]] = true;
+            Layer& lb = b.layers()[match[i]];
+            if (moved[i])
+                change.kinds |= LayerChange::Moved;
+            if (!same_record(la, lb))
+                change.kinds |= LayerChange::Record;
+            if (!same_extra_data(la, lb))
+                change.kinds |= LayerChange::Extra;
+            if (!diff_pixels(fa, la, fb, lb, change))
+                return false;
+            if ((change.kinds & (LayerChange::Moved | LayerChange::Record)) && change.dirty.empty())
+                change.dirty.push_back(la.bounds().united(lb.bounds()));
+            if (change.kinds)
+                result.layers.push_back(change);
+        }
+        for(size_t j = 0; j < matched.size(); j ++)
+        {
+            if (matched[j])
+                continue;
+            LayerChange change;
+            change.kinds = LayerChange::Added;
+            change.new_index = j;
+            change.dirty.push_back(b.layers()[j].bounds());
+            result.layers.push_back(change);
+        }
+        return true;
+    }
+
+    static void hash_bytes(Hasher& h, const void* data, size_t size)
+    {
+        uint64_t n = size;
+        h.update(&n, sizeof(n));
+        h.update(data, size);
+    }
+
+    static uint64_t record_hash(const Layer& l)
+    {
+        Hasher h;
+        Rect r = l.bounds();
+        uint32_t fields[8] = {
+            (uint32_t)r.top, (uint32_t)r.left, (uint32_t)r.bottom, (uint32_t)r.right,
+            l.blend_key.x, l.opacity, l.clipping, l.bit_flags,
+        };
+        h.update(fields, sizeof(fields));
+        hash_bytes(h, l.name.data(), l.name.size());
+        hash_bytes(h, l.utf8name.data(), l.utf8name.size());
+        uint32_t length = l.mask.length;
+        h.update(&length, sizeof(length));
+        if (length)
+        {
+            uint32_t mask[6] = {
+                l.mask.top, l.mask.left, l.mask.bottom, l.mask.right,
+                l.mask.default_color, l.mask.flags,
+            };
+            h.update(mask, sizeof(mask));
+            hash_bytes(h, l.mask.additional_data.data(), l.mask.additional_data.size());
+        }
+        hash_bytes(h, l.blending_ranges.data.data(), l.blending_ranges.data.size());
+        return h.digest();
+    }
+
+    static uint64_t extra_hash(const Layer& l)
+    {
+        Hasher h;
+        for(auto& ed:l.additional_extra_data)
+        {
+            h.update(&ed.key.sig, sizeof(ed.key.sig));
+            hash_bytes(h, ed.data.data(), ed.data.size());
+        }
+        return h.digest();
+    }
+
+    static bool pixels_hash(std::istream& f, const Layer& l, uint64_t& hash)
+    {
+        Hasher h;
+        std::vector<char> buffer;
+        for(size_t i = 0; i < l.channel_infos.size(); i ++)
+        {
+            int32_t t, lf, b, r;
+            l.channel_bounds(l.channel_infos[i].first, t, lf, b, r);
+            int64_t header[4] = {l.channel_infos[i].first, r - lf, b - t, (int64_t)l.channel_infos[i].second};
+            h.update(header, sizeof(header));
+            f.clear();
+            f.seekg(l.channel_pos(i));
+            for(uint64_t left = l.channel_infos[i].second; left; )
+            {
+                buffer.resize(std::min<uint64_t>(left, 1 << 20));
+                if (!f.read(buffer.data(), buffer.size()))
+                    return false;
+                h.update(buffer.data(), buffer.size());
+                left -= buffer.size();
+            }
+        }
+        hash = h.digest();
+        return true;
+    }
+
+    bool fingerprint(std::istream& f, psd& doc, DocumentFingerprint& result)
+    {
+        result = DocumentFingerprint();
+        result.header = hash64(&doc.header, sizeof(Header));
+        Hasher resources;
+        for(auto& r:doc.image_resources)
+        {
+            uint32_t id = r.image_resource_id;
+            resources.update(&id, sizeof(id));
+            hash_bytes(resources, r.name.data(), r.name.size());
+            hash_bytes(resources, r.buffer.data(), r.buffer.size());
+        }
+        result.resources = resources.digest();
+        auto& g = doc.global_layer_mask_info;
+        Hasher global;
+        uint32_t length = g.length;
+        global.update(&length, sizeof(length));
+        if (length)
+            global.update(&g.overlay_colorspace, 2+2*4+2+1);
+        hash_bytes(global, g.data.data(), g.data.size());
+        hash_bytes(global, doc.additional_layer_data.data(), doc.additional_layer_data.size());
+        result.global_data = global.digest();
+
+        for(auto& l:doc.layers())
+        {
+            LayerFingerprint lf;
+            lf.has_layer_id = l.has_layer_id;
+            lf.layer_id = l.layer_id;
+            lf.utf8name = l.utf8name;
+            lf.bounds = l.bounds();
+            if (l.mask.length >= 4*4+2)
+                lf.bounds = lf.bounds.united(Rect(l.mask.top, l.mask.left, l.mask.bottom, l.mask.right));
+            lf.record = record_hash(l);
+            lf.extra = extra_hash(l);
+            if (!pixels_hash(f, l, lf.pixels))
+            {
+                std::cerr << "fingerprint: cannot read channels of " << l.utf8name << std::endl;
+                return false;
+            }
+            result.layers.push_back(std::move(lf));
+        }
+        return true;
+    }
+
+    // same rules as match_layers: lyid first, then unused layers without one by name
+    static std::vector<int32_t> match_fingerprints(const std::vector<LayerFingerprint>& a, const std::vector<LayerFingerprint>& b)
+    {
+        std::unordered_map<uint32_t, int32_t> ids;
+        std::unordered_map<std::string, std::vector<int32_t>> names;
+        for(size_t j = 0; j < b.size(); j ++)
+        {
+            if (b[j].has_layer_id)
+                ids.insert(std::make_pair(b[j].layer_id, (int32_t)j));
+            else
+                names[b[j].utf8name].push_back(j);
+        }
+        std::vector<int32_t> match(a.size(), -1);
+        std::vector<bool> used(b.size(), false);
+        for(size_t i = 0; i < a.size(); i ++)
+        {
+            if (a[i].has_layer_id)
+            {
+                auto it = ids.find(a[i].layer_id);
+                if (it != ids.end() && !used[it->second])
+                {
+                    match[i] = it->second;
+                    used[it->second] = true;
+                }
+                continue;
+            }
+            auto it = names.find(a[i].utf8name);
+            if (it == names.end())
+                continue;
+            for(auto j:it->second)
+            {
+                if (!used[j])
+                {
+                    match[i] = j;
+                    used[j] = true;
+                    break;
+                }
+            }
+        }
+        return match;
+    }
+
+    void diff(const DocumentFingerprint& a, const DocumentFingerprint& b, DocumentDiff& result)
+    {
+        result = DocumentDiff();
+        result.header = a.header != b.header;
+        result.resources = a.resources != b.resources;
+        result.global_data = a.global_data != b.global_data;
+
+        auto match = match_fingerprints(a.layers, b.layers);
+        auto moved = moved_layers(match);
+        std::vector<bool> matched(b.layers.size(), false);
+        for(size_t i = 0; i < match.size(); i ++)
+        {
+            auto& la = a.layers[i];
+            LayerChange change;
+            change.old_index = i;
+            change.new_index = match[i];
+            if (match[i] < 0)
+            {
+                change.kinds = LayerChange::Removed;
+                change.dirty.push_back(la.bounds);
+                result.layers.push_back(change);
+                continue;
+            }
+            matched[match[i]] = true;
+            auto& lb = b.layers[match[i]];
+            if (moved[i])
+                change.kinds |= LayerChange::Moved;
+            if (la.record != lb.record)
+                change.kinds |= LayerChange::Record;
+            if (la.extra != lb.extra)
+                change.kinds |= LayerChange::Extra;
+            if (la.pixels != lb.pixels)
+                change.kinds |= LayerChange::Pixels;
+            if (change.kinds & (LayerChange::Moved | LayerChange::Record | LayerChange::Pixels))
+                change.dirty.push_back(la.bounds.united(lb.bounds));
+            if (change.kinds)
+                result.layers.push_back(change);
+        }
+        for(size_t j = 0; j < matched.size(); j ++)
+        {
+            if (matched[j])
+                continue;
+            LayerChange change;
+            change.kinds = LayerChange::Added;
+            change.new_index = j;
+            change.dirty.push_back(b.layers[j].bounds);
+            result.layers.push_back(change);
+        }
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "psd.h"
+
+namespace psd
+{
+    struct LayerChange
+    {
+        enum : uint32_t
+        {
+            Added = 1,
+            Removed = 2,
+            Moved = 4, // stacking order changed
+            Record = 8, // bounds, blending, flags, name, mask or blending ranges
+            Extra = 16, // additional extra data
+            Pixels = 32,
+        };
+
+        LayerChange()
+            : kinds(0), old_index(-1), new_index(-1)
+        {}
+        uint32_t kinds;
+        int32_t old_index; // -1 when added
+        int32_t new_index; // -1 when removed
+        std::vector<Rect> dirty; // document coordinates
+    };
+
+    struct DocumentDiff
+    {
+        DocumentDiff()
+            : header(false), resources(false), global_data(false)
+        {}
+        bool header;
+        bool resources;
+        bool global_data; // global layer mask info and additional layer data
+        std::vector<LayerChange> layers; // changed layers only
+
+        bool empty() const { return !header && !resources && !global_data && layers.empty(); }
+    };
+
+    // Compares two revisions of a document. Layers are matched by lyid, or
+    // by name; channel rows are compared as stored and only rows whose bytes
+    // differ are decoded to find the changed columns.
+    bool diff(std::istream& a, std::istream& b, DocumentDiff& result);
+
+    // Hashes of one revision, enough to compare a later revision against it
+    // without keeping the older file around. Dirty rectangles from such a
+    // comparison cover whole layers rather than changed rows.
+    struct LayerFingerprint
+    {
+        LayerFingerprint()
+            : has_layer_id(false), layer_id(0), record(0), extra(0), pixels(0)
+        {}
+        bool has_layer_id;
+        uint32_t layer_id;
+        std::string utf8name;
+        Rect bounds; // layer bounds united with the mask rectangle
+        uint64_t record; // bounds, blending, flags, name, mask and blending ranges
+        uint64_t extra; // additional extra data
+        uint64_t pixels; // stored bytes of every channel, with its id and size
+    };
+
+    struct DocumentFingerprint
+    {
+        DocumentFingerprint()
+            : header(0), resources(0), global_data(0)
+        {}
+        uint64_t header;
+        uint64_t resources;
+        uint64_t global_data;
+        std::vector<LayerFingerprint> layers;
+    };
+
+    // doc was loaded from f; its layer images need not be
+    bool fingerprint(std::istream& f, psd& doc, DocumentFingerprint& result);
+    void diff(const DocumentFingerprint& a, const DocumentFingerprint& b, DocumentDiff& result);
+}
@@ -0,0 +1,757 @@
+#include "psd.h"
+#include "cache.h"
+#include "catalog.h"
+#include "composite.h"
+#include "diff.h"
+#include "planes.h"
+#include "resize.h"
+#include "tiles.h"
+#include "psdexport/pipeline.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <dirent.h>
+#include <unistd.h>
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+    cout << (ok ? "ok   " : "FAIL ") << what << endl;
+    if (!ok)
+        failures ++;
+}
+
+static void put32(string& s, uint32_t v)
+{
+    for(int i = 3; i >= 0; i --)
+        s += (char)(v >> (i*8));
+}
+
+static void put_key(string& s, const char* key)
+{
+    put32(s, 0);
+    s += key;
+}
+
+static bool load(psd::psd& doc, const string& bytes)
+{
+    istringstream f(bytes);
+    return doc.load(f);
+}
+
+static string save(psd::psd& doc)
+{
+    ostringstream f;
+    return doc.save(f) ? f.str() : string();
+}
+
+static bool same(const psd::Image& a, const psd::Image& b)
+{
+    return a.w == b.w && a.h == b.h && a.pixels == b.pixels;
+}
+
+static bool same_crop(const psd::Image& full, const psd::Image& part, const psd::Rect& r)
+{
+    if (part.w != (uint32_t)(r.right - r.left) || part.h != (uint32_t)(r.bottom - r.top))
+        return false;
+    for(uint32_t y = 0; y < part.h; y ++)
+        if (memcmp(part.row(y), full.row(r.top + y) + r.left*4, part.w*4) != 0)
+            return false;
+    return true;
+}
+
+// a new empty directory under /tmp
+static string make_temp_dir()
+{
+    char name[] = "/tmp/featuretest.XXXXXX";
+    return mkdtemp(name) ? name : "";
+}
+
+static void remove_dir(const string& dir)
+{
+    if (DIR* d = opendir(dir.c_str()))
+    {
+        while(dirent* e = readdir(d))
+            if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0)
+            {
+                string path = dir + "/" + e->d_name;
+                if (e->d_type == DT_DIR)
+                    remove_dir(path);
+                else
+                    unlink(path.c_str());
+            }
+        closedir(d);
+    }
+    rmdir(dir.c_str());
+}
+
+// the first layer with a color channel holding pixels, -1 if none
+static int32_t pixel_layer(psd::psd& doc)
+{
+    for(size_t i = 0; i < doc.layers().size(); i ++)
+    {
+        psd::ImageData* d = doc.layers()[i].get_channel_info_by_id(0);
+        if (d && d->w && d->h && d->has_pixels())
+            return i;
+    }
+    return -1;
+}
+
+// every column of the table holds what the layer holds, and follows an
+// edit once rebuilt
+static void test_layer_table(psd::psd& doc)
+{
+    const psd::LayerTable& t = doc.layer_info.table;
+    auto& layers = doc.layers();
+    bool columns = t.size() == layers.size() && t.name_offset.size() == layers.size() + 1;
+    for(size_t i = 0; columns && i < layers.size(); i ++)
+    {
+        auto& l = layers[i];
+        uint32_t keys = 0;
+        for(auto& ed:l.additional_extra_data)
+            keys |= psd::LayerTable::extra_key_bit(ed.key);
+        columns = t.top[i] == (int32_t)(uint32_t)l.top && t.left[i] == (int32_t)(uint32_t)l.left
+            && t.bottom[i] == (int32_t)(uint32_t)l.bottom && t.right[i] == (int32_t)(uint32_t)l.right
+            && t.blend_key[i] == l.blend_key.x && t.opacity[i] == l.opacity && t.clipping[i] == l.clipping
+            && t.bit_flags[i] == l.bit_flags && t.num_channels[i] == l.channel_infos.size()
+            && t.extra_keys[i] == keys && t.name(i) == l.utf8name;
+    }
+    check(columns, "table: columns match the layers");
+    check(psd::LayerTable::extra_key_bit(psd::Signature("lyid")) == psd::LayerTable::Key_lyid
+        && psd::LayerTable::extra_key_bit(psd::Signature("zzzz")) == psd::LayerTable::Key_Other, "table: extra key bits");
+    if (layers.empty())
+        return;
+
+    psd::Layer& l = doc.layers()[0];
+    bool visible = t.visible(0);
+    string name = l.utf8name;
+    l.bit_flags ^= psd::LayerTable::Hidden;
+    l.utf8name += " edited";
+    doc.layer_info.table.build(layers);
+    check(t.visible(0) != visible && t.name(0) == name + " edited", "table: rebuild follows an edit");
+    l.bit_flags ^= psd::LayerTable::Hidden;
+    l.utf8name = name;
+    doc.layer_info.table.build(layers);
+}
+
+// a group nested in another, bottom to top: divider, divider, layer,
+// folder, layer, folder, then a layer at the root; folder layers are
+// children of the enclosing group
+static void test_group_tree()
+{
+    psd::LayerInfo info;
+    info.layers.resize(7);
+    info.layers[0].section_type = psd::Layer::SectionBoundingDivider;
+    info.layers[1].section_type = psd::Layer::SectionBoundingDivider;
+    info.layers[3].section_type = psd::Layer::SectionClosedFolder;
+    info.layers[3].utf8name = "inner";
+    info.layers[5].section_type = psd::Layer::SectionOpenFolder;
+    info.layers[5].utf8name = "outer";
+    info.build_groups();
+
+    auto& g = info.groups;
+    check(g.size() == 3 && g[0].subgroups == vector<int32_t>{1} && g[0].children == (vector<int32_t>{5, 6}), "groups: root holds the outer group and the top layer");
+    int32_t outer = info.find_group("outer"), inner = info.find_group("inner");
+    check(outer == 1 && inner == 2 && info.find_group("none") == -1, "groups: find by name");
+    if (g.size() != 3)
+        return;
+    check(g[1].first() == 0 && g[1].last() == 5 && g[1].subgroups == vector<int32_t>{2} && g[1].children == (vector<int32_t>{3, 4})
+        && !g[1].collapsed, "groups: the outer group spans its layers");
+    check(g[2].parent == 1 && g[2].first() == 1 && g[2].last() == 3 && g[2].children == vector<int32_t>{2} && g[2].collapsed,
+        "groups: the inner group nests in the outer one");
+    check(info.layer_groups == vector<int32_t>{1, 2, 2, 1, 1, 0, 0}, "groups: enclosing group of every layer");
+}
+
+// loading one group's images leaves the layers outside it unloaded
+static void test_group_images(psd::psd& doc, const string& bytes)
+{
+    psd::psd lazy;
+    psd::psd::LoadOptions options;
+    options.layer_images = false;
+    istringstream f(bytes);
+    lazy.load(f, options);
+    auto& info = lazy.layer_info;
+    if (info.groups.size() < 2)
+        return;
+    const psd::LayerGroup& g = info.groups[1];
+    check(lazy.load_group_images(f, 1), "groups: load one group's images");
+    bool loaded = true;
+    for(int32_t i = 0; i < (int32_t)info.layers.size(); i ++)
+    {
+        auto& l = info.layers[i];
+        bool inside = i >= g.first() && i <= g.last();
+        loaded = loaded && (inside ? l.images_loaded() : l.channel_infos.empty() || !l.images_loaded());
+        for(size_t c = 0; inside && c < l.channel_info_data.size(); c ++)
+            loaded = loaded && l.channel_info_data[c].data == doc.layers()[i].channel_info_data[c].data;
+    }
+    check(loaded, "groups: only the group's layers are loaded, as in a full load");
+}
+
+static bool contains(const vector<int32_t>& v, int32_t i)
+{
+    return find(v.begin(), v.end(), i) != v.end();
+}
+
+// every layer is found by its name, its ID and each of its extra data keys,
+// and by its new name once the index is rebuilt
+static void test_layer_index(psd::psd& doc)
+{
+    psd::LayerInfo& info = doc.layer_info;
+    bool found = true;
+    for(int32_t i = 0; i < (int32_t)info.layers.size(); i ++)
+    {
+        auto& l = info.layers[i];
+        found = found && contains(info.find_layers(l.utf8name), i);
+        if (l.has_layer_id)
+            found = found && info.find_layer_by_id(l.layer_id) && info.find_layer_by_id(l.layer_id)->layer_id == l.layer_id;
+        for(auto& ed:l.additional_extra_data)
+            found = found && contains(info.find_layers_with_key(ed.key), i);
+    }
+    check(found, "index: layers are found by name, ID and key");
+    check(info.find_layers("no such layer").empty() && !info.find_layer("no such layer")
+        && info.find_layers_with_key(psd::Signature("zzzz")).empty(), "index: missing entries");
+    if (info.layers.empty())
+        return;
+
+    string name = info.layers[0].utf8name;
+    info.layers[0].utf8name = "renamed layer";
+    info.build_index();
+    check(info.find_layer("renamed layer") == &info.layers[0] && !contains(info.find_layers(name), 0), "index: rebuild follows a rename");
+    info.layers[0].utf8name = name;
+    info.build_index();
+}
+
+// two items followed by bytes that would parse as a third
+static void test_descriptor()
+{
+    string s;
+    put32(s, 1);
+    s += string("\0A", 2);
+    put_key(s, "null");
+    put32(s, 2);
+    put_key(s, "Ab  ");
+    s += "long";
+    put32(s, 5);
+    put_key(s, "Cd  ");
+    s += "bool";
+    s += (char)1;
+    size_t end = s.size();
+    put_key(s, "Xx  ");
+    s += "long";
+    put32(s, 9);
+
+    psd::Descriptor d;
+    check(d.read(psd::Slice(s.data(), s.size())), "descriptor: read");
+    int count = 0;
+    psd::Slice key;
+    psd::DescriptorValue value;
+    for(const char* c = d.items(); d.next(c, key, value);)
+        count ++;
+    check(count == 2 && d.size() == 2, "descriptor: iteration stops at the item count");
+    check(d.get("Ab  ").as_int() == 5 && d.get("Cd  ").as_bool(), "descriptor: values");
+    check(!d.get("Xx  ").valid(), "descriptor: bytes past the last item are not an item");
+    check(d.end() == s.data() + end, "descriptor: end is after the last item");
+}
+
+// two copies of a pixel layer on top of an otherwise hidden stack, the
+// upper one clipped to the lower: the clipped copy follows the base's opacity
+static void test_clipping(const string& bytes)
+{
+    psd::psd doc;
+    load(doc, bytes);
+    int32_t i = pixel_layer(doc);
+    if (i < 0)
+        return;
+    auto& layers = doc.layers();
+    for(auto& l:layers)
+        l.bit_flags |= psd::LayerTable::Hidden;
+    psd::Layer copy = layers[i];
+    copy.bit_flags &= ~psd::LayerTable::Hidden;
+    copy.has_layer_id = false;
+    copy.clipping = 0;
+    layers.push_back(copy);
+    copy.clipping = 1;
+    layers.push_back(copy);
+    doc.layer_info.num_layers = layers.size();
+    doc.layer_info.groups.clear();
+    doc.layer_info.build_groups();
+    doc.layer_info.table.build(layers);
+    psd::Layer& base = layers[layers.size() - 2];
+
+    uint8_t most[3];
+    uint8_t opacities[3] = {255, 128, 0};
+    for(int k = 0; k < 3; k ++)
+    {
+        base.opacity = opacities[k];
+        psd::Image out;
+        psd::Compositor(doc).render(out);
+        most[k] = 0;
+        for(size_t p = 3; p < out.pixels.size(); p += 4)
+            most[k] = max(most[k], out.pixels[p]);
+    }
+    check(most[1] < most[0] || most[0] == 0, "clipping: a half opaque base lets clipped layers through partly");
+    check(most[2] == 0, "clipping: nothing shows over a transparent base");
+}
+
+// the same rows stored raw and PackBits hash alike when decoded, and
+// differently when the stored bytes are hashed
+static void test_hash_modes()
+{
+    const uint32_t w = 20, h = 3;
+    string raw = string("\0\0", 2) + string(w*h, 7), packed;
+    {
+        psd::ImageData d;
+        d.w = w;
+        d.h = h;
+        d.compression_method = 1;
+        d.data.assign(h, vector<char>(w, 7));
+        ostringstream f;
+        d.write(f);
+        packed = f.str();
+    }
+    uint64_t hashes[2][2];
+    bool decoded_pixels = true, packed_pixels = false;
+    for(int m = 0; m < 2; m ++)
+    {
+        for(int mode = 0; mode < 2; mode ++)
+        {
+            psd::ImageData d;
+            istringstream f(m ? packed : raw);
+            d.read(f, w, h, mode ? psd::HashMode::Compressed : psd::HashMode::Decoded);
+            hashes[m][mode] = d.hash;
+            if (!mode)
+                decoded_pixels = decoded_pixels && d.has_pixels();
+            else if (m)
+                packed_pixels = d.has_pixels();
+        }
+    }
+    check(packed[1] == 1, "hash: rows were written PackBits");
+    check(hashes[0][0] != 0 && hashes[0][0] == hashes[1][0], "hash: Decoded ignores the compression");
+    check(hashes[0][1] != hashes[1][1], "hash: Compressed depends on the stored bytes");
+    check(decoded_pixels && !packed_pixels, "hash: Compressed leaves packed rows undecoded");
+}
+
+// an edited pixel shows up as a pixel change of its layer alone, against
+// the same document saved unedited
+static void test_diff(const string& bytes)
+{
+    psd::DocumentDiff none;
+    {
+        istringstream a(bytes), b(bytes);
+        check(psd::diff(a, b, none) && none.empty(), "diff: a document equals itself");
+    }
+
+    psd::psd doc;
+    load(doc, bytes);
+    int32_t i = pixel_layer(doc);
+    if (i < 0)
+        return;
+    string saved = save(doc);
+    psd::Layer& l = doc.layers()[i];
+    psd::ImageData* d = l.get_channel_info_by_id(0);
+    uint32_t x = d->w/2, y = d->h/2;
+    d->set(x, y, d->data[y][x] ^ 0x55);
+    string edited = save(doc);
+
+    psd::DocumentDiff result;
+    istringstream a(saved), b(edited);
+    check(psd::diff(a, b, result), "diff: compare");
+    check(!result.header && !result.resources && !result.global_data, "diff: only layers changed");
+    bool found = result.layers.size() == 1 && result.layers[0].old_index == i && result.layers[0].new_index == i
+        && result.layers[0].kinds == psd::LayerChange::Pixels;
+    check(found, "diff: the edited layer changed its pixels only");
+    bool covered = false;
+    int32_t px = l.bounds().left + x, py = l.bounds().top + y;
+    if (found)
+        for(auto& r:result.layers[0].dirty)
+            covered = covered || (px >= r.left && px < r.right && py >= r.top && py < r.bottom);
+    check(covered, "diff: a dirty rectangle covers the edit");
+
+    // the edited row made into a PackBits literal run longer than the row
+    psd::psd reloaded;
+    load(reloaded, edited);
+    psd::Layer& e = reloaded.layers()[i];
+    int64_t pos = e.channel_pos(e.get_channel_slot(0));
+    const unsigned char* p = (const unsigned char*)edited.data() + pos;
+    if (p[0] != 0 || p[1] != 1)
+        return;
+    size_t row = pos + 2 + 2*d->h;
+    for(uint32_t k = 0; k <= y; k ++)
+    {
+        uint32_t length = p[2 + 2*k] << 8 | p[3 + 2*k];
+        if (k < y)
+            row += length;
+        else if (length > 128)
+            return;
+    }
+    string corrupt = edited;
+    corrupt[row] = 127;
+    psd::DocumentDiff broken;
+    istringstream c(saved), g(corrupt);
+    check(!psd::diff(c, g, broken), "diff: a corrupt row is an error");
+}
+
+static psd::Image solid_image(uint32_t w, uint32_t h, uint8_t value)
+{
+    psd::Image image;
+    image.resize(w, h);
+    memset(image.pixels.data(), value, image.pixels.size());
+    return image;
+}
+
+// two caches on one directory, as two processes would use it, share its
+// size limit; entries come back as stored and the oldest go first
+static void test_disk_cache()
+{
+    string dir = make_temp_dir();
+    const uint64_t entry = 64 + 32*32*4, limit = 10*entry;
+    psd::DiskCache a(dir, limit), b(dir, limit);
+    psd::DiskCache::Key key;
+    key.operation = "test";
+    // neither cache alone writes past the limit
+    for(int i = 0; i < 12; i ++)
+    {
+        key.content_hash = i;
+        (i % 2 ? b : a).put(key, solid_image(32, 32, i));
+    }
+    check(a.size() <= limit, "cache: processes share the size limit");
+
+    psd::Image image;
+    key.content_hash = 11;
+    check(a.get(key, image) && image.w == 32 && image.h == 32 && image.pixels == solid_image(32, 32, 11).pixels, "cache: get returns what was put");
+    psd::DiskCache::Mapped mapped;
+    check(b.map(key, mapped) && mapped.w == 32 && mapped.pixels[0] == 11, "cache: map");
+    key.content_hash = 0;
+    check(!a.get(key, image), "cache: the oldest entries were evicted");
+
+    key.content_hash = 11;
+    uint64_t before = a.size();
+    check(a.remove(key) && !b.get(key, image) && a.size() == before - entry, "cache: remove");
+    key.content_hash = 10;
+    a.put(key, solid_image(32, 32, 1));
+    check(b.get(key, image) && image.pixels[0] == 1, "cache: put replaces an entry");
+    remove_dir(dir);
+}
+
+// planes exported from a document loaded without layer images, mapped
+// back through the sealed descriptor, hold the rows of a full load
+static void test_planes(psd::psd& doc, const string& bytes)
+{
+    psd::psd lazy;
+    psd::psd::LoadOptions options;
+    options.layer_images = false;
+    istringstream f(bytes);
+    lazy.load(f, options);
+    psd::MemfdProvider provider;
+    psd::SharedPlanes exported;
+    check(psd::export_planes(lazy, f, provider, exported), "planes: export");
+    check(pwrite(exported.buffer.fd, "x", 1, 0) < 0, "planes: the buffer is sealed");
+
+    psd::MappedPlanes mapped;
+    check(mapped.map(dup(exported.buffer.fd), exported.buffer.size, exported.planes), "planes: map");
+    size_t i = 0, bad = 0;
+    for(auto& l:doc.layers())
+        for(auto& c:l.channel_info_data)
+        {
+            if (i == mapped.planes.size() || mapped.planes[i].layer < 0)
+                break;
+            const psd::PlaneDesc& plane = mapped.planes[i];
+            for(uint32_t y = 0; y < plane.h; y ++)
+                bad += memcmp(mapped.row(i, y), c.data[y].data(), plane.w) != 0;
+            i ++;
+        }
+    check(bad == 0 && (i == mapped.planes.size() || mapped.planes[i].layer < 0), "planes: layer rows match a full load");
+}
+
+static void write_file(const string& path, const string& bytes)
+{
+    ofstream f(path, ios::binary);
+    f << bytes;
+}
+
+// a scan parses new and changed files only, drops removed ones, survives
+// a save and load, and answers queries on names, sizes and keys
+static void test_catalog(psd::psd& doc, const string& bytes)
+{
+    if (doc.layers().empty())
+        return;
+    string dir = make_temp_dir();
+    write_file(dir + "/a.psd", bytes);
+    write_file(dir + "/b.psd", bytes);
+    write_file(dir + "/c.psd", "not a document");
+
+    psd::Catalog catalog;
+    psd::Catalog::ScanStats stats = catalog.scan(dir, 2);
+    check(stats.files == 3 && stats.parsed == 3 && stats.failed == 1 && stats.reused == 0, "catalog: first scan parses every file");
+    auto& entries = catalog.entries();
+    psd::Layer& l = doc.layers()[0];
+    check(entries.size() == 3 && entries[0].ok && entries[0].width == doc.header.width && entries[0].height == doc.header.height
+        && entries[0].layers.size() == doc.layers().size() && entries[0].layers[0].name == l.utf8name && !entries[2].ok,
+        "catalog: entries hold the headers and layers");
+
+    write_file(dir + "/a.psd", bytes + "x");
+    unlink((dir + "/c.psd").c_str());
+    stats = catalog.scan(dir, 2);
+    check(stats.files == 2 && stats.parsed == 1 && stats.reused == 1 && stats.removed == 1, "catalog: rescan parses changed files only");
+
+    string index = dir + "/catalog.bin";
+    psd::Catalog loaded;
+    check(catalog.save(index) && loaded.load(index) && loaded.entries().size() == 2
+        && loaded.entries()[1].path == dir + "/b.psd" && loaded.entries()[1].layers[0].name == l.utf8name, "catalog: save and load");
+
+    psd::Catalog::Query query;
+    query.layer_name = l.utf8name;
+    for(auto& c:query.layer_name)
+        c = toupper((unsigned char)c);
+    bool names = l.utf8name.empty() || loaded.find(query).size() == 2;
+    query.layer_name = "no such layer";
+    check(names && loaded.find(query).empty(), "catalog: find by layer name");
+    query = psd::Catalog::Query();
+    query.min_width = doc.header.width + 1;
+    check(loaded.find(query).empty(), "catalog: find by size");
+    query = psd::Catalog::Query();
+    query.keys.push_back(psd::Catalog::key("zzzz"));
+    bool keys = loaded.find(query).empty();
+    if (!l.additional_extra_data.empty())
+    {
+        query.keys[0] = l.additional_extra_data[0].key.sig;
+        keys = keys && loaded.find(query).size() == 2;
+    }
+    check(keys, "catalog: find by key");
+    remove_dir(dir);
+}
+
+static string read_file(const string& path)
+{
+    ifstream f(path, ios::binary);
+    return f ? string((istreambuf_iterator<char>(f)), istreambuf_iterator<char>()) : string();
+}
+
+static psdexport::Output output(const char* spec)
+{
+    psdexport::Output o;
+    psdexport::Output::parse(spec, o);
+    return o;
+}
+
+// every output of one decode is written, once per task of the graph; a
+// deepzoom tile covering its whole level is the composite, however many
+// threads run under whatever budget, and a failed output fails the run
+// but not the others
+static void test_pipeline(psd::psd& doc, const string& path)
+{
+    psdexport::Output o;
+    check(psdexport::Output::parse("thumbnail:64=t.png", o) && o.kind == psdexport::Output::Thumbnail && o.size == 64 && o.path == "t.png"
+        && psdexport::Output::parse("deepzoom=dz", o) && o.size == 254 && !psdexport::Output::parse("thumbnail:-1=t.png", o)
+        && !psdexport::Output::parse("composite=", o) && !psdexport::Output::parse("bogus=x", o), "pipeline: output specs");
+
+    string dir = make_temp_dir();
+    uint32_t w = doc.header.width, h = doc.header.height;
+    size_t levels = 1;
+    for(uint32_t lw = w, lh = h; lw > 1 || lh > 1; lw = (lw + 1)/2, lh = (lh + 1)/2)
+        levels ++;
+    vector<psdexport::Output> outputs;
+    outputs.push_back(output(("composite=" + dir + "/c.png").c_str()));
+    outputs.push_back(output(("deepzoom:" + to_string(max(w, h)) + "=" + dir + "/dz").c_str()));
+    outputs.push_back(output(("layers=" + dir + "/layers").c_str()));
+    outputs.push_back(output(("metadata=" + dir + "/m.json").c_str()));
+    psdexport::Options options;
+    options.threads = 4;
+    psdexport::Report report;
+    bool ok = psdexport::run(path, outputs, options, report);
+    check(ok && report.errors.empty(), "pipeline: run");
+    // decode, the levels, the composite, one deepzoom row per level, every layer and the metadata
+    check(report.tasks == 1 + levels + 1 + levels + doc.layers().size() + 1, "pipeline: one task per product");
+    string composite = read_file(dir + "/c.png");
+    check(!composite.empty() && read_file(dir + "/dz_files/" + to_string(levels - 1) + "/0_0.png") == composite
+        && !read_file(dir + "/dz_files/0/0_0.png").empty() && !read_file(dir + "/dz.dzi").empty() && !read_file(dir + "/m.json").empty(),
+        "pipeline: outputs share the composite");
+
+    string serial = dir + "/serial.png";
+    outputs.assign(1, output(("composite=" + serial).c_str()));
+    options.threads = 4;
+    options.memory_budget = 1;
+    check(psdexport::run(path, outputs, options, report) && read_file(serial) == composite, "pipeline: a budget too small for any task still finishes");
+
+    outputs.assign(1, output(("composite=" + dir + "/missing/c.png").c_str()));
+    outputs.push_back(output(("metadata=" + dir + "/m2.json").c_str()));
+    check(!psdexport::run(path, outputs, options, report) && report.errors.size() == 1 && !read_file(dir + "/m2.json").empty(),
+        "pipeline: a failed output leaves the others");
+    check(!psdexport::run(dir + "/none.psd", outputs, options, report) && !report.errors.empty(), "pipeline: missing document");
+    remove_dir(dir);
+}
+
+// renders with a cached active layer, before and after editing it, match
+// a fresh compositor; region renders match the same crop of a full one
+static void test_cached_renders(psd::psd& doc)
+{
+    psd::Image full;
+    if (!psd::Compositor(doc).render(full))
+    {
+        check(false, "composite: render");
+        return;
+    }
+    psd::Rect region(full.h/4, full.w/3, full.h - full.h/5, full.w - full.w/6);
+    psd::Image part;
+    psd::Compositor(doc).render(part, region);
+    check(same_crop(full, part, region), "composite: region matches the full render");
+
+    int cached = 0;
+    bool ok = true;
+    for(size_t i = 0; i < doc.layers().size(); i ++)
+    {
+        psd::Compositor c(doc);
+        if (!c.set_active_layer(i))
+            continue;
+        cached ++;
+        psd::Image out, ref;
+        c.render(out);
+        ok = ok && same(out, full);
+
+        psd::ImageData* d = doc.layers()[i].get_channel_info_by_id(0);
+        if (d == nullptr || !d->has_pixels())
+            continue;
+        vector<vector<char>> saved = d->data;
+        for(uint32_t y = 0; y < d->h; y += 2)
+            for(uint32_t x = 0; x < d->w; x += 3)
+                d->set(x, y, d->data[y][x] + 40);
+        c.render(out);
+        psd::Compositor fresh(doc);
+        fresh.render(ref);
+        ok = ok && same(out, ref);
+        c.render(out, region);
+        fresh.render(ref, region);
+        ok = ok && same(out, ref);
+        d->data.swap(saved);
+        d->mark_dirty(0, d->h);
+    }
+    check(ok, "composite: cached renders match fresh ones");
+    cout << "     " << cached << " layers could be cached" << endl;
+}
+
+// tiled channels read back as the rows they came from, write back only
+// edited rows, and render like the rows do
+static void test_tiles(psd::psd& doc)
+{
+    int32_t i = pixel_layer(doc);
+    if (i < 0)
+        return;
+    psd::Layer& l = doc.layers()[i];
+    psd::TiledImage tiles;
+    check(tiles.from_layer(l, 8), "tiles: from_layer");
+    psd::Rect b = tiles.bounds();
+    psd::Rect region(b.top - 3, b.left - 5, b.bottom + 2, b.right + 7);
+    uint32_t w = region.right - region.left, h = region.bottom - region.top;
+    bool ok = true;
+    for(size_t c = 0; c < tiles.channel_ids().size(); c ++)
+    {
+        psd::ImageData* d = l.get_channel_info_by_id(tiles.channel_ids()[c]);
+        vector<uint8_t> out((size_t)w*h, 1);
+        tiles.read(region, c, out.data(), w);
+        for(int32_t y = region.top; y < region.bottom; y ++)
+            for(int32_t x = region.left; x < region.right; x ++)
+            {
+                uint8_t v = out[(size_t)(y - region.top)*w + x - region.left];
+                if (x < b.left || x >= b.right || y < b.top || y >= b.bottom)
+                    ok = ok && v == 0;
+                else if (tiles.pixel(x, y, c))
+                    ok = ok && v == (uint8_t)d->data[y - b.top][x - b.left];
+                else
+                    ok = ok && v == 0;
+            }
+    }
+    check(ok, "tiles: read matches the rows, zeros outside the layer");
+
+    psd::Layer copy = l;
+    for(auto& d:copy.channel_info_data)
+        d.dirty_rows.clear();
+    bool same_rows = tiles.to_layer(copy);
+    for(auto id:tiles.channel_ids())
+        same_rows = same_rows && copy.get_channel_info_by_id(id)->data == l.get_channel_info_by_id(id)->data
+            && copy.get_channel_info_by_id(id)->dirty_rows.empty();
+    check(same_rows, "tiles: an unedited write back changes nothing");
+    for(uint32_t ty = 0; ty < tiles.tiles_y(); ty ++)
+        for(uint32_t tx = 0; tx < tiles.tiles_x(); tx ++)
+            if (uint8_t* p = tiles.tile(tx, ty))
+            {
+                p[0] ^= 0xff; // channel 0, first sample of the tile
+                tiles.to_layer(copy);
+                auto& dirty = copy.get_channel_info_by_id(tiles.channel_ids()[0])->dirty_rows;
+                check(dirty.size() == 1 && dirty[0].first == ty*8 && dirty[0].second == ty*8 + 1, "tiles: to_layer marks only the edited row");
+                tx = tiles.tiles_x();
+                ty = tiles.tiles_y();
+            }
+
+    psd::Compositor rows(doc), tiled(doc);
+    tiled.set_tile_size(16);
+    psd::Image a, t;
+    bool same_renders = rows.render(a) && tiled.render(t) && same(a, t);
+    psd::Rect part(a.h/3, a.w/4, a.h - a.h/4, a.w - a.w/5);
+    same_renders = same_renders && rows.render(a, part) && tiled.render(t, part) && same(a, t);
+    check(same_renders, "tiles: tiled layers render like rows");
+}
+
+// a resized document saves, reloads with the new size and renders the same
+static void test_resize(const string& bytes)
+{
+    psd::psd doc;
+    load(doc, bytes);
+    uint32_t w = max<uint32_t>(1, doc.header.width/2), h = max<uint32_t>(1, doc.header.height/3);
+    check(psd::resize(doc, w, h, psd::ResizeFilter::Bilinear, 2), "resize: resize");
+    psd::Image before, after;
+    psd::Compositor(doc).render(before);
+
+    psd::psd reloaded;
+    string resized = save(doc);
+    check(!resized.empty() && load(reloaded, resized), "resize: save and reload");
+    check(reloaded.header.width == w && reloaded.header.height == h, "resize: header size");
+    bool bounds = reloaded.layers().size() == doc.layers().size();
+    for(size_t i = 0; bounds && i < doc.layers().size(); i ++)
+    {
+        psd::Rect a = doc.layers()[i].bounds(), b = reloaded.layers()[i].bounds();
+        bounds = a.top == b.top && a.left == b.left && a.bottom == b.bottom && a.right == b.right
+            && (a.empty() || (a.left < (int32_t)w && a.top < (int32_t)h && a.right > 0 && a.bottom > 0));
+    }
+    check(bounds, "resize: layer bounds survive the round trip");
+    check(reloaded.merged_image.datas.empty() || (reloaded.merged_image.w == w && reloaded.merged_image.h == h), "resize: merged image size");
+    psd::Compositor(reloaded).render(after);
+    check(before.w == w && before.h == h && same(before, after), "resize: reloaded document renders the same");
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = argc > 1 ? argv[1] : "x.psd";
+    test_group_tree();
+    test_descriptor();
+    test_hash_modes();
+    test_disk_cache();
+
+    ifstream f(path, ios::binary);
+    string bytes((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+    psd::psd doc;
+    if (!load(doc, bytes))
+    {
+        cout << "read fail: " << path << endl;
+        return -1;
+    }
+    test_layer_table(doc);
+    test_group_images(doc, bytes);
+    test_layer_index(doc);
+    test_clipping(bytes);
+    test_diff(bytes);
+    test_planes(doc, bytes);
+    test_catalog(doc, bytes);
+    test_pipeline(doc, path);
+    test_cached_renders(doc);
+    test_tiles(doc);
+    test_resize(bytes);
+
+    cout << (failures ? "FAILED " : "passed ") << failures << endl;
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,352 @@
+#include "planes.h"
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace psd
+{
+    bool HeapProvider::allocate(uint64_t size, PlaneBuffer& buffer)
+    {
+        buffer.data = (uint8_t*)malloc(size ? size : 1);
+        buffer.size = size;
+        buffer.fd = -1;
+        return buffer.data != nullptr;
+    }
+
+    void HeapProvider::free(PlaneBuffer& buffer)
+    {
+        ::free(buffer.data);
+        buffer = PlaneBuffer();
+    }
+
+    bool MemfdProvider::allocate(uint64_t size, PlaneBuffer& buffer)
+    {
+        int fd = memfd_create(name_.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0)
+        {
+            std::cerr << "memfd_create failed" << std::endl;
+            return false;
+        }
+        if (ftruncate(fd, size) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        void* data = size ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : nullptr;
+        if (data == MAP_FAILED)
+        {
+            ::close(fd);
+            return false;
+        }
+        buffer.data = (uint8_t*)data;
+        buffer.size = size;
+        buffer.fd = fd;
+        return true;
+    }
+
+    void MemfdProvider::seal(PlaneBuffer& buffer)
+    {
+        // F_SEAL_WRITE needs every shared mapping that could become writable
+        // gone, including read only ones; map again once sealed
+        if (buffer.size)
+            munmap(buffer.data, buffer.size);
+        if (fcntl(buffer.fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0)
+            std::cerr << "MemfdProvider: cannot seal buffer" << std::endl;
+        if (buffer.size)
+        {
+            void* data = mmap(nullptr, buffer.size, PROT_READ, MAP_SHARED, buffer.fd, 0);
+            buffer.data = data == MAP_FAILED ? nullptr : (uint8_t*)data;
+        }
+    }
+
+    void MemfdProvider::free(PlaneBuffer& buffer)
+    {
+        if (buffer.data && buffer.size)
+            munmap(buffer.data, buffer.size);
+        if (buffer.fd >= 0)
+            ::close(buffer.fd);
+        buffer = PlaneBuffer();
+    }
+
+    void SharedPlanes::reset()
+    {
+        if (provider_)
+            provider_->free(buffer);
+        provider_ = nullptr;
+        buffer = PlaneBuffer();
+        planes.clear();
+    }
+
+    static uint64_t align_up(uint64_t n, uint64_t alignment)
+    {
+        return (n + alignment - 1) / alignment * alignment;
+    }
+
+    static void copy_row(const std::vector<char>& row, uint8_t* dst, uint32_t row_bytes)
+    {
+        size_t n = std::min<size_t>(row.size(), row_bytes);
+        std::memcpy(dst, row.data(), n);
+        std::memset(dst + n, 0, row_bytes - n);
+    }
+
+    // one row at a time: raw rows are read into place, PackBits rows
+    // through a single row buffer
+    static bool decode_channel(std::istream& f, const Layer& layer, size_t slot, const PlaneDesc& plane, uint8_t* base)
+    {
+        f.clear();
+        f.seekg(layer.channel_pos(slot));
+        uint32_t row_bytes = (plane.w * plane.depth + 7) / 8;
+        ImageData::RowReader reader;
+        bool ok = reader.open(f, row_bytes, plane.h);
+        std::vector<char> packed, row;
+        for(uint32_t y = 0; ok && y < plane.h; y ++)
+        {
+            uint8_t* dst = base + plane.offset + (uint64_t)y*plane.stride;
+            if (reader.compression_method == 0)
+                ok = (bool)f.read((char*)dst, row_bytes);
+            else if ((ok = reader.next(packed) && ImageData::unpack_row(packed, row)))
+                copy_row(row, dst, row_bytes);
+        }
+        if (!ok)
+            std::cerr << "export_planes: cannot read channel " << plane.channel << " of " << layer.utf8name << std::endl;
+        return ok;
+    }
+
+    bool export_planes(psd& doc, std::istream* stream, BufferProvider& provider, SharedPlanes& out)
+    {
+        out.reset();
+        uint16_t depth = doc.header.bit_depth;
+
+        // layout: every plane 64 byte aligned, rows 16 byte aligned
+        uint64_t size = 0;
+        auto add_plane = [&](int32_t layer, int16_t channel, const Rect& bounds)
+        {
+            PlaneDesc p;
+            p.layer = layer;
+            p.channel = channel;
+            p.depth = depth;
+            p.bounds = bounds;
+            p.w = bounds.right > bounds.left ? bounds.right - bounds.left : 0;
+            p.h = bounds.bottom > bounds.top ? bounds.bottom - bounds.top : 0;
+            p.stride = align_up((p.w * depth + 7) / 8, 16);
+            p.offset = align_up(size, 64);
+            size = p.offset + (uint64_t)p.stride * p.h;
+            out.planes.push_back(p);
+        };
+        auto& layers = doc.layers();
+        for(size_t i = 0; i < layers.size(); i ++)
+        {
+            auto& l = layers[i];
+            if (!l.images_loaded() && stream == nullptr)
+            {
+                std::cerr << "export_planes: layer images not loaded: " << l.utf8name << std::endl;
+                return false;
+            }
+            for(auto& ci:l.channel_infos)
+            {
+                Rect r;
+                l.channel_bounds(ci.first, r.top, r.left, r.bottom, r.right);
+                add_plane(i, ci.first, r);
+            }
+        }
+        auto& merged = doc.merged_image;
+        for(size_t c = 0; c < merged.datas.size(); c ++)
+            add_plane(-1, c, Rect(0, 0, merged.h, merged.w));
+
+        if (!provider.allocate(size, out.buffer))
+        {
+            out.planes.clear();
+            return false;
+        }
+        out.provider_ = &provider;
+
+        size_t index = 0;
+        for(size_t i = 0; i < layers.size(); i ++)
+        {
+            auto& l = layers[i];
+            for(size_t slot = 0; slot < l.channel_infos.size(); slot ++)
+            {
+                const PlaneDesc& p = out.planes[index++];
+                uint32_t row_bytes = (p.w * p.depth + 7) / 8;
+                if (l.images_loaded() && l.channel_info_data[slot].has_pixels())
+                {
+                    auto& data = l.channel_info_data[slot].data;
+                    for(uint32_t y = 0; y < p.h && y < data.size(); y ++)
+                        copy_row(data[y], out.buffer.data + p.offset + (uint64_t)y*p.stride, row_bytes);
+                }
+                else if (stream == nullptr || !decode_channel(*stream, l, slot, p, out.buffer.data))
+                {
+                    out.reset();
+                    return false;
+                }
+            }
+        }
+        for(size_t c = 0; c < merged.datas.size(); c ++)
+        {
+            const PlaneDesc& p = out.planes[index++];
+            uint32_t row_bytes = (p.w * p.depth + 7) / 8;
+            for(uint32_t y = 0; y < p.h && y < merged.datas[c].size(); y ++)
+                copy_row(merged.datas[c][y], out.buffer.data + p.offset + (uint64_t)y*p.stride, row_bytes);
+        }
+
+        provider.seal(out.buffer);
+        return true;
+    }
+
+    bool export_planes(psd& doc, BufferProvider& provider, SharedPlanes& out)
+    {
+        return export_planes(doc, nullptr, provider, out);
+    }
+
+    bool export_planes(psd& doc, std::istream& stream, BufferProvider& provider, SharedPlanes& out)
+    {
+        return export_planes(doc, &stream, provider, out);
+    }
+
+    bool MappedPlanes::map(int fd, uint64_t size, const std::vector<PlaneDesc>& planes)
+    {
+        reset();
+        // the sender could otherwise change or truncate the buffer while it
+        // is read, faulting the mapping
+        int seals = fcntl(fd, F_GET_SEALS);
+        struct stat st;
+        bool ok = seals >= 0 && (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) == (F_SEAL_WRITE | F_SEAL_SHRINK) &&
+            fstat(fd, &st) == 0 && st.st_size >= 0 && (uint64_t)st.st_size >= size;
+        for(size_t i = 0; ok && i < planes.size(); i ++)
+        {
+            const PlaneDesc& p = planes[i];
+            ok = p.depth >= 1 && p.depth <= 32 && p.stride >= ((uint64_t)p.w * p.depth + 7) / 8 &&
+                p.offset <= size && (uint64_t)p.stride * p.h <= size - p.offset;
+        }
+        if (!ok)
+        {
+            ::close(fd);
+            return false;
+        }
+        void* base = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+        ::close(fd);
+        if (base == MAP_FAILED)
+            return false;
+        base_ = (const uint8_t*)base;
+        size_ = size;
+        this->planes = planes;
+        return true;
+    }
+
+    void MappedPlanes::reset()
+    {
+        if (base_ && size_)
+            munmap((void*)base_, size_);
+        base_ = nullptr;
+        size_ = 0;
+        planes.clear();
+    }
+
+    // native byte order; both ends run on the same machine
+    struct PlanesMessage
+    {
+        uint32_t magic; // "PSDP"
+        uint32_t count;
+        uint64_t size;
+    };
+
+    static const uint32_t planes_magic = 0x50445350; // "PSDP"
+    static const uint32_t max_planes = 1 << 22; // 65535 layers of 56 channels, plus the merged image
+
+    static bool write_all(int socket, const void* data, size_t size)
+    {
+        const char* p = (const char*)data;
+        while(size)
+        {
+            ssize_t n = ::send(socket, p, size, MSG_NOSIGNAL);
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static bool read_all(int socket, void* data, size_t size)
+    {
+        char* p = (char*)data;
+        while(size)
+        {
+            ssize_t n = ::recv(socket, p, size, 0);
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool send_planes(int socket, const SharedPlanes& planes)
+    {
+        if (planes.buffer.fd < 0)
+        {
+            std::cerr << "send_planes: buffer has no file descriptor" << std::endl;
+            return false;
+        }
+        PlanesMessage message;
+        message.magic = planes_magic;
+        message.count = planes.planes.size();
+        message.size = planes.buffer.size;
+
+        // the descriptor travels with the fixed header
+        struct iovec iov;
+        iov.iov_base = &message;
+        iov.iov_len = sizeof(message);
+        char control[CMSG_SPACE(sizeof(int))];
+        std::memset(control, 0, sizeof(control));
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &planes.buffer.fd, sizeof(int));
+        if (::sendmsg(socket, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(message))
+            return false;
+        return write_all(socket, planes.planes.data(), planes.planes.size() * sizeof(PlaneDesc));
+    }
+
+    bool receive_planes(int socket, MappedPlanes& planes)
+    {
+        PlanesMessage message;
+        struct iovec iov;
+        iov.iov_base = &message;
+        iov.iov_len = sizeof(message);
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (::recvmsg(socket, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL) != (ssize_t)sizeof(message))
+            return false;
+        int fd = -1;
+        for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        if (fd < 0)
+            return false;
+        bool valid = message.magic == planes_magic && message.count <= max_planes;
+        std::vector<PlaneDesc> descs(valid ? message.count : 0);
+        if (!valid || !read_all(socket, descs.data(), descs.size() * sizeof(PlaneDesc)))
+        {
+            ::close(fd);
+            return false;
+        }
+        return planes.map(fd, message.size, descs);
+    }
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "psd.h"
+
+namespace psd
+{
+    // memory that decoded planes are written into
+    struct PlaneBuffer
+    {
+        PlaneBuffer()
+            : data(nullptr), size(0), fd(-1)
+        {}
+        uint8_t* data;
+        uint64_t size;
+        int fd; // -1 if the memory cannot be shared with other processes
+    };
+
+    class BufferProvider
+    {
+    public:
+        virtual ~BufferProvider() {}
+        virtual bool allocate(uint64_t size, PlaneBuffer& buffer) = 0;
+        virtual void seal(PlaneBuffer&) {} // called once the planes are written
+        virtual void free(PlaneBuffer& buffer) = 0;
+    };
+
+    // malloc'ed memory, for use within one process
+    class HeapProvider : public BufferProvider
+    {
+    public:
+        bool allocate(uint64_t size, PlaneBuffer& buffer) override;
+        void free(PlaneBuffer& buffer) override;
+    };
+
+    // Linux memfd; seal() drops the writable mapping and seals the file
+    // against writes and resizing, which MappedPlanes::map checks for
+    class MemfdProvider : public BufferProvider
+    {
+    public:
+        explicit MemfdProvider(const std::string& name = "psdlite-planes")
+            : name_(name)
+        {}
+        bool allocate(uint64_t size, PlaneBuffer& buffer) override;
+        void seal(PlaneBuffer& buffer) override;
+        void free(PlaneBuffer& buffer) override;
+
+    private:
+        std::string name_;
+    };
+
+    // where one decoded channel lives in a buffer
+    struct PlaneDesc
+    {
+        int32_t layer; // index into layers(), -1 for the merged image
+        int16_t channel; // channel ID; merged image channels are numbered from 0
+        uint16_t depth; // bits per sample
+        Rect bounds; // document coordinates
+        uint32_t w;
+        uint32_t h;
+        uint32_t stride; // bytes between rows
+        uint64_t offset; // of the first row, from the start of the buffer
+    };
+
+    // the decoded planes of a document in one buffer
+    class SharedPlanes
+    {
+    public:
+        SharedPlanes()
+            : provider_(nullptr)
+        {}
+        ~SharedPlanes() { reset(); }
+        SharedPlanes(const SharedPlanes&) = delete;
+        SharedPlanes& operator = (const SharedPlanes&) = delete;
+
+        void reset();
+        const uint8_t* row(size_t plane, uint32_t y) const { return buffer.data + planes[plane].offset + (uint64_t)y*planes[plane].stride; }
+
+        PlaneBuffer buffer;
+        std::vector<PlaneDesc> planes;
+
+    private:
+        friend bool export_planes(psd& doc, std::istream* stream, BufferProvider& provider, SharedPlanes& out);
+        BufferProvider* provider_;
+    };
+
+    // Layer channels that are not loaded are decoded from stream, which must
+    // be the one the document was loaded from, into the buffer one row at a
+    // time; no channel is held whole outside it.
+    bool export_planes(psd& doc, BufferProvider& provider, SharedPlanes& out);
+    bool export_planes(psd& doc, std::istream& stream, BufferProvider& provider, SharedPlanes& out);
+
+    // read only view of planes exported by another process
+    class MappedPlanes
+    {
+    public:
+        MappedPlanes()
+            : base_(nullptr), size_(0)
+        {}
+        ~MappedPlanes() { reset(); }
+        MappedPlanes(const MappedPlanes&) = delete;
+        MappedPlanes& operator = (const MappedPlanes&) = delete;
+
+        // takes ownership of fd; fails unless fd is sealed against writes
+        // and shrinking, holds size bytes and every plane fits inside them
+        bool map(int fd, uint64_t size, const std::vector<PlaneDesc>& planes);
+        void reset();
+        const uint8_t* row(size_t plane, uint32_t y) const { return base_ + planes[plane].offset + (uint64_t)y*planes[plane].stride; }
+
+        std::vector<PlaneDesc> planes;
+
+    private:
+        const uint8_t* base_;
+        uint64_t size_;
+    };
+
+    // plane descriptions and the buffer's descriptor over a Unix socket
+    bool send_planes(int socket, const SharedPlanes& planes);
+    bool receive_planes(int socket, MappedPlanes& planes);
+}
@@ -1,5 +1,9 @@
 #include "psd.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
+#include <cstdlib>
 #include <sstream>
 
 #define PSD_DEBUG
@@ -12,6 +16,131 @@ namespace psd
         return (size + padding-1)/padding*padding;
     }
 
+    static const uint64_t prime64_1 = 11400714785074694791ULL;
+    static const uint64_t prime64_2 = 14029467366897019727ULL;
+    static const uint64_t prime64_3 = 1609587929392839161ULL;
+    static const uint64_t prime64_4 = 9650029242287828579ULL;
+    static const uint64_t prime64_5 = 2870177450012600261ULL;
+
+    static inline uint64_t rotl64(uint64_t x, int r)
+    {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static inline uint64_t read64(const uint8_t* p)
+    {
+        uint64_t x;
+        std::copy(p, p+8, (uint8_t*)&x);
+        return x;
+    }
+
+    static inline uint32_t read32(const uint8_t* p)
+    {
+        uint32_t x;
+        std::copy(p, p+4, (uint8_t*)&x);
+        return x;
+    }
+
+    static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+    {
+        acc += input * prime64_2;
+        acc = rotl64(acc, 31);
+        return acc * prime64_1;
+    }
+
+    static inline uint64_t xxh64_merge(uint64_t acc, uint64_t v)
+    {
+        acc ^= xxh64_round(0, v);
+        return acc * prime64_1 + prime64_4;
+    }
+
+    Hasher::Hasher(uint64_t seed)
+        : seed(seed), total(0), buffered(0)
+    {
+        v[0] = seed + prime64_1 + prime64_2;
+        v[1] = seed + prime64_2;
+        v[2] = seed;
+        v[3] = seed - prime64_1;
+    }
+
+    void Hasher::update(const void* data, size_t size)
+    {
+        const uint8_t* p = (const uint8_t*)data;
+        const uint8_t* end = p + size;
+        total += size;
+        if (buffered + size < 32)
+        {
+            std::copy(p, end, buffer + buffered);
+            buffered += size;
+            return;
+        }
+        if (buffered)
+        {
+            std::copy(p, p + (32 - buffered), buffer + buffered);
+            p += 32 - buffered;
+            for(int i = 0; i < 4; i ++)
+                v[i] = xxh64_round(v[i], read64(buffer + i*8));
+            buffered = 0;
+        }
+        uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+        for(; end - p >= 32; p += 32)
+        {
+            v0 = xxh64_round(v0, read64(p));
+            v1 = xxh64_round(v1, read64(p+8));
+            v2 = xxh64_round(v2, read64(p+16));
+            v3 = xxh64_round(v3, read64(p+24));
+        }
+        v[0] = v0; v[1] = v1; v[2] = v2; v[3] = v3;
+        std::copy(p, end, buffer);
+        buffered = end - p;
+    }
+
+    uint64_t Hasher::digest() const
+    {
+        uint64_t h;
+        if (total >= 32)
+        {
+            h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+            for(int i = 0; i < 4; i ++)
+                h = xxh64_merge(h, v[i]);
+        }
+        else
+            h = seed + prime64_5;
+        h += total;
+
+        const uint8_t* p = buffer;
+        const uint8_t* end = buffer + buffered;
+        for(; end - p >= 8; p += 8)
+        {
+            h ^= xxh64_round(0, read64(p));
+            h = rotl64(h, 27) * prime64_1 + prime64_4;
+        }
+        if (end - p >= 4)
+        {
+            h ^= (uint64_t)read32(p) * prime64_1;
+            h = rotl64(h, 23) * prime64_2 + prime64_3;
+            p += 4;
+        }
+        for(; p < end; p ++)
+        {
+            h ^= (*p) * prime64_5;
+            h = rotl64(h, 11) * prime64_1;
+        }
+        h ^= h >> 33;
+        h *= prime64_2;
+        h ^= h >> 29;
+        h *= prime64_3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    uint64_t hash64(const void* data, size_t size, uint64_t seed)
+    {
+        Hasher hasher(seed);
+        hasher.update(data, size);
+        return hasher.digest();
+    }
+
     uint32_t ImageResourceBlock::size() const
     {
         return 
@@ -97,11 +226,729 @@ namespace psd
     }
 
     psd::psd()
-        : valid_(false)
+        : valid_(false), merged_image_skipped_(false), block_data_skipped_(false), resolution_info_parsed_(false), has_resolution_info_(false)
+    {
+    }
+
+    bool ResolutionInfo::read(Slice s)
+    {
+        if (s.size < 16)
+            return false;
+        h_res = (uint32_t)*(be<uint32_t>*)(s.data+0) / 65536.0;
+        h_res_unit = *(be<uint16_t>*)(s.data+4);
+        width_unit = *(be<uint16_t>*)(s.data+6);
+        v_res = (uint32_t)*(be<uint32_t>*)(s.data+8) / 65536.0;
+        v_res_unit = *(be<uint16_t>*)(s.data+12);
+        height_unit = *(be<uint16_t>*)(s.data+14);
+        return true;
+    }
+
+    static inline uint32_t tag(const char* s)
+    {
+        return *(const uint32_t*)s;
+    }
+
+    static bool read_u32(const char*& p, const char* end, uint32_t& x)
+    {
+        if (end - p < 4)
+            return false;
+        x = *(be<uint32_t>*)p;
+        p += 4;
+        return true;
+    }
+
+    // 4 byte length then bytes, or 0 then a 4 byte ID
+    static bool read_descriptor_key(const char*& p, const char* end, Slice& key)
+    {
+        uint32_t length;
+        if (!read_u32(p, end, length))
+            return false;
+        if (length == 0)
+            length = 4;
+        if ((uint64_t)(end - p) < length)
+            return false;
+        key = Slice(p, length);
+        p += length;
+        return true;
+    }
+
+    static bool skip_unicode_string(const char*& p, const char* end)
+    {
+        uint32_t count;
+        if (!read_u32(p, end, count))
+            return false;
+        if ((uint64_t)(end - p) < (uint64_t)count*2)
+            return false;
+        p += count*2;
+        return true;
+    }
+
+    static std::string utf16be_to_utf8(const char* p, uint32_t count)
+    {
+        std::string out;
+        for(uint32_t i = 0; i < count; i ++)
+        {
+            uint32_t wc = *(be<uint16_t>*)(p+i*2);
+            if (wc >= 0xD800 && wc < 0xDC00 && i+1 < count)
+            {
+                uint32_t lo = *(be<uint16_t>*)(p+i*2+2);
+                if (lo >= 0xDC00 && lo < 0xE000)
+                {
+                    wc = 0x10000 + ((wc - 0xD800) << 10) + (lo - 0xDC00);
+                    i ++;
+                }
+            }
+            if (wc == 0 && i+1 == count)
+                break;
+            if (wc < 0x80)
+                out += (char)wc;
+            else if (wc < 0x800)
+            {
+                out += (char)(0xC0 + (wc>>6));
+                out += (char)(0x80 + (wc & 0x3F));
+            }
+            else if (wc < 0x10000)
+            {
+                out += (char)(0xE0 + (wc>>12));
+                out += (char)(0x80 + ((wc>>6) & 0x3F));
+                out += (char)(0x80 + (wc & 0x3F));
+            }
+            else
+            {
+                out += (char)(0xF0 + (wc>>18));
+                out += (char)(0x80 + ((wc>>12) & 0x3F));
+                out += (char)(0x80 + ((wc>>6) & 0x3F));
+                out += (char)(0x80 + (wc & 0x3F));
+            }
+        }
+        return out;
+    }
+
+    static bool skip_descriptor_value(uint32_t type, const char*& p, const char* end);
+
+    static bool skip_descriptor(const char*& p, const char* end)
+    {
+        Slice key;
+        uint32_t count;
+        if (!skip_unicode_string(p, end) ||
+            !read_descriptor_key(p, end, key) ||
+            !read_u32(p, end, count))
+            return false;
+        for(uint32_t i = 0; i < count; i ++)
+        {
+            if (!read_descriptor_key(p, end, key) || end - p < 4)
+                return false;
+            uint32_t type = tag(p);
+            p += 4;
+            if (!skip_descriptor_value(type, p, end))
+                return false;
+        }
+        return true;
+    }
+
+    static bool skip_reference(const char*& p, const char* end)
+    {
+        uint32_t count;
+        if (!read_u32(p, end, count))
+            return false;
+        Slice key;
+        for(uint32_t i = 0; i < count; i ++)
+        {
+            if (end - p < 4)
+                return false;
+            uint32_t type = tag(p);
+            p += 4;
+            if (type == tag("prop"))
+            {
+                if (!skip_unicode_string(p, end) || !read_descriptor_key(p, end, key) || !read_descriptor_key(p, end, key))
+                    return false;
+            }
+            else if (type == tag("Clss"))
+            {
+                if (!skip_unicode_string(p, end) || !read_descriptor_key(p, end, key))
+                    return false;
+            }
+            else if (type == tag("Enmr"))
+            {
+                if (!skip_unicode_string(p, end) || !read_descriptor_key(p, end, key) ||
+                    !read_descriptor_key(p, end, key) || !read_descriptor_key(p, end, key))
+                    return false;
+            }
+            else if (type == tag("rele"))
+            {
+                if (!skip_unicode_string(p, end) || !read_descriptor_key(p, end, key) || end - p < 4)
+                    return false;
+                p += 4;
+            }
+            else if (type == tag("Idnt") || type == tag("indx"))
+            {
+                if (end - p < 4)
+                    return false;
+                p += 4;
+            }
+            else if (type == tag("name"))
+            {
+                if (!skip_unicode_string(p, end))
+                    return false;
+            }
+            else
+                return false;
+        }
+        return true;
+    }
+
+    static bool skip_bytes(const char*& p, const char* end, uint64_t n)
+    {
+        if ((uint64_t)(end - p) < n)
+            return false;
+        p += n;
+        return true;
+    }
+
+    static bool skip_descriptor_value(uint32_t type, const char*& p, const char* end)
+    {
+        Slice key;
+        uint32_t n;
+        if (type == tag("Objc") || type == tag("GlbO"))
+            return skip_descriptor(p, end);
+        if (type == tag("ObAr"))
+            return skip_bytes(p, end, 4) && skip_descriptor(p, end);
+        if (type == tag("VlLs"))
+        {
+            if (!read_u32(p, end, n))
+                return false;
+            for(uint32_t i = 0; i < n; i ++)
+            {
+                if (end - p < 4)
+                    return false;
+                uint32_t item_type = tag(p);
+                p += 4;
+                if (!skip_descriptor_value(item_type, p, end))
+                    return false;
+            }
+            return true;
+        }
+        if (type == tag("doub") || type == tag("comp"))
+            return skip_bytes(p, end, 8);
+        if (type == tag("UntF"))
+            return skip_bytes(p, end, 12);
+        if (type == tag("UnFl"))
+            return skip_bytes(p, end, 4) && read_u32(p, end, n) && skip_bytes(p, end, (uint64_t)n*8);
+        if (type == tag("long"))
+            return skip_bytes(p, end, 4);
+        if (type == tag("bool"))
+            return skip_bytes(p, end, 1);
+        if (type == tag("TEXT"))
+            return skip_unicode_string(p, end);
+        if (type == tag("enum"))
+            return read_descriptor_key(p, end, key) && read_descriptor_key(p, end, key);
+        if (type == tag("type") || type == tag("GlbC") || type == tag("Clss"))
+            return skip_unicode_string(p, end) && read_descriptor_key(p, end, key);
+        if (type == tag("obj "))
+            return skip_reference(p, end);
+        if (type == tag("tdta") || type == tag("alis") || type == tag("Pth "))
+            return read_u32(p, end, n) && skip_bytes(p, end, n);
+#ifdef PSD_DEBUG
+        std::cout << "Unknown descriptor value type: " << std::string((const char*)&type, 4) << std::endl;
+#endif
+        return false;
+    }
+
+    bool Descriptor::read(Slice s, size_t offset)
+    {
+        begin_ = items_ = nullptr;
+        end_ = nullptr;
+        count_ = 0;
+        if (offset > s.size)
+            return false;
+        const char* p = s.data + offset;
+        const char* end = s.data + s.size;
+        Slice key;
+        uint32_t count;
+        if (!skip_unicode_string(p, end) ||
+            !read_descriptor_key(p, end, key) ||
+            !read_u32(p, end, count))
+            return false;
+        const char* items_end = p;
+        begin_ = s.data + offset;
+        items_ = p;
+        count_ = count;
+        // end at the last item, so next() does not run on into whatever
+        // follows the descriptor in s (e.g. the warp data of TySh)
+        for(uint32_t i = 0; i < count; i ++)
+        {
+            if (!read_descriptor_key(p, end, key) || end - p < 4)
+                break;
+            uint32_t type = tag(p);
+            p += 4;
+            if (!skip_descriptor_value(type, p, end))
+                break;
+            items_end = p;
+        }
+        end_ = items_end;
+        return true;
+    }
+
+    std::string Descriptor::name() const
+    {
+        if (!valid())
+            return std::string();
+        uint32_t count = *(be<uint32_t>*)begin_;
+        return utf16be_to_utf8(begin_+4, count);
+    }
+
+    Slice Descriptor::class_id() const
+    {
+        if (!valid())
+            return Slice();
+        const char* p = begin_;
+        Slice key;
+        skip_unicode_string(p, end_);
+        read_descriptor_key(p, end_, key);
+        return key;
+    }
+
+    bool Descriptor::next(const char*& cursor, Slice& key, DescriptorValue& value) const
+    {
+        if (!valid() || cursor == nullptr || cursor >= end_)
+            return false;
+        const char* p = cursor;
+        if (!read_descriptor_key(p, end_, key) || end_ - p < 4)
+            return false;
+        uint32_t type = tag(p);
+        p += 4;
+        const char* data = p;
+        if (!skip_descriptor_value(type, p, end_))
+            return false;
+        value = DescriptorValue(Signature(type), data, p);
+        cursor = p;
+        return true;
+    }
+
+    const char* Descriptor::end() const
+    {
+        const char* p = items_;
+        Slice key;
+        DescriptorValue value;
+        for(uint32_t i = 0; i < count_; i ++)
+            if (!next(p, key, value))
+                return nullptr;
+        return p;
+    }
+
+    DescriptorValue Descriptor::get(const std::string& key) const
+    {
+        const char* p = items_;
+        Slice k;
+        DescriptorValue value;
+        for(uint32_t i = 0; i < count_; i ++)
+        {
+            if (!next(p, k, value))
+                break;
+            if (k.size == key.size() && std::equal(k.data, k.data+k.size, key.data()))
+                return value;
+        }
+        return DescriptorValue();
+    }
+
+    DescriptorValue Descriptor::find(const std::string& path) const
+    {
+        Descriptor d = *this;
+        DescriptorValue value;
+        size_t pos = 0;
+        while(pos <= path.size())
+        {
+            size_t slash = path.find('/', pos);
+            if (slash == std::string::npos)
+                slash = path.size();
+            std::string part = path.substr(pos, slash-pos);
+            pos = slash+1;
+
+            if (value.valid() && value.type == "VlLs")
+            {
+                char* e = nullptr;
+                unsigned long index = std::strtoul(part.c_str(), &e, 10);
+                if (part.empty() || *e != 0)
+                    return DescriptorValue();
+                value = value.at(index);
+            }
+            else
+            {
+                if (value.valid())
+                    d = value.as_descriptor();
+                if (!d.valid())
+                    return DescriptorValue();
+                value = d.get(part);
+            }
+            if (!value.valid())
+                return value;
+        }
+        return value;
+    }
+
+    double DescriptorValue::as_double(double def) const
+    {
+        if (type == "doub" && end_ - data_ == 8)
+        {
+            be<uint64_t> x = *(be<uint64_t>*)data_;
+            uint64_t bits = x;
+            double d;
+            std::copy((const char*)&bits, (const char*)&bits+8, (char*)&d);
+            return d;
+        }
+        if (type == "UntF" && end_ - data_ == 12)
+            return DescriptorValue(Signature("doub"), data_+4, end_).as_double(def);
+        if (type == "long" || type == "comp")
+            return (double)as_int();
+        return def;
+    }
+
+    int64_t DescriptorValue::as_int(int64_t def) const
+    {
+        if (type == "long" && end_ - data_ == 4)
+            return (int32_t)*(be<int32_t>*)data_;
+        if (type == "comp" && end_ - data_ == 8)
+            return (int64_t)*(be<int64_t>*)data_;
+        if (type == "doub" || type == "UntF")
+            return (int64_t)as_double();
+        return def;
+    }
+
+    bool DescriptorValue::as_bool(bool def) const
+    {
+        if (type == "bool" && end_ - data_ == 1)
+            return *data_ != 0;
+        return def;
+    }
+
+    std::string DescriptorValue::as_string() const
+    {
+        if (type == "TEXT")
+        {
+            uint32_t count = *(be<uint32_t>*)data_;
+            return utf16be_to_utf8(data_+4, count);
+        }
+        if (type == "enum")
+        {
+            Slice v = enum_value();
+            return std::string(v.data, v.size);
+        }
+        if (type == "type" || type == "GlbC" || type == "Clss")
+        {
+            const char* p = data_;
+            Slice key;
+            if (skip_unicode_string(p, end_) && read_descriptor_key(p, end_, key))
+                return std::string(key.data, key.size);
+        }
+        return std::string();
+    }
+
+    Signature DescriptorValue::unit() const
+    {
+        if (type == "UntF" && end_ - data_ == 12)
+            return Signature(tag(data_));
+        return Signature();
+    }
+
+    Slice DescriptorValue::raw() const
+    {
+        if ((type == "tdta" || type == "alis" || type == "Pth ") && end_ - data_ >= 4)
+            return Slice(data_+4, end_-data_-4);
+        return Slice();
+    }
+
+    Slice DescriptorValue::enum_type() const
+    {
+        const char* p = data_;
+        Slice key;
+        if (type == "enum" && read_descriptor_key(p, end_, key))
+            return key;
+        return Slice();
+    }
+
+    Slice DescriptorValue::enum_value() const
+    {
+        const char* p = data_;
+        Slice key;
+        if (type == "enum" && read_descriptor_key(p, end_, key) && read_descriptor_key(p, end_, key))
+            return key;
+        return Slice();
+    }
+
+    Descriptor DescriptorValue::as_descriptor() const
+    {
+        Descriptor d;
+        if (type == "Objc" || type == "GlbO")
+            d.read(Slice(data_, end_-data_));
+        else if (type == "ObAr")
+            d.read(Slice(data_, end_-data_), 4);
+        return d;
+    }
+
+    const char* DescriptorValue::list_begin() const
+    {
+        if (type != "VlLs" || end_ - data_ < 4)
+            return nullptr;
+        return data_+4;
+    }
+
+    uint32_t DescriptorValue::list_size() const
+    {
+        if (list_begin() == nullptr)
+            return 0;
+        return *(be<uint32_t>*)data_;
+    }
+
+    bool DescriptorValue::next(const char*& cursor, DescriptorValue& value) const
+    {
+        if (cursor == nullptr || end_ - cursor < 4)
+            return false;
+        const char* p = cursor;
+        uint32_t item_type = tag(p);
+        p += 4;
+        const char* data = p;
+        if (!skip_descriptor_value(item_type, p, end_))
+            return false;
+        value = DescriptorValue(Signature(item_type), data, p);
+        cursor = p;
+        return true;
+    }
+
+    DescriptorValue DescriptorValue::at(uint32_t i) const
+    {
+        if (i >= list_size())
+            return DescriptorValue();
+        const char* p = list_begin();
+        DescriptorValue value;
+        for(uint32_t j = 0; j <= i; j ++)
+            if (!next(p, value))
+                return DescriptorValue();
+        return value;
+    }
+
+    Descriptor Layer::get_descriptor(Signature key)
+    {
+        static const struct
+        {
+            Signature key;
+            uint32_t offset; // bytes of version fields before the descriptor
+        } offsets[] = {
+            {Signature("lfx2"), 8}, {Signature("lmfx"), 8},
+            {Signature("SoLd"), 12}, {Signature("SoLE"), 12},
+            {Signature("TySh"), 2+6*8+2+4},
+            {Signature("SoCo"), 4}, {Signature("GdFl"), 4}, {Signature("PtFl"), 4},
+            {Signature("vstk"), 4}, {Signature("vscg"), 8}, {Signature("vogk"), 8},
+            {Signature("artb"), 4}, {Signature("artd"), 4}, {Signature("abdd"), 4},
+            {Signature("CgEd"), 4}, {Signature("pths"), 4},
+        };
+        Descriptor d;
+        ExtraData* ed = get_extra_data(key);
+        if (ed == nullptr)
+            return d;
+        for(auto& o:offsets)
+        {
+            if (o.key.sig == key.sig)
+            {
+                d.read(ed->slice(), o.offset);
+                break;
+            }
+        }
+        return d;
+    }
+
+    static bool read_u64(const char*& p, const char* end, uint64_t& x)
+    {
+        if (end - p < 8)
+            return false;
+        x = *(be<uint64_t>*)p;
+        p += 8;
+        return true;
+    }
+
+    // lnk2/lnkD/lnk3: 8 byte length prefixed entries, padded to 4 bytes
+    static bool read_linked_files(Slice block, std::vector<LinkedFile>& files)
+    {
+        const char* p = block.data;
+        const char* end = block.data + block.size;
+        while(end - p >= 8)
+        {
+            uint64_t length;
+            read_u64(p, end, length);
+            if (length == 0)
+                break;
+            if ((uint64_t)(end - p) < length)
+                return false;
+            const char* entry_end = p + length;
+            const char* q = p;
+
+            LinkedFile lf;
+            uint32_t sig;
+            uint8_t id_length;
+            Slice key;
+            if (!read_u32(q, entry_end, sig) || !read_u32(q, entry_end, lf.version) || entry_end - q < 1)
+                return false;
+            lf.type = be<uint32_t>(sig).x;
+            id_length = (uint8_t)*q++;
+            if (entry_end - q < id_length)
+                return false;
+            lf.unique_id.assign(q, id_length);
+            q += id_length;
+
+            const char* name = q;
+            if (!skip_unicode_string(q, entry_end))
+                return false;
+            lf.filename = utf16be_to_utf8(name+4, *(be<uint32_t>*)name);
+            if (entry_end - q < 8)
+                return false;
+            lf.file_type = tag(q);
+            lf.file_creator = tag(q+4);
+            q += 8;
+            if (!read_u64(q, entry_end, lf.file_size) || entry_end - q < 1)
+                return false;
+            bool has_open_descriptor = *q++ != 0;
+            if (has_open_descriptor && !(skip_bytes(q, entry_end, 4) && skip_descriptor(q, entry_end)))
+                return false;
+
+            if (lf.type == "liFE")
+            {
+                if (!skip_bytes(q, entry_end, 4) || !skip_descriptor(q, entry_end))
+                    return false;
+                if (lf.version > 3 && !skip_bytes(q, entry_end, 4+4+8))
+                    return false;
+                if (!read_u64(q, entry_end, lf.file_size))
+                    return false;
+                if (lf.version > 2 && (uint64_t)(entry_end - q) >= lf.file_size)
+                    lf.data = Slice(q, lf.file_size);
+            }
+            else if (lf.type == "liFD")
+            {
+                if ((uint64_t)(entry_end - q) < lf.file_size)
+                    return false;
+                lf.data = Slice(q, lf.file_size);
+            }
+            files.push_back(std::move(lf));
+
+            p = entry_end;
+            while((p - block.data) % 4 != 0 && p < end)
+                p ++;
+        }
+        return true;
+    }
+
+    std::vector<std::pair<Signature, Slice>> psd::additional_layer_blocks() const
+    {
+        std::vector<std::pair<Signature, Slice>> blocks;
+        const char* begin = additional_layer_data.data();
+        const char* p = begin;
+        const char* end = begin + additional_layer_data.size();
+        while(end - p >= 12)
+        {
+            if (tag(p) != tag("8BIM") && tag(p) != tag("8B64"))
+                break;
+            Signature key(tag(p+4));
+            uint32_t length = *(be<uint32_t>*)(p+8);
+            p += 12;
+            if ((uint64_t)(end - p) < length)
+                break;
+            blocks.emplace_back(key, Slice(p, length));
+            p += length;
+            while((p - begin) % 4 != 0 && p < end && *p == 0)
+                p ++;
+        }
+        return blocks;
+    }
+
+    std::vector<LinkedFile> psd::linked_files()
+    {
+        std::vector<LinkedFile> files;
+        static const char* keys[] = { "lnk2", "lnkD", "lnk3" };
+        for(auto& b:additional_layer_blocks())
+        {
+            for(auto key:keys)
+            {
+                if (b.first == key && !read_linked_files(b.second, files))
+                {
+                    std::cerr << "Cannot read linked files: " << key << std::endl;
+                    break;
+                }
+            }
+        }
+        for(auto key:keys)
+        {
+            for(auto i:layer_info.find_layers_with_key(Signature(key)))
+            {
+                for(auto& ed:layers()[i].additional_extra_data)
+                {
+                    if (ed.key == key && !read_linked_files(ed.slice(), files))
+                        std::cerr << "Cannot read linked files: " << key << std::endl;
+                }
+            }
+        }
+        return files;
+    }
+
+    std::string Layer::smart_object_id()
+    {
+        Descriptor d = get_descriptor(Signature("SoLd"));
+        if (d.valid())
+            return d.get("Idnt").as_string();
+        ExtraData* ed = get_extra_data(Signature("PlLd"));
+        if (ed != nullptr && ed->data.size() > 8)
+        {
+            uint8_t length = ed->data[8];
+            if (ed->data.size() >= 9u + length)
+                return std::string(&ed->data[9], length);
+        }
+        return std::string();
+    }
+
+    void psd::build_image_resource_index()
     {
+        image_resource_index.clear();
+        for(size_t i = 0; i < image_resources.size(); i ++)
+            image_resource_index.emplace(image_resources[i].image_resource_id, i);
+        resolution_info_parsed_ = false;
+    }
+
+    ImageResourceBlock* psd::get_image_resource(uint16_t id)
+    {
+        auto it = image_resource_index.find(id);
+        if (it == image_resource_index.end() ||
+            it->second >= image_resources.size() ||
+            image_resources[it->second].image_resource_id != id)
+            return nullptr;
+        return &image_resources[it->second];
+    }
+
+    const ResolutionInfo* psd::resolution_info()
+    {
+        if (!resolution_info_parsed_)
+        {
+            resolution_info_parsed_ = true;
+            ImageResourceBlock* b = get_image_resource(1005);
+            has_resolution_info_ = b != nullptr && resolution_info_.read(b->slice());
+        }
+        return has_resolution_info_ ? &resolution_info_ : nullptr;
+    }
+
+    Slice psd::icc_profile()
+    {
+        ImageResourceBlock* b = get_image_resource(1039);
+        return b ? b->slice() : Slice();
+    }
+
+    Slice psd::xmp()
+    {
+        ImageResourceBlock* b = get_image_resource(1060);
+        return b ? b->slice() : Slice();
     }
 
     bool psd::load(std::istream& stream)
+    {
+        return load(stream, LoadOptions());
+    }
+
+    bool psd::load(std::istream& stream, const LoadOptions& options)
     {
         valid_ = false;
         if (!read_header(stream))
@@ -110,15 +957,69 @@ namespace psd
             return false;
         if (!read_image_resources(stream))
             return false;
-        if (!read_layers_and_masks(stream))
+        if (!read_layers_and_masks(stream, options))
             return false;
-        if (!merged_image.read(stream, header.width, header.height, header.num_channels, header.bit_depth))
+        merged_image_skipped_ = !options.merged_image;
+        if (!options.merged_image)
+        {
+            merged_image = MultipleImageData();
+            merged_image.w = header.width;
+            merged_image.h = header.height;
+            merged_image.count = header.num_channels;
+            stream.read((char*)&merged_image.compression_method, 2);
+        }
+        else if (!merged_image.read(stream, header.width, header.height, header.num_channels, header.bit_depth))
             return false;
 
         valid_ = true;
         return true;
     }
 
+    // read only stream over memory, so a nested document can be loaded in place
+    class SliceStreamBuf : public std::streambuf
+    {
+    public:
+        SliceStreamBuf(Slice s)
+        {
+            char* p = const_cast<char*>(s.data);
+            setg(p, p, p + s.size);
+        }
+
+    protected:
+        pos_type seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which) override
+        {
+            char* base = eback();
+            off_type pos;
+            if (dir == std::ios::beg)
+                pos = off;
+            else if (dir == std::ios::cur)
+                pos = gptr() - base + off;
+            else
+                pos = egptr() - base + off;
+            if (pos < 0 || pos > egptr() - base)
+                return pos_type(off_type(-1));
+            setg(base, base + pos, egptr());
+            return pos_type(pos);
+        }
+
+        pos_type seekpos(pos_type pos, std::ios::openmode which) override
+        {
+            return seekoff(off_type(pos), std::ios::beg, which);
+        }
+    };
+
+    bool psd::load(Slice data)
+    {
+        return load(data, LoadOptions());
+    }
+
+    bool psd::load(Slice data, const LoadOptions& options)
+    {
+        SliceStreamBuf buf(data);
+        std::istream stream(&buf);
+        return load(stream, options);
+    }
+
     bool psd::read_header(std::istream& f)
     {
         f.seekg(0);
@@ -182,6 +1083,36 @@ namespace psd
         return true;
     }
 
+    Layer::LayerBlendingRanges::Range Layer::LayerBlendingRanges::source(size_t i) const
+    {
+        Range r = {0, 0, 255, 255};
+        if (i < count())
+        {
+            const char* p = &data[i*8];
+            r = Range{(uint8_t)p[0], (uint8_t)p[1], (uint8_t)p[2], (uint8_t)p[3]};
+        }
+        return r;
+    }
+
+    Layer::LayerBlendingRanges::Range Layer::LayerBlendingRanges::destination(size_t i) const
+    {
+        Range r = {0, 0, 255, 255};
+        if (i < count())
+        {
+            const char* p = &data[i*8+4];
+            r = Range{(uint8_t)p[0], (uint8_t)p[1], (uint8_t)p[2], (uint8_t)p[3]};
+        }
+        return r;
+    }
+
+    bool Layer::LayerBlendingRanges::is_default() const
+    {
+        for(size_t i = 0; i < count(); i ++)
+            if (!source(i).full() || !destination(i).full())
+                return false;
+        return true;
+    }
+
     bool Layer::LayerBlendingRanges::write(std::ostream& f)
     {
         be<uint32_t> size = data.size();
@@ -222,7 +1153,13 @@ namespace psd
         return true;
     }
 
-    bool Layer::read(std::istream& f)
+    // the extra data Layer::read() interprets
+    static bool layer_reads_key(Signature key)
+    {
+        return key == "luni" || key == "lyid" || key == "lsct" || key == "lsdk";
+    }
+
+    bool Layer::read(std::istream& f, bool block_data)
     {
         f.read((char*)&top, 4*4+2);
 #ifdef PSD_DEBUG
@@ -242,6 +1179,7 @@ namespace psd
                     ((uint32_t)buffer[5]<<0))
                 );
         }
+        build_channel_slots();
         f.read((char*)&blend_signature, 4*3+4);
 #ifdef PSD_DEBUG
         std::cout << "Blend Signature: " << std::string((char*)&blend_signature, (char*)&blend_signature+4) << std::endl;
@@ -290,7 +1228,7 @@ namespace psd
         while(f.tellg() - extra_start_pos < extra_data_length)
         {
             ExtraData ed;
-            if (!ed.read(f))
+            if (!ed.read(f, block_data ? nullptr : layer_reads_key))
             {
                 std::cerr << "fail to read ExtraData" << std::endl;
                 return false;
@@ -304,19 +1242,28 @@ namespace psd
             std::cout << std::endl;
 #endif
 
-        for(auto& ed:additional_extra_data)
-        {
+        build_extra_data_index();
 #ifdef PSD_DEBUG
+        for(auto& ed:additional_extra_data)
             std::cout << '\t' << (std::string)ed.key;
 #endif
-            if (ed.key == "luni")
-            {
-                ed.luni_read_name(wname, utf8name);
-            }
-            else if (ed.key == "TySh")
-            {
-                has_text = true;
-            }
+
+        ExtraData* ed;
+        if ((ed = get_extra_data(Signature("luni"))) != nullptr)
+            ed->luni_read_name(wname, utf8name);
+        has_text = get_extra_data(Signature("TySh")) != nullptr;
+        if ((ed = get_extra_data(Signature("lyid"))) != nullptr && ed->data.size() >= 4)
+        {
+            has_layer_id = true;
+            layer_id = *(be<uint32_t>*)&ed->data[0];
+        }
+        if ((ed = get_extra_data(Signature("lsct"))) == nullptr)
+            ed = get_extra_data(Signature("lsdk"));
+        if (ed != nullptr && ed->data.size() >= 4)
+        {
+            section_type = *(be<uint32_t>*)&ed->data[0];
+            if (ed->data.size() >= 12 && Signature(*(uint32_t*)&ed->data[4]) == "8BIM")
+                section_blend_key = *(uint32_t*)&ed->data[8];
         }
 
 #ifdef PSD_DEBUG
@@ -327,7 +1274,7 @@ namespace psd
         return true;
     }
 
-    bool ExtraData::read(std::istream& f)
+    bool ExtraData::read(std::istream& f, bool (*keep)(Signature key))
     {
         f.read((char*)&signature, 4);
         if (signature != "8BIM" && 
@@ -341,6 +1288,12 @@ namespace psd
 
         f.read((char*)&key, 4);
         f.read((char*)&length, 4);
+        if (keep && !keep(key))
+        {
+            data.clear();
+            f.seekg(length, std::ios::cur);
+            return true;
+        }
         data.resize(length);
         f.read(&data[0], length);
         return true;
@@ -388,6 +1341,11 @@ namespace psd
 
     bool Layer::write(std::ostream& f)
     {
+        if (!images_loaded())
+        {
+            std::cerr << "Layer images not loaded: " << utf8name << std::endl;
+            return false;
+        }
 #ifdef PSD_DEBUG
         if (num_channels != channel_infos.size())
             std::cout << "Image channel count: " << num_channels << " -> " << channel_infos.size() << std::endl;
@@ -398,12 +1356,13 @@ namespace psd
         int idx = 0;
         for(auto& ci:channel_infos)
         {
-            std::ostringstream image_buffer;
-            channel_info_data[idx++].write(image_buffer);
+            ImageData& id = channel_info_data[idx++];
+            if (!id.encode())
+                return false;
 #ifdef PSD_DEBUG
-            //std::cout << "Image channel size change: " << ci.second << " -> " << image_buffer.str().size() << std::endl;
+            //std::cout << "Image channel size change: " << ci.second << " -> " << id.encoded.size() << std::endl;
 #endif
-            ci.second = image_buffer.str().size();
+            ci.second = id.encoded.size();
 
             f.write((char*)&ci.first, 2);
             f.write((char*)&ci.second, 4);
@@ -455,13 +1414,121 @@ namespace psd
         return true;
     }
 
-    bool Layer::read_images(std::istream& f)
+    void Layer::build_extra_data_index()
+    {
+        extra_data_index.clear();
+        for(uint16_t i = 0; i < additional_extra_data.size(); i ++)
+            extra_data_index.emplace(additional_extra_data[i].key.sig, i);
+    }
+
+    ExtraData* Layer::get_extra_data(Signature key)
+    {
+        auto it = extra_data_index.find(key.sig);
+        if (it == extra_data_index.end() ||
+            it->second >= additional_extra_data.size() ||
+            additional_extra_data[it->second].key.sig != key.sig)
+            return nullptr;
+        return &additional_extra_data[it->second];
+    }
+
+    uint8_t Layer::fill_opacity()
+    {
+        ExtraData* ed = get_extra_data(Signature("iOpa"));
+        if (ed == nullptr || ed->data.empty())
+            return 255;
+        return (uint8_t)ed->data[0];
+    }
+
+    uint16_t Layer::sheet_color()
+    {
+        ExtraData* ed = get_extra_data(Signature("lclr"));
+        if (ed == nullptr || ed->data.size() < 2)
+            return 0;
+        return *(be<uint16_t>*)&ed->data[0];
+    }
+
+    uint32_t Layer::protection_flags()
+    {
+        ExtraData* ed = get_extra_data(Signature("lspf"));
+        if (ed == nullptr || ed->data.size() < 4)
+            return 0;
+        return *(be<uint32_t>*)&ed->data[0];
+    }
+
+    void Layer::build_channel_slots()
+    {
+        channel_slots.clear();
+        for(uint16_t i = 0; i < channel_infos.size(); i ++)
+            channel_slots[channel_infos[i].first] = i;
+    }
+
+    int64_t Layer::channel_pos(size_t slot) const
+    {
+        int64_t pos = images_pos;
+        for(size_t i = 0; i < slot && i < channel_infos.size(); i ++)
+            pos += channel_infos[i].second;
+        return pos;
+    }
+
+    int32_t Layer::LayerMask::real_offset() const
+    {
+        size_t offset = 0;
+        if (flags & 16)
+        {
+            // parameter flags, then user and vector mask density (1 byte)
+            // and feather (8 byte double) for each bit set
+            if (additional_data.empty())
+                return -1;
+            uint8_t parameters = additional_data[0];
+            offset = 1 + (parameters & 1 ? 1 : 0) + (parameters & 2 ? 8 : 0) + (parameters & 4 ? 1 : 0) + (parameters & 8 ? 8 : 0);
+        }
+        if (additional_data.size() < offset + 2+4*4)
+            return -1;
+        return (int32_t)offset;
+    }
+
+    void Layer::channel_bounds(int16_t id, int32_t& t, int32_t& l, int32_t& b, int32_t& r) const
+    {
+        t = (int32_t)(uint32_t)top;
+        l = (int32_t)(uint32_t)left;
+        b = (int32_t)(uint32_t)bottom;
+        r = (int32_t)(uint32_t)right;
+        if (id == -2 && mask.length >= 4*4+2)
+        {
+            t = (int32_t)(uint32_t)mask.top;
+            l = (int32_t)(uint32_t)mask.left;
+            b = (int32_t)(uint32_t)mask.bottom;
+            r = (int32_t)(uint32_t)mask.right;
+        }
+        else if (id == -3 && mask.real_offset() >= 0)
+        {
+            // real flags, real background, then the real user mask rectangle
+            const char* p = &mask.additional_data[mask.real_offset() + 2];
+            t = *(be<int32_t>*)(p+0);
+            l = *(be<int32_t>*)(p+4);
+            b = *(be<int32_t>*)(p+8);
+            r = *(be<int32_t>*)(p+12);
+        }
+    }
+
+    uint64_t Layer::images_size() const
+    {
+        uint64_t size = 0;
+        for(auto& ci:channel_infos)
+            size += ci.second;
+        return size;
+    }
+
+    bool Layer::read_images(std::istream& f, HashMode hash_mode)
     {
+        channel_info_data.clear();
         for(auto& ci:channel_infos)
         {
             ImageData id;
+            int32_t t, l, b, r;
+            channel_bounds(ci.first, t, l, b, r);
             auto pos = f.tellg();
-            id.read(f, right-left, bottom-top);
+            id.read(f, r-l, b-t, hash_mode);
             auto read_size = f.tellg() - pos;
 
             if (read_size != ci.second)
@@ -472,20 +1539,210 @@ namespace psd
             channel_info_data.push_back(std::move(id));
         }
 
-        return true;
+        return true;
+    }
+
+    bool Layer::write_images(std::ostream& f)
+    {
+        for(auto& id:channel_info_data)
+        {
+            if (!id.write(f))
+                return false;
+        }
+        return true;
+    }
+
+    uint32_t LayerTable::extra_key_bit(Signature key)
+    {
+        static const struct
+        {
+            Signature key;
+            uint32_t bit;
+        } keys[] = {
+            {Signature("luni"), Key_luni}, {Signature("lyid"), Key_lyid},
+            {Signature("lsct"), Key_lsct}, {Signature("lsdk"), Key_lsdk},
+            {Signature("TySh"), Key_TySh}, {Signature("SoLd"), Key_SoLd},
+            {Signature("PlLd"), Key_PlLd}, {Signature("lfx2"), Key_lfx2},
+            {Signature("lrFX"), Key_lrFX}, {Signature("vmsk"), Key_vmsk},
+            {Signature("vsms"), Key_vsms}, {Signature("levl"), Key_levl},
+            {Signature("curv"), Key_curv}, {Signature("hue2"), Key_hue2},
+            {Signature("brit"), Key_brit}, {Signature("mixr"), Key_mixr},
+            {Signature("SoCo"), Key_SoCo}, {Signature("GdFl"), Key_GdFl},
+            {Signature("PtFl"), Key_PtFl},
+        };
+        for(auto& k:keys)
+            if (k.key.sig == key.sig)
+                return k.bit;
+        return Key_Other;
+    }
+
+    void LayerTable::clear()
+    {
+        top.clear(); left.clear(); bottom.clear(); right.clear();
+        blend_key.clear();
+        opacity.clear();
+        clipping.clear();
+        bit_flags.clear();
+        num_channels.clear();
+        extra_keys.clear();
+        name_offset.clear();
+        names.clear();
+    }
+
+    void LayerTable::build(const std::vector<Layer>& layers)
+    {
+        clear();
+        size_t n = layers.size();
+        top.reserve(n); left.reserve(n); bottom.reserve(n); right.reserve(n);
+        blend_key.reserve(n);
+        opacity.reserve(n);
+        clipping.reserve(n);
+        bit_flags.reserve(n);
+        num_channels.reserve(n);
+        extra_keys.reserve(n);
+        name_offset.reserve(n+1);
+
+        name_offset.push_back(0);
+        for(auto& l:layers)
+        {
+            top.push_back((int32_t)(uint32_t)l.top);
+            left.push_back((int32_t)(uint32_t)l.left);
+            bottom.push_back((int32_t)(uint32_t)l.bottom);
+            right.push_back((int32_t)(uint32_t)l.right);
+            blend_key.push_back(l.blend_key.x);
+            opacity.push_back(l.opacity);
+            clipping.push_back(l.clipping);
+            bit_flags.push_back(l.bit_flags);
+            num_channels.push_back(l.channel_infos.size());
+
+            uint32_t keys = 0;
+            for(auto& ed:l.additional_extra_data)
+                keys |= extra_key_bit(ed.key);
+            extra_keys.push_back(keys);
+
+            names += l.utf8name;
+            name_offset.push_back(names.size());
+        }
+    }
+
+    void LayerInfo::build_groups()
+    {
+        groups.clear();
+        groups.resize(1);
+        layer_groups.assign(layers.size(), 0);
+
+        std::vector<int32_t> stack(1, 0);
+        for(int32_t i = 0; i < (int32_t)layers.size(); i ++)
+        {
+            auto& l = layers[i];
+            if (l.section_type == Layer::SectionBoundingDivider)
+            {
+                LayerGroup g;
+                g.divider = i;
+                g.parent = stack.back();
+                groups.push_back(std::move(g));
+                stack.push_back(groups.size()-1);
+                layer_groups[i] = stack.back();
+            }
+            else if ((l.section_type == Layer::SectionOpenFolder ||
+                      l.section_type == Layer::SectionClosedFolder) && stack.size() > 1)
+            {
+                int32_t gi = stack.back();
+                stack.pop_back();
+                auto& g = groups[gi];
+                g.layer = i;
+                g.name = l.utf8name;
+                g.collapsed = l.section_type == Layer::SectionClosedFolder;
+                g.blend_key = l.section_blend_key.sig ? l.section_blend_key : Signature(l.blend_key.x);
+                g.pass_through = g.blend_key == "pass";
+                layer_groups[i] = g.parent;
+                groups[g.parent].children.push_back(i);
+                groups[g.parent].subgroups.push_back(gi);
+            }
+            else
+            {
+                layer_groups[i] = stack.back();
+                groups[stack.back()].children.push_back(i);
+            }
+        }
+#ifdef PSD_DEBUG
+        if (stack.size() > 1)
+            std::cout << "Unterminated layer groups: " << stack.size()-1 << std::endl;
+#endif
+    }
+
+    int32_t LayerInfo::find_group(const std::string& utf8name) const
+    {
+        for(size_t i = 1; i < groups.size(); i ++)
+            if (groups[i].name == utf8name)
+                return i;
+        return -1;
+    }
+
+    void LayerInfo::build_index()
+    {
+        name_index.clear();
+        id_index.clear();
+        key_index.clear();
+        for(int32_t i = 0; i < (int32_t)layers.size(); i ++)
+        {
+            auto& l = layers[i];
+            name_index[l.utf8name].push_back(i);
+            if (l.has_layer_id)
+                id_index.emplace(l.layer_id, i);
+            for(auto& ed:l.additional_extra_data)
+            {
+                auto& v = key_index[ed.key.sig];
+                if (v.empty() || v.back() != i)
+                    v.push_back(i);
+            }
+        }
+    }
+
+    const std::vector<int32_t>& LayerInfo::find_layers(const std::string& utf8name) const
+    {
+        static const std::vector<int32_t> none;
+        auto it = name_index.find(utf8name);
+        return it != name_index.end() ? it->second : none;
+    }
+
+    const std::vector<int32_t>& LayerInfo::find_layers_with_key(Signature key) const
+    {
+        static const std::vector<int32_t> none;
+        auto it = key_index.find(key.sig);
+        return it != key_index.end() ? it->second : none;
     }
 
-    bool Layer::write_images(std::ostream& f)
+    Layer* LayerInfo::find_layer(const std::string& utf8name)
     {
-        for(auto& id:channel_info_data)
+        auto& v = find_layers(utf8name);
+        return v.empty() ? nullptr : &layers[v.front()];
+    }
+
+    Layer* LayerInfo::find_layer_by_id(uint32_t id)
+    {
+        auto it = id_index.find(id);
+        return it != id_index.end() ? &layers[it->second] : nullptr;
+    }
+
+    bool LayerInfo::read_images(std::istream& f, int32_t first, int32_t last)
+    {
+        for(int32_t i = first; i <= last; i ++)
         {
-            if (!id.write(f))
+            auto& l = layers[i];
+            if (l.images_loaded())
+                continue;
+            f.seekg(l.images_pos);
+            if (!l.read_images(f, hash_mode))
+            {
+                std::cerr << "Layer read images fail" << std::endl;
                 return false;
+            }
         }
         return true;
     }
 
-    bool LayerInfo::read(std::istream& f)
+    bool LayerInfo::read(std::istream& f, bool read_images)
     {
         be<uint32_t> length;
         f.read((char*)&length, 4);
@@ -509,17 +1766,26 @@ namespace psd
             std::cout << "Layer " << i << ": (at " << f.tellg() << ")" << std::endl;
 #endif
             Layer l;
-            if (!l.read(f))
+            if (!l.read(f, block_data))
             {
                 std::cerr << "Layer read fail" << std::endl;
                 return false;
             }
             layers.push_back(std::move(l));
         }
+        table.build(layers);
+        build_groups();
+        build_index();
 
         for(auto& l:layers)
         {
-            if (!l.read_images(f))
+            l.images_pos = f.tellg();
+            if (!read_images)
+            {
+                f.seekg(l.images_size(), std::ios::cur);
+                continue;
+            }
+            if (!l.read_images(f, hash_mode))
             {
                 std::cerr << "Layer read images fail" << std::endl;
                 return false;
@@ -545,39 +1811,67 @@ namespace psd
         return true;
     }
 
-    bool LayerInfo::write(std::ostream& f)
+    // a big endian 32 bit length, then what body writes padded to a multiple
+    // of padding; the length is patched in place when the stream can seek
+    template <typename Body>
+    static bool write_length_prefixed(std::ostream& f, uint32_t padding, Body body)
     {
-        std::ostringstream os;
-        be<int16_t> adjusted_num_layers;
-        adjusted_num_layers = num_layers;
-        if (has_merged_alpha_channel)
-            adjusted_num_layers = -(int16_t)num_layers;
-#ifdef PSD_DEBUG
-        std::cout << "Writing number of layers: " << num_layers <<' ' << adjusted_num_layers << std::endl;
-#endif
-        os.write((char*)&adjusted_num_layers, 2);
-        for(auto& l:layers)
-        {
-            if (!l.write(os))
-                return false;
-        }
-        for(auto& l:layers)
+        auto start = f.tellp();
+        if (start != std::ostream::pos_type(-1))
         {
-            if (!l.write_images(os))
+            be<uint32_t> length = 0;
+            f.write((char*)&length, 4);
+            if (!body(f))
                 return false;
+            uint64_t size = f.tellp() - start - 4;
+            for(; size % padding; size ++)
+                f.put('\x00');
+            auto end = f.tellp();
+            length = size;
+            f.seekp(start);
+            f.write((char*)&length, 4);
+            f.seekp(end);
+            return (bool)f;
         }
 
+        std::ostringstream os;
+        if (!body(os))
+            return false;
         std::string output = os.str();
-        if (output.size() % 2 == 1)
+        while(output.size() % padding)
             output += '\x00';
-
         be<uint32_t> length = output.size();
         f.write((char*)&length, 4);
         f.write(output.data(), output.size());
-        
         return true;
     }
 
+    bool LayerInfo::write(std::ostream& f)
+    {
+        return write_length_prefixed(f, 2, [this](std::ostream& os)
+        {
+            be<int16_t> adjusted_num_layers;
+            adjusted_num_layers = num_layers;
+            if (has_merged_alpha_channel)
+                adjusted_num_layers = -(int16_t)num_layers;
+#ifdef PSD_DEBUG
+            std::cout << "Writing number of layers: " << num_layers <<' ' << adjusted_num_layers << std::endl;
+#endif
+            os.write((char*)&adjusted_num_layers, 2);
+            for(auto& l:layers)
+            {
+                if (!l.write(os))
+                    return false;
+            }
+            for(auto& l:layers)
+            {
+                if (!l.write_images(os))
+                    return false;
+            }
+            return true;
+        });
+    }
+
     bool GlobalLayerMaskInfo::read(std::istream& f)
     {
         f.read((char*)&length, 4);
@@ -609,11 +1903,16 @@ namespace psd
         return true;
     }
 
-    bool ImageData::read_with_method(std::istream& f, uint32_t w, uint32_t h, uint16_t compression_method)
+    bool ImageData::read_with_method(std::istream& f, uint32_t w, uint32_t h, uint16_t compression_method, HashMode hash_mode)
     {
+        version = new_version();
         this->w = w;
         this->h = h;
         this->compression_method = compression_method;
+        hash = 0;
+        block_hashes.clear();
+        data.clear();
+        Hasher block;
         switch(compression_method)
         {
             case 0: // RAW
@@ -623,6 +1922,15 @@ namespace psd
                     {
                         data[y].resize(w);
                         f.read(&data[y][0], w);
+                        if (hash_mode != HashMode::None)
+                        {
+                            block.update(data[y].data(), w);
+                            if ((y+1) % hash_block_rows == 0 || y+1 == h)
+                            {
+                                block_hashes.push_back(block.digest());
+                                block = Hasher();
+                            }
+                        }
                     }
                 }
                 break;
@@ -631,40 +1939,31 @@ namespace psd
                     std::vector<be<uint16_t>> lengths;
                     lengths.resize(h);
                     f.read((char*)&lengths[0], 2*h);
+                    if (hash_mode == HashMode::Compressed)
+                    {
+                        // hash the packed rows as stored, without decoding them
+                        std::vector<char> packed;
+                        for(uint32_t y = 0; y < h; y++)
+                        {
+                            packed.resize(lengths[y]);
+                            f.read(packed.data(), lengths[y]);
+                            block.update(packed.data(), packed.size());
+                            if ((y+1) % hash_block_rows == 0 || y+1 == h)
+                            {
+                                block_hashes.push_back(block.digest());
+                                block = Hasher();
+                            }
+                        }
+                        break;
+                    }
                     data.resize(h);
                     for(uint32_t y = 0; y < h; y++)
                     {
                         data[y].resize(lengths[y]);
                         f.read(&data[y][0], lengths[y]);
                         std::vector<char> uncompressed;
-
-                        for(uint32_t i = 0; i < data[y].size(); i ++)
-                        {
-                            int c = data[y][i];
-                            if (c >= 128) c -= 256;
-                            if (c == -128)
-                            {
-                                continue;
-                            }
-                            else if (c < 0)
-                            {
-                                i++;
-                                for(int j = 0; j < 1-c; j++)
-                                    uncompressed.push_back(data[y][i]);
-                            }
-                            else
-                            {
-                                if (i+1 + c+1 > data[y].size())
-                                {
-#ifdef PSD_DEBUG
-                                    std::cout << "PackBit source length invalid" << std::endl;
-#endif
-                                    return false;
-                                }
-                                uncompressed.insert(uncompressed.end(), data[y].begin()+i+1, data[y].begin()+i+1+c+1);
-                                i += c+1;
-                            }
-                        }
+                        if (!unpack_row(data[y], uncompressed))
+                            return false;
                         if (uncompressed.size()*8%w != 0 || uncompressed.size() == 0)
                         {
 #ifdef PSD_DEBUG
@@ -673,6 +1972,15 @@ namespace psd
                             return false;
                         }
                         data[y].swap(uncompressed);
+                        if (hash_mode == HashMode::Decoded)
+                        {
+                            block.update(data[y].data(), data[y].size());
+                            if ((y+1) % hash_block_rows == 0 || y+1 == h)
+                            {
+                                block_hashes.push_back(block.digest());
+                                block = Hasher();
+                            }
+                        }
                     }
                 }
                 break;
@@ -685,16 +1993,83 @@ namespace psd
                     return false;
                 }
         }
+        // decoded rows hash the same however they were stored; stored bytes
+        // only mean the same thing under the same compression
+        if (hash_mode != HashMode::None)
+            hash = hash64(block_hashes.data(), block_hashes.size()*sizeof(uint64_t), hash_mode == HashMode::Compressed ? (uint64_t)compression_method : 0);
+
+        return true;
+    }
 
+    bool ImageData::unpack_row(const std::vector<char>& packed, std::vector<char>& row)
+    {
+        row.clear();
+        for(uint32_t i = 0; i < packed.size(); i ++)
+        {
+            int c = packed[i];
+            if (c >= 128) c -= 256;
+            if (c == -128)
+            {
+                continue;
+            }
+            else if (c < 0)
+            {
+                i++;
+                if (i >= packed.size())
+                    return false;
+                row.insert(row.end(), 1-c, packed[i]);
+            }
+            else
+            {
+                if (i+1 + c+1 > packed.size())
+                {
+#ifdef PSD_DEBUG
+                    std::cout << "PackBit source length invalid" << std::endl;
+#endif
+                    return false;
+                }
+                row.insert(row.end(), packed.begin()+i+1, packed.begin()+i+1+c+1);
+                i += c+1;
+            }
+        }
         return true;
     }
 
-    bool ImageData::read(std::istream& f, uint32_t w, uint32_t h)
+    bool ImageData::RowReader::open(std::istream& f, uint32_t w, uint32_t h)
+    {
+        this->f = &f;
+        this->w = w;
+        this->h = h;
+        y = 0;
+        be<uint16_t> method;
+        f.read((char*)&method, 2);
+        compression_method = method;
+        if (compression_method == 1)
+        {
+            lengths.resize(h);
+            f.read((char*)lengths.data(), 2*h);
+        }
+        else if (compression_method != 0)
+            return false;
+        return (bool)f;
+    }
+
+    bool ImageData::RowReader::next(std::vector<char>& row)
+    {
+        if (y >= h)
+            return false;
+        row.resize(compression_method == 1 ? (size_t)lengths[y] : w);
+        f->read(row.data(), row.size());
+        y ++;
+        return (bool)*f;
+    }
+
+    bool ImageData::read(std::istream& f, uint32_t w, uint32_t h, HashMode hash_mode)
     {
         this->w = w;
         this->h = h;
         f.read((char*)&compression_method, 2);
-        return read_with_method(f, w, h, compression_method);
+        return read_with_method(f, w, h, compression_method, hash_mode);
     }
 
     size_t PackBitCompress(const std::vector<char>& input, std::vector<char>& output)
@@ -795,38 +2170,182 @@ namespace psd
         return output.size() - output_size_at_start;
     }
 
-    bool ImageData::write(std::ostream& f)
+    static uint64_t rows_key(uint32_t w, uint32_t h, const std::vector<uint64_t>& row_keys)
+    {
+        Hasher hasher;
+        uint32_t dims[2] = {w, h};
+        hasher.update(dims, sizeof(dims));
+        hasher.update(row_keys.data(), row_keys.size() * sizeof(uint64_t));
+        return hasher.digest();
+    }
+
+    uint64_t ImageData::content_key() const
+    {
+        std::vector<uint64_t> keys;
+        keys.reserve(data.size());
+        for(auto& line:data)
+            keys.push_back(hash64(line.data(), line.size()));
+        return rows_key(w, h, keys);
+    }
+
+    uint64_t ImageData::new_version()
+    {
+        static std::atomic<uint64_t> next(1);
+        return next++;
+    }
+
+    void ImageData::mark_dirty(uint32_t first, uint32_t last)
+    {
+        if (first >= last)
+            return;
+        version = new_version();
+        if (!dirty_rows.empty())
+        {
+            // consecutive edits mostly touch the same or the next rows
+            auto& r = dirty_rows.back();
+            if (first <= r.second && r.first <= last)
+            {
+                r.first = std::min(r.first, first);
+                r.second = std::max(r.second, last);
+                return;
+            }
+        }
+        dirty_rows.emplace_back(first, last);
+    }
+
+    void ImageData::encode_all()
     {
         uint64_t raw_size = w*h;
         std::vector<be<uint16_t>> sizes;
         std::vector<char> merged;
         uint64_t packed_size = 0;
 
+        packed_sizes.clear();
         for(auto& line:data)
         {
-            sizes.push_back(PackBitCompress(line, merged));
+            packed_sizes.push_back(PackBitCompress(line, merged));
+            sizes.push_back(packed_sizes.back());
             packed_size += (uint16_t)sizes.back();
         }
         
+        encoded.clear();
         if (raw_size > packed_size + 2 * sizes.size())
         {
             // using PackBits
             compression_method = 1;
-            f.write((char*)&compression_method, 2);
-            f.write((char*)&sizes[0], sizes.size() * 2);
-            f.write(merged.data(), merged.size());
+            encoded.append((char*)&compression_method, 2);
+            encoded.append((char*)&sizes[0], sizes.size() * 2);
+            encoded.append(merged.data(), merged.size());
         }
         else
         {
             // using raw
             compression_method = 0;
-            f.write((char*)&compression_method, 2);
+            encoded.append((char*)&compression_method, 2);
             for(auto& line:data)
             {
-                f.write(line.data(), line.size());
+                encoded.append(line.data(), line.size());
+            }
+        }
+    }
+
+    void ImageData::encode_dirty()
+    {
+        std::sort(dirty_rows.begin(), dirty_rows.end());
+        std::vector<bool> dirty(h, false);
+        for(auto& r:dirty_rows)
+            for(uint32_t y = r.first; y < r.second && y < h; y ++)
+                dirty[y] = true;
+        dirty_rows.clear();
+
+        // rows are independent: repack the dirty ones, keep the others' bytes
+        std::vector<uint64_t> old_offsets(h + 1, 0);
+        for(uint32_t y = 0; y < h; y ++)
+            old_offsets[y+1] = old_offsets[y] + (compression_method == 1 ? packed_sizes[y] : data[y].size());
+        std::vector<char> packed;
+        std::string body;
+        body.reserve(encoded.size());
+        uint64_t packed_size = 0;
+        for(uint32_t y = 0; y < h; y ++)
+        {
+            if (dirty[y])
+            {
+                row_keys[y] = hash64(data[y].data(), data[y].size());
+                packed.clear();
+                packed_sizes[y] = PackBitCompress(data[y], packed);
+                if (compression_method == 1)
+                    body.append(packed.data(), packed.size());
+            }
+            else if (compression_method == 1)
+            {
+                uint32_t end = y + 1;
+                while(end < h && !dirty[end])
+                    end ++;
+                body.append(&encoded[2 + 2*h + old_offsets[y]], old_offsets[end] - old_offsets[y]);
+                for(; y + 1 < end; y ++)
+                    packed_size += packed_sizes[y];
             }
+            packed_size += packed_sizes[y];
+        }
+        encoded_key = rows_key(w, h, row_keys);
+
+        uint64_t raw_size = w*h;
+        bool use_packbits = raw_size > packed_size + 2 * h;
+        if (use_packbits && compression_method == 1)
+        {
+            std::vector<be<uint16_t>> sizes(packed_sizes.begin(), packed_sizes.end());
+            encoded.resize(2);
+            encoded.append((char*)&sizes[0], sizes.size() * 2);
+            encoded.append(body);
+        }
+        else if (!use_packbits && compression_method == 0)
+        {
+            for(uint32_t y = 0; y < h; y ++)
+                if (dirty[y])
+                    encoded.replace(2 + old_offsets[y], data[y].size(), data[y].data(), data[y].size());
+        }
+        else
+        {
+            // the choice between raw and PackBits flipped
+            encode_all();
+        }
+    }
+
+    bool ImageData::write(std::ostream& f)
+    {
+        if (!encode())
+            return false;
+        f.write(encoded.data(), encoded.size());
+        return true;
+    }
+
+    bool ImageData::encode()
+    {
+        if (!has_pixels())
+        {
+            std::cerr << "ImageData has no decoded pixels" << std::endl;
+            return false;
+        }
+        if ((track_edits || !dirty_rows.empty()) && !encoded.empty() && row_keys.size() == h && packed_sizes.size() == h)
+        {
+            if (!dirty_rows.empty())
+                encode_dirty();
+            return true;
         }
+        dirty_rows.clear();
 
+        // hashing is far cheaper than PackBits; untouched channels are not re-encoded
+        std::vector<uint64_t> keys;
+        keys.reserve(h);
+        for(auto& line:data)
+            keys.push_back(hash64(line.data(), line.size()));
+        uint64_t key = rows_key(w, h, keys);
+        row_keys.swap(keys);
+        if (encoded.empty() || key != encoded_key)
+        {
+            encode_all();
+            encoded_key = key;
+        }
         return true;
     }
 
@@ -862,8 +2381,32 @@ namespace psd
         return true;
     }
 
+    uint64_t MultipleImageData::content_key() const
+    {
+        Hasher hasher;
+        uint32_t dims[2] = {w, h};
+        hasher.update(dims, sizeof(dims));
+        for(auto& data:datas)
+        {
+            for(auto& line:data)
+            {
+                uint64_t size = line.size();
+                hasher.update(&size, sizeof(size));
+                hasher.update(line.data(), line.size());
+            }
+        }
+        return hasher.digest();
+    }
+
     bool MultipleImageData::write(std::ostream& f)
     {
+        uint64_t key = content_key();
+        if (!encoded.empty() && key == encoded_key)
+        {
+            f.write(encoded.data(), encoded.size());
+            return true;
+        }
+
         ImageData imageData;
         imageData.w = w;
         imageData.h = h * datas.size();
@@ -872,22 +2415,32 @@ namespace psd
             for(auto& line:data)
                 imageData.data.push_back(line);
         }
-        if (!imageData.write(f))
+        std::ostringstream os;
+        if (!imageData.write(os))
             return false;
+        compression_method = imageData.compression_method;
+        encoded = os.str();
+        encoded_key = key;
+        f.write(encoded.data(), encoded.size());
         return true;
     }
 
-    bool psd::read_layers_and_masks(std::istream& f)
+    bool psd::read_layers_and_masks(std::istream& f, const LoadOptions& options)
     {
 
         be<uint32_t> length;
         f.read((char*)&length, 4);
         auto start_pos = f.tellg();
-        
+        block_data_skipped_ = !options.block_data;
+        skipped_blocks_.clear();
+        additional_layer_data.clear();
+
         if (length == 0)
             return true;
 
-        if (!layer_info.read(f))
+        layer_info.hash_mode = options.hash;
+        layer_info.block_data = options.block_data;
+        if (!layer_info.read(f, options.layer_images))
             return false;
 
         if (!global_layer_mask_info.read(f))
@@ -899,6 +2452,8 @@ namespace psd
 #ifdef PSD_DEBUG
             std::cout << "Layer remaining: " << remaining << " at " << f.tellg() << std::endl;
 #endif
+            if (!options.block_data)
+                return skip_layer_blocks(f, remaining);
             additional_layer_data.resize(remaining);
             f.read(&additional_layer_data[0], remaining);
         }
@@ -906,27 +2461,90 @@ namespace psd
         return true;
     }
 
-    bool psd::write_layers_and_masks(std::ostream& f)
+    // the block headers of additional_layer_data, walked as
+    // additional_layer_blocks() does without keeping the data
+    bool psd::skip_layer_blocks(std::istream& f, uint64_t size)
     {
-        std::ostringstream os;
+        auto begin = f.tellg();
+        uint64_t offset = 0;
+        while(size - offset >= 12)
+        {
+            char head[12];
+            if (!f.read(head, 12) || (tag(head) != tag("8BIM") && tag(head) != tag("8B64")))
+                break;
+            uint32_t length = *(be<uint32_t>*)(head+8);
+            offset += 12;
+            if (size - offset < length)
+                break;
+            skipped_blocks_.emplace_back(Signature(tag(head+4)), length);
+            offset += length;
+            f.seekg(begin + (std::streamoff)offset);
+            while(offset % 4 != 0 && offset < size && f.peek() == 0)
+            {
+                f.get();
+                offset ++;
+            }
+        }
+        f.clear();
+        f.seekg(begin + (std::streamoff)size);
+        return (bool)f;
+    }
+
+    std::vector<std::pair<Signature, uint64_t>> psd::additional_layer_block_sizes() const
+    {
+        if (block_data_skipped_)
+            return skipped_blocks_;
+        std::vector<std::pair<Signature, uint64_t>> sizes;
+        for(auto& b:additional_layer_blocks())
+            sizes.emplace_back(b.first, b.second.size);
+        return sizes;
+    }
+
+    bool psd::load_layer_images(std::istream& stream)
+    {
+        if (layer_info.layers.empty())
+            return true;
+        return layer_info.read_images(stream, 0, layer_info.layers.size()-1);
+    }
 
-        if (!layer_info.write(os))
+    bool psd::load_group_images(std::istream& stream, int32_t group)
+    {
+        if (group < 0 || group >= (int32_t)layer_info.groups.size())
             return false;
-        if (!global_layer_mask_info.write(os))
+        if (group == 0)
+            return load_layer_images(stream);
+        auto& g = layer_info.groups[group];
+        if (g.first() < 0 || g.last() < 0)
             return false;
+        return layer_info.read_images(stream, g.first(), g.last());
+    }
 
-        os.write(additional_layer_data.data(), additional_layer_data.size());
-
-        std::string output = os.str();
-        be<uint32_t> length(output.size());
-        f.write((char*)&length, 4);
-        f.write(output.data(), output.size());
+    bool psd::write_layers_and_masks(std::ostream& f)
+    {
+        return write_length_prefixed(f, 1, [this](std::ostream& os)
+        {
+            if (!layer_info.write(os))
+                return false;
+            if (!global_layer_mask_info.write(os))
+                return false;
 
-        return true;
+            os.write(additional_layer_data.data(), additional_layer_data.size());
+            return true;
+        });
     }
 
     bool psd::save(std::ostream& f)
     {
+        if (merged_image_skipped_)
+        {
+            std::cerr << "merged image was not loaded" << std::endl;
+            return false;
+        }
+        if (block_data_skipped_)
+        {
+            std::cerr << "tagged block data was not loaded" << std::endl;
+            return false;
+        }
         if (!write_header(f))
             return false;
         if (!write_color_mode(f))
@@ -941,6 +2559,178 @@ namespace psd
         return true;
     }
 
+    // a channel still to be PackBits sampled for estimate_saved_size()
+    struct PendingChannel
+    {
+        std::vector<const std::vector<char>*> rows;
+        uint64_t raw_size; // w*h, as compared by ImageData::write
+        uint64_t raw_bytes;
+        psd::SizeEstimate* target;
+    };
+
+    static void add_estimate(psd::SizeEstimate& e, uint64_t bytes, uint64_t low, uint64_t high)
+    {
+        e.bytes += bytes;
+        e.low += low;
+        e.high += high;
+        if (low == high)
+            e.exact_bytes += bytes;
+    }
+
+    static void estimate_channel(const PendingChannel& c, uint32_t samples)
+    {
+        uint64_t count = c.rows.size();
+        uint64_t min_packed = 0, max_packed = 0;
+        for(auto row:c.rows)
+        {
+            uint64_t runs = (row->size() + 127) / 128;
+            min_packed += 2 * runs;
+            max_packed += row->size() + runs;
+        }
+        uint32_t n = std::min<uint64_t>(count, std::max<uint32_t>(samples, 1));
+        uint64_t stride = n ? count / n : 1;
+        double sum = 0, sum2 = 0;
+        std::vector<char> packed;
+        uint64_t state = prime64_5;
+        for(uint32_t k = 0; k < n; k ++)
+        {
+            // one row at a random offset in each stride, so periodic content cannot alias
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            packed.clear();
+            double size = PackBitCompress(*c.rows[k*stride + (state >> 33) % stride], packed);
+            sum += size;
+            sum2 += size * size;
+        }
+        double est = sum, lo = sum, hi = sum;
+        if (n < count)
+        {
+            double mean = sum / n;
+            double var = n > 1 ? std::max(0.0, (sum2 - sum*mean) / (n-1)) : mean*mean;
+            // standard error of the total, with finite population correction
+            double se = count * std::sqrt(var / n * (1.0 - (double)n / count));
+            est = mean * count;
+            lo = est - 3*se;
+            hi = est + 3*se;
+        }
+        auto written = [&](double packed_size) -> uint64_t
+        {
+            uint64_t p = (uint64_t)std::llround(std::min(std::max(packed_size, (double)min_packed), (double)max_packed));
+            return 2 + (c.raw_size > p + 2*count ? p + 2*count : c.raw_bytes);
+        };
+        add_estimate(*c.target, written(est), written(lo), written(hi));
+    }
+
+    psd::SizeEstimate psd::estimate_saved_size()
+    {
+        return estimate_saved_size(EstimateOptions());
+    }
+
+    psd::SizeEstimate psd::estimate_saved_size(const EstimateOptions& options)
+    {
+        SizeEstimate e, info;
+        std::vector<PendingChannel> pending;
+        uint64_t pending_bytes = 0;
+        auto add_pending = [&](PendingChannel& c, SizeEstimate* target)
+        {
+            c.raw_bytes = 0;
+            for(auto row:c.rows)
+                c.raw_bytes += row->size();
+            c.target = target;
+            pending_bytes += c.raw_bytes;
+            pending.push_back(std::move(c));
+        };
+
+        uint64_t fixed = sizeof(Header) + 4 + 4; // header, empty color mode data, resources length
+        for(auto& r:image_resources)
+            fixed += r.size();
+        fixed += 4 + 4; // layer and mask section length, layer info length
+        fixed += 4 + (global_layer_mask_info.length ? 2+2*4+2+1 + global_layer_mask_info.data.size() : 0);
+        fixed += additional_layer_data.size();
+        add_estimate(e, fixed, fixed, fixed);
+
+        uint64_t records = 2;
+        for(auto& l:layer_info.layers)
+        {
+            records += 4*4+2 + 6*l.channel_infos.size() + 4*3+4 +
+                l.mask.size() + l.blending_ranges.size() + l.name_size();
+            for(auto& ed:l.additional_extra_data)
+                records += 12 + ed.length;
+
+            for(size_t i = 0; i < l.channel_infos.size(); i ++)
+            {
+                if (!l.images_loaded())
+                {
+                    // the stored size is the best guess, but the file may come from
+                    // another encoder or be stored raw; bound by what save() can write
+                    int32_t t, left, b, r;
+                    l.channel_bounds(l.channel_infos[i].first, t, left, b, r);
+                    uint64_t w = r > left ? r - left : 0, h = b > t ? b - t : 0;
+                    uint64_t low = 2 + std::min(w*h, 2*h + 2*h*((w + 127) / 128));
+                    uint64_t high = 2 + w*h;
+                    uint64_t stored = std::min(std::max<uint64_t>(l.channel_infos[i].second, low), high);
+                    add_estimate(info, stored, low, high);
+                    continue;
+                }
+                ImageData& id = l.channel_info_data[i];
+                if (!id.encoded.empty() && id.dirty_rows.empty() && (!options.verify_cached || id.content_key() == id.encoded_key))
+                {
+                    add_estimate(info, id.encoded.size(), id.encoded.size(), id.encoded.size());
+                    continue;
+                }
+                PendingChannel c;
+                c.raw_size = (uint64_t)id.w * id.h;
+                for(auto& line:id.data)
+                    c.rows.push_back(&line);
+                add_pending(c, &info);
+            }
+        }
+        add_estimate(info, records, records, records);
+
+        if (!merged_image.encoded.empty() && (!options.verify_cached || merged_image.content_key() == merged_image.encoded_key))
+        {
+            uint64_t size = merged_image.encoded.size();
+            add_estimate(e, size, size, size);
+        }
+        else
+        {
+            PendingChannel c;
+            c.raw_size = (uint64_t)merged_image.w * merged_image.h * merged_image.datas.size();
+            for(auto& data:merged_image.datas)
+                for(auto& line:data)
+                    c.rows.push_back(&line);
+            add_pending(c, &e);
+        }
+
+        // small documents are encoded in full, large ones sampled within the budget
+        double share = pending_bytes > options.sample_bytes ? (double)options.sample_bytes / pending_bytes : 1.0;
+        for(auto& c:pending)
+        {
+            uint64_t samples = c.rows.size();
+            if (share < 1.0)
+                samples = std::min<uint64_t>(options.sample_rows, std::max<uint64_t>(2, (uint64_t)std::ceil(c.rows.size() * share)));
+            estimate_channel(c, samples);
+        }
+
+        // layer info is padded to an even length
+        uint64_t pad = info.bytes % 2;
+        if (info.exact())
+            add_estimate(info, pad, pad, pad);
+        else
+            add_estimate(info, pad, 0, 1);
+        e.bytes += info.bytes;
+        e.low += info.low;
+        e.high += info.high;
+        e.exact_bytes += info.exact_bytes;
+        return e;
+    }
+
+    void psd::track_edits(bool enable)
+    {
+        for(auto& l:layer_info.layers)
+            for(auto& id:l.channel_info_data)
+                id.track_edits = enable;
+    }
+
     bool psd::write_header(std::ostream& f)
     {
         f.write((char*)&header, sizeof(header));
@@ -975,6 +2765,7 @@ namespace psd
             }
             image_resources.push_back(std::move(b));
         }
+        build_image_resource_index();
         return true;
     }
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <string>
 #include <iostream>
@@ -28,6 +29,19 @@ namespace psd
         uint8_t* p = reinterpret_cast<uint8_t*>(&x);
         t = p[0]; p[0] = p[1]; p[1] = t;
     }
+    template <> inline void BEtoLE<uint64_t>(uint64_t& x)
+    {
+        uint8_t t;
+        uint8_t* p = reinterpret_cast<uint8_t*>(&x);
+        t = p[0]; p[0] = p[7]; p[7] = t;
+        t = p[1]; p[1] = p[6]; p[6] = t;
+        t = p[2]; p[2] = p[5]; p[5] = t;
+        t = p[3]; p[3] = p[4]; p[4] = t;
+    }
+    template <> inline void BEtoLE<int64_t>(int64_t& x)
+    {
+        BEtoLE(*(uint64_t*)&x);
+    }
     template <> inline void BEtoLE<int32_t>(int32_t& x)
     {
         BEtoLE(*(uint32_t*)&x);
@@ -156,6 +170,177 @@ namespace psd
         Lab = 9,
     };
 
+    // streaming XXH64, used for content hashes of channel data
+    struct Hasher
+    {
+        Hasher(uint64_t seed = 0);
+        void update(const void* data, size_t size);
+        uint64_t digest() const;
+
+        uint64_t v[4];
+        uint64_t seed;
+        uint64_t total;
+        uint8_t buffer[32];
+        uint32_t buffered;
+    };
+    uint64_t hash64(const void* data, size_t size, uint64_t seed = 0);
+
+    enum class HashMode
+    {
+        None,
+        Decoded, // hash the rows as they are decoded
+        Compressed, // hash the stored bytes and skip decoding
+    };
+
+    // document coordinates, bottom and right exclusive
+    struct Rect
+    {
+        Rect()
+            : top(0), left(0), bottom(0), right(0)
+        {}
+        Rect(int32_t top, int32_t left, int32_t bottom, int32_t right)
+            : top(top), left(left), bottom(bottom), right(right)
+        {}
+        int32_t top, left, bottom, right;
+
+        bool empty() const { return bottom <= top || right <= left; }
+        bool intersects(const Rect& r) const
+        {
+            return !empty() && !r.empty() && r.left < right && left < r.right && r.top < bottom && top < r.bottom;
+        }
+        Rect united(const Rect& r) const
+        {
+            if (empty()) return r;
+            if (r.empty()) return *this;
+            return Rect(std::min(top, r.top), std::min(left, r.left), std::max(bottom, r.bottom), std::max(right, r.right));
+        }
+        Rect intersected(const Rect& r) const
+        {
+            Rect i(std::max(top, r.top), std::max(left, r.left), std::min(bottom, r.bottom), std::min(right, r.right));
+            return i.empty() ? Rect() : i;
+        }
+    };
+
+    // view into a buffer owned by the document
+    struct Slice
+    {
+        Slice()
+            : data(nullptr), size(0)
+        {}
+        Slice(const char* data, size_t size)
+            : data(data), size(size)
+        {}
+        const char* data;
+        size_t size;
+
+        bool empty() const { return size == 0; }
+    };
+
+    // image resource 1005
+    struct ResolutionInfo
+    {
+        double h_res; // pixels per inch or per cm, see h_res_unit
+        uint16_t h_res_unit; // 1 = per inch, 2 = per cm
+        uint16_t width_unit;
+        double v_res;
+        uint16_t v_res_unit;
+        uint16_t height_unit;
+
+        bool read(Slice s);
+    };
+
+    class Descriptor;
+
+    // One value inside a Descriptor; points into the descriptor bytes.
+    class DescriptorValue
+    {
+    public:
+        DescriptorValue()
+            : data_(nullptr), end_(nullptr)
+        {}
+        DescriptorValue(Signature type, const char* data, const char* end)
+            : type(type), data_(data), end_(end)
+        {}
+
+        Signature type; // OSType: 'doub', 'long', 'TEXT', 'Objc', 'VlLs', ...; 0 if not found
+
+        bool valid() const { return type.sig != 0; }
+        Slice data() const { return Slice(data_, end_-data_); }
+
+        double as_double(double def = 0) const; // doub, UntF, long, comp
+        int64_t as_int(int64_t def = 0) const; // long, comp, doub, UntF
+        bool as_bool(bool def = false) const;
+        std::string as_string() const; // TEXT as utf8; enum value; class ID
+        Signature unit() const; // UntF
+        Slice raw() const; // tdta, alis, Pth
+        Slice enum_type() const; // enum
+        Slice enum_value() const; // enum
+        Descriptor as_descriptor() const; // Objc, GlbO, ObAr
+
+        uint32_t list_size() const; // VlLs
+        DescriptorValue at(uint32_t i) const; // VlLs
+        bool next(const char*& cursor, DescriptorValue& value) const; // VlLs; cursor starts at list_begin()
+        const char* list_begin() const;
+
+    private:
+        const char* data_;
+        const char* end_;
+    };
+
+    // Photoshop action descriptor, walked in place over the bytes of an
+    // ExtraData or ImageResourceBlock. Nothing is decoded or allocated until
+    // a field is asked for, and the bytes must outlive the Descriptor.
+    class Descriptor
+    {
+    public:
+        Descriptor()
+            : begin_(nullptr), end_(nullptr), items_(nullptr), count_(0)
+        {}
+
+        // s.data+offset points to the unicode name that starts a descriptor
+        bool read(Slice s, size_t offset = 0);
+        bool valid() const { return items_ != nullptr; }
+
+        std::string name() const;
+        Slice class_id() const;
+        uint32_t size() const { return count_; }
+
+        DescriptorValue get(const std::string& key) const;
+        // keys separated by '/', list entries by index: "Txt /EngineData", "Trnf/xx", "FrFX/Clr /Rd  "
+        DescriptorValue find(const std::string& path) const;
+
+        // for(const char* c = d.items(); d.next(c, key, value);) ...
+        const char* items() const { return items_; }
+        bool next(const char*& cursor, Slice& key, DescriptorValue& value) const;
+
+        const char* end() const; // one past the last item; walks all items
+
+    private:
+        friend class DescriptorValue;
+        const char* begin_;
+        const char* end_;
+        const char* items_;
+        uint32_t count_;
+    };
+
+    // one entry of a lnk2/lnkD/lnk3 linked layer block (smart object source)
+    struct LinkedFile
+    {
+        LinkedFile()
+            : version(0), file_size(0)
+        {}
+        Signature type; // liFD embedded, liFE external, liFA alias
+        uint32_t version;
+        std::string unique_id; // matches the Idnt of the SoLd/PlLd layers that place it
+        std::string filename; // utf8
+        Signature file_type; // e.g. "8BPS", "png "
+        Signature file_creator;
+        uint64_t file_size;
+        Slice data; // file contents inside the owning block; empty when not embedded
+
+        bool embedded() const { return type == "liFD"; }
+    };
+
 #pragma pack(push, 1)
     struct Header
     {
@@ -180,6 +365,7 @@ namespace psd
         std::string name; // encoded as pascal string; 1 byte length header
 
         std::vector<char> buffer;
+        Slice slice() const { return Slice(buffer.data(), buffer.size()); }
 
         uint32_t size() const;
         bool read(std::istream& stream);
@@ -192,9 +378,12 @@ namespace psd
         Signature key;
         be<uint32_t> length;
         std::vector<char> data;
+        Slice slice() const { return Slice(data.data(), data.size()); }
 
         uint32_t size() const { return 12+data.size() + (data.size()%2); }
-        bool read(std::istream& stream);
+        // keep, when given, decides from the key whether data is read or
+        // skipped; skipped blocks keep their length with data left empty
+        bool read(std::istream& stream, bool (*keep)(Signature key) = nullptr);
         bool write(std::ostream& stream);
 
         void luni_read_name(std::wstring& wname, std::string& utf8name);
@@ -202,40 +391,117 @@ namespace psd
 
     struct ImageData
     {
+        ImageData()
+            : w(0), h(0), hash(0), version(new_version()), encoded_key(0), track_edits(false)
+        {}
         uint32_t w;
         uint32_t h;
         be<uint16_t> compression_method;
         std::vector<std::vector<char>> data;
-        bool read(std::istream& f, uint32_t w, uint32_t h);
+        bool has_pixels() const { return data.size() == h; } // false after HashMode::Compressed
+
+        // filled when read with a HashMode other than None
+        enum { hash_block_rows = 64 };
+        uint64_t hash; // hash of block_hashes; Compressed also keys it by compression_method
+        std::vector<uint64_t> block_hashes; // one per hash_block_rows rows
+
+        // unique to these rows: renewed by read() and mark_dirty(), so
+        // caches of derived data compare it instead of hashing the pixels
+        uint64_t version;
+        static uint64_t new_version();
+
+        // output of the last write(), reused verbatim while the rows hash to
+        // encoded_key; clear encoded to release the memory
+        uint64_t encoded_key;
+        std::string encoded;
+        std::vector<uint32_t> packed_sizes; // PackBits size of each row, as of the last write()
+        std::vector<uint64_t> row_keys; // hash64 of each row, as of the last write()
+        uint64_t content_key() const;
+
+        // Pixel edits. The next write() re-encodes the rows marked dirty and
+        // reuses the rest of its previous output without rehashing it, so rows
+        // changed through data directly must be marked as well. With
+        // track_edits set, a channel without marks is not rehashed at all.
+        std::vector<std::pair<uint32_t, uint32_t>> dirty_rows; // [first, last) ranges
+        bool track_edits;
+        void mark_dirty(uint32_t first, uint32_t last);
+        char* edit_row(uint32_t y) { mark_dirty(y, y+1); return &data[y][0]; }
+        void set(uint32_t x, uint32_t y, uint8_t value) { edit_row(y)[x] = value; }
+
+        bool read(std::istream& f, uint32_t w, uint32_t h, HashMode hash_mode = HashMode::None);
         bool write(std::ostream& f);
+        bool encode(); // brings encoded up to date; write() emits it
+
+        bool read_with_method(std::istream& f, uint32_t w, uint32_t h, uint16_t compression_method, HashMode hash_mode = HashMode::None);
 
-        bool read_with_method(std::istream& f, uint32_t w, uint32_t h, uint16_t compression_method);
+        // stored rows of a channel one at a time, still PackBits packed
+        // when compression_method is 1; nothing else may read f in between
+        struct RowReader
+        {
+            RowReader()
+                : f(nullptr), compression_method(0), w(0), h(0), y(0)
+            {}
+            std::istream* f;
+            uint16_t compression_method;
+            uint32_t w, h; // w is the size of a raw row in bytes
+            uint32_t y; // next row
+            std::vector<be<uint16_t>> lengths; // PackBits row sizes
+
+            bool open(std::istream& f, uint32_t w, uint32_t h); // reads the method and row sizes
+            bool next(std::vector<char>& row); // false past the last row or on a read error
+        };
+        static bool unpack_row(const std::vector<char>& packed, std::vector<char>& row);
+
+    private:
+        void encode_all();
+        void encode_dirty();
     };
 
     struct MultipleImageData
     {
+        MultipleImageData()
+            : w(0), h(0), count(0), encoded_key(0)
+        {}
         uint32_t w;
         uint32_t h;
         uint32_t count;
         be<uint16_t> compression_method;
         std::vector<std::vector<std::vector<char>>> datas;
+        uint64_t encoded_key; // as in ImageData
+        std::string encoded;
+        uint64_t content_key() const;
         bool read(std::istream& f, uint32_t w, uint32_t h, uint32_t count, uint16_t bit_depth);
         bool write(std::ostream& f);
     };
 
     struct Layer
     {
-        Layer() : has_text(false) {}
+        Layer() : has_text(false), has_layer_id(false), layer_id(0), section_type(0), images_pos(-1) {}
         be<uint32_t> top, left, bottom, right;
         be<uint16_t> num_channels;
         std::vector<std::pair<be<int16_t>, be<uint32_t>>> channel_infos; // ID, length
         std::vector<ImageData> channel_info_data;
-        ImageData* get_channel_info_by_id(int16_t id)
+        std::unordered_map<int16_t, uint16_t> channel_slots; // ID -> index into channel_infos
+        void build_channel_slots();
+        int32_t get_channel_slot(int16_t id) const
         {
+            if (channel_slots.size() == channel_infos.size())
+            {
+                auto it = channel_slots.find(id);
+                if (it != channel_slots.end() && it->second < channel_infos.size() && channel_infos[it->second].first == id)
+                    return it->second;
+            }
             for(uint16_t i = 0; i < channel_infos.size(); i ++)
                 if (channel_infos[i].first == id)
-                    return &channel_info_data[i];
-            return nullptr;
+                    return i;
+            return -1;
+        }
+        ImageData* get_channel_info_by_id(int16_t id)
+        {
+            int32_t i = get_channel_slot(id);
+            if (i < 0 || i >= (int32_t)channel_info_data.size())
+                return nullptr;
+            return &channel_info_data[i];
         }
 
         Signature blend_signature;
@@ -246,6 +512,19 @@ namespace psd
         uint8_t dummy1;
         be<uint32_t> extra_data_length;
         std::vector<ExtraData> additional_extra_data;
+        // key -> first index into additional_extra_data; call build_extra_data_index() after editing
+        std::unordered_map<uint32_t, uint16_t> extra_data_index;
+        void build_extra_data_index();
+        ExtraData* get_extra_data(Signature key);
+
+        // descriptor stored in lfx2, SoLd, TySh (text), SoCo/GdFl/PtFl, vstk, vscg, artb, ...
+        Descriptor get_descriptor(Signature key);
+
+        std::string smart_object_id(); // unique ID of the linked file of a SoLd/PlLd layer, empty if none
+
+        uint8_t fill_opacity(); // iOpa, 255 if absent
+        uint16_t sheet_color(); // lclr, 0 if absent
+        uint32_t protection_flags(); // lspf, 0 if absent
 
         uint16_t name_size();
 
@@ -258,6 +537,11 @@ namespace psd
             uint8_t flags;
             std::vector<char> additional_data;
 
+            // additional_data starts with the mask parameters when flags has
+            // bit 4, then holds the real flags, background and rectangle of
+            // the user mask; offset of the real flags, -1 when they are absent
+            int32_t real_offset() const;
+
             bool read(std::istream& f);
             bool write(std::ostream& f);
 
@@ -265,8 +549,21 @@ namespace psd
 
         struct LayerBlendingRanges
         {
+            // one blend if slider: the value shows fully between black_high
+            // and white_low and fades out towards black_low and white_high
+            struct Range
+            {
+                uint8_t black_low, black_high, white_low, white_high;
+                bool full() const { return black_high == 0 && white_low == 255; }
+            };
+
             uint32_t size() const { return data.size() + 4; }
             std::vector<char> data;
+            // composite gray first, then one pair per channel
+            size_t count() const { return data.size()/8; }
+            Range source(size_t i) const; // this layer
+            Range destination(size_t i) const; // underlying layers
+            bool is_default() const; // every range full
             bool read(std::istream& f);
             bool write(std::ostream& f);
         } blending_ranges;
@@ -274,23 +571,149 @@ namespace psd
         std::wstring wname;
         std::string utf8name;
         bool has_text;
+        bool has_layer_id;
+        uint32_t layer_id; // lyid
 
-        bool read(std::istream& f);
+        // section divider (lsct/lsdk)
+        enum : uint32_t
+        {
+            SectionOther = 0,
+            SectionOpenFolder = 1,
+            SectionClosedFolder = 2,
+            SectionBoundingDivider = 3,
+        };
+        uint32_t section_type;
+        Signature section_blend_key; // 0 if not stored in the divider
+
+        int64_t images_pos; // stream position of the channel image data
+        bool images_loaded() const { return channel_info_data.size() == channel_infos.size(); }
+        uint64_t images_size() const;
+        int64_t channel_pos(size_t slot) const; // stream position of one channel's image data
+        Rect bounds() const
+        {
+            return Rect((int32_t)(uint32_t)top, (int32_t)(uint32_t)left, (int32_t)(uint32_t)bottom, (int32_t)(uint32_t)right);
+        }
+        // rectangle covered by a channel: layer bounds, or the mask rectangles for -2/-3
+        void channel_bounds(int16_t id, int32_t& top, int32_t& left, int32_t& bottom, int32_t& right) const;
+
+        // block_data false reads only the extra data this function interprets
+        bool read(std::istream& f, bool block_data = true);
         bool write(std::ostream& f);
-        bool read_images(std::istream& f);
+        bool read_images(std::istream& f, HashMode hash_mode = HashMode::None);
         bool write_images(std::ostream& f);
     };
 
+    // Compact per-layer metadata laid out as structure of arrays, so filters
+    // over thousands of layers only touch the columns they need.
+    struct LayerTable
+    {
+        // bit_flags
+        enum : uint8_t
+        {
+            TransparencyProtected = 1,
+            Hidden = 2,
+            PixelDataIrrelevant = 8,
+        };
+
+        // bits of extra_keys, one per well-known extra data key
+        enum ExtraKey : uint32_t
+        {
+            Key_luni = 1u<<0,
+            Key_lyid = 1u<<1,
+            Key_lsct = 1u<<2,
+            Key_lsdk = 1u<<3,
+            Key_TySh = 1u<<4,
+            Key_SoLd = 1u<<5,
+            Key_PlLd = 1u<<6,
+            Key_lfx2 = 1u<<7,
+            Key_lrFX = 1u<<8,
+            Key_vmsk = 1u<<9,
+            Key_vsms = 1u<<10,
+            Key_levl = 1u<<11,
+            Key_curv = 1u<<12,
+            Key_hue2 = 1u<<13,
+            Key_brit = 1u<<14,
+            Key_mixr = 1u<<15,
+            Key_SoCo = 1u<<16,
+            Key_GdFl = 1u<<17,
+            Key_PtFl = 1u<<18,
+            Key_Other = 1u<<31,
+        };
+        static uint32_t extra_key_bit(Signature key);
+
+        std::vector<int32_t> top, left, bottom, right;
+        std::vector<uint32_t> blend_key; // same byte order as Signature::sig
+        std::vector<uint8_t> opacity;
+        std::vector<uint8_t> clipping;
+        std::vector<uint8_t> bit_flags;
+        std::vector<uint16_t> num_channels;
+        std::vector<uint32_t> extra_keys;
+        std::vector<uint32_t> name_offset; // size()+1 entries into names
+        std::string names; // utf8 names, back to back
+
+        size_t size() const { return opacity.size(); }
+        void clear();
+        void build(const std::vector<Layer>& layers);
+
+        bool visible(size_t i) const { return (bit_flags[i] & Hidden) == 0; }
+        bool has_key(size_t i, uint32_t bits) const { return (extra_keys[i] & bits) != 0; }
+        std::string name(size_t i) const
+        {
+            return names.substr(name_offset[i], name_offset[i+1]-name_offset[i]);
+        }
+    };
+
+    struct LayerGroup
+    {
+        LayerGroup()
+            : layer(-1), divider(-1), parent(-1), collapsed(false), pass_through(false)
+        {}
+        int32_t layer; // folder layer index; -1 for the root
+        int32_t divider; // bounding section divider layer index; -1 for the root
+        int32_t parent; // index into LayerInfo::groups; -1 for the root
+        std::vector<int32_t> children; // direct child layer indices, bottom to top
+        std::vector<int32_t> subgroups; // direct child group indices, bottom to top
+        std::string name;
+        Signature blend_key;
+        bool collapsed;
+        bool pass_through;
+
+        // layers of a group are stored contiguously, from its divider to its folder layer
+        int32_t first() const { return divider; }
+        int32_t last() const { return layer; }
+    };
+
     struct LayerInfo
     {
         LayerInfo()
-            : num_layers(0), has_merged_alpha_channel(false)
+            : num_layers(0), has_merged_alpha_channel(false), hash_mode(HashMode::None), block_data(true)
         {}
         be<int16_t> num_layers;
         bool has_merged_alpha_channel;
         std::vector<Layer> layers;
+        LayerTable table; // rebuilt by read(); call table.build(layers) after editing layers
+        std::vector<LayerGroup> groups; // groups[0] is the document root
+        std::vector<int32_t> layer_groups; // per layer, index of the enclosing group
 
-        bool read(std::istream& stream);
+        // lookup indexes into layers, rebuilt by read(); call build_index() after editing layers
+        std::unordered_map<std::string, std::vector<int32_t>> name_index; // utf8name
+        std::unordered_map<uint32_t, int32_t> id_index; // lyid
+        std::unordered_map<uint32_t, std::vector<int32_t>> key_index; // extra data key (Signature::sig)
+
+        void build_index();
+        const std::vector<int32_t>& find_layers(const std::string& utf8name) const;
+        const std::vector<int32_t>& find_layers_with_key(Signature key) const;
+        Layer* find_layer(const std::string& utf8name);
+        Layer* find_layer_by_id(uint32_t id);
+
+        void build_groups();
+        int32_t find_group(const std::string& utf8name) const;
+        bool read_images(std::istream& f, int32_t first, int32_t last);
+
+        HashMode hash_mode; // used by read() and read_images()
+        bool block_data; // used by read(), see Layer::read()
+
+        bool read(std::istream& stream, bool read_images = true);
         bool write(std::ostream& stream);
     };
 
@@ -315,20 +738,83 @@ namespace psd
             psd();
             template <typename Stream>
             psd(Stream&& stream)
+                : valid_(false), merged_image_skipped_(false), block_data_skipped_(false), resolution_info_parsed_(false), has_resolution_info_(false)
             {
                 load(stream);
             }
 
+            struct LoadOptions
+            {
+                LoadOptions()
+                    : layer_images(true), merged_image(true), block_data(true), hash(HashMode::None)
+                {}
+                bool layer_images; // false defers layer pixels until load_layer_images()
+                bool merged_image; // false reads only its compression method; the document cannot be saved
+                // false skips the data of tagged blocks the loader does not use
+                // itself, keeping their keys and lengths; the document cannot be saved
+                bool block_data;
+                HashMode hash; // content hashes of layer channels
+            };
+
             bool load(std::istream& stream);
+            bool load(std::istream& stream, const LoadOptions& options);
+            // reads from memory in place, e.g. a LinkedFile::data holding a nested .psd
+            bool load(Slice data);
+            bool load(Slice data, const LoadOptions& options);
+            bool load_layer_images(std::istream& stream);
+            bool load_group_images(std::istream& stream, int32_t group);
             bool save(std::ostream& f);
+            // promise that every pixel edit of the loaded layers is marked
+            // dirty; saves then cost in proportion to the edited rows
+            void track_edits(bool enable);
+
+            struct EstimateOptions
+            {
+                EstimateOptions()
+                    : sample_rows(256), sample_bytes(8 << 20), verify_cached(false)
+                {}
+                uint32_t sample_rows; // at most this many rows PackBits encoded per channel
+                uint64_t sample_bytes; // total encoding budget; large documents get fewer rows per channel
+                bool verify_cached; // rehash channels before trusting their last encoding
+            };
+            struct SizeEstimate
+            {
+                SizeEstimate()
+                    : bytes(0), low(0), high(0), exact_bytes(0)
+                {}
+                uint64_t bytes; // expected output size of save()
+                uint64_t low, high; // 3 standard errors around bytes for sampled channels
+                uint64_t exact_bytes; // headers, records, resources and cached encodings
+                bool exact() const { return low == high; }
+            };
+            // size of save() without encoding everything; layers whose images
+            // are not loaded count with their stored channel sizes
+            SizeEstimate estimate_saved_size();
+            SizeEstimate estimate_saved_size(const EstimateOptions& options);
 
             Header header;
 
             std::vector<ImageResourceBlock> image_resources;
+            std::unordered_map<uint16_t, size_t> image_resource_index; // ID -> index into image_resources
+            void build_image_resource_index();
+            ImageResourceBlock* get_image_resource(uint16_t id);
+
+            // typed image resources, parsed on first access and cached; null if absent
+            const ResolutionInfo* resolution_info();
+            Slice icc_profile(); // 1039
+            Slice xmp(); // 1060
 
             LayerInfo layer_info;
             GlobalLayerMaskInfo global_layer_mask_info;
             std::vector<char> additional_layer_data;
+
+            // tagged blocks of additional_layer_data, as views into it
+            std::vector<std::pair<Signature, Slice>> additional_layer_blocks() const;
+            // keys and lengths of those blocks, also when their data was skipped
+            std::vector<std::pair<Signature, uint64_t>> additional_layer_block_sizes() const;
+            // files of the global and per-layer lnk2/lnkD/lnk3 blocks; the data
+            // views stay valid as long as the blocks are not modified
+            std::vector<LinkedFile> linked_files();
             std::vector<Layer>& layers() { return layer_info.layers; }
 
             MultipleImageData merged_image;
@@ -338,7 +824,8 @@ namespace psd
             bool read_header(std::istream& f);
             bool read_color_mode(std::istream& f);
             bool read_image_resources(std::istream& f);
-            bool read_layers_and_masks(std::istream& f);
+            bool read_layers_and_masks(std::istream& f, const LoadOptions& options);
+            bool skip_layer_blocks(std::istream& f, uint64_t size);
 
             bool read_layer_info(std::istream& f);
 
@@ -348,6 +835,13 @@ namespace psd
             bool write_layers_and_masks(std::ostream& f);
 
             bool valid_;
+            bool merged_image_skipped_;
+            bool block_data_skipped_;
+            std::vector<std::pair<Signature, uint64_t>> skipped_blocks_; // global blocks read with block_data false
+
+            bool resolution_info_parsed_;
+            bool has_resolution_info_;
+            ResolutionInfo resolution_info_;
 
     };
 
@@ -0,0 +1,581 @@
+#define MINIZ_NO_STDIO
+#define MINIZ_NO_ARCHIVE_APIS
+#define MINIZ_NO_TIME
+#define MINIZ_NO_ZLIB_APIS
+
+// the bundled miniz is kept as released; -Wall only checks our code
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmisleading-indentation"
+extern "C" {
+#include "../example_psd2pnd/miniz.c"
+}
+#pragma GCC diagnostic pop
+
+#include "pipeline.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <errno.h>
+#include <sys/stat.h>
+
+namespace psdexport
+{
+    // largest thumbnail bound or deepzoom tile
+    static const unsigned long max_output_size = 1 << 16;
+
+    bool Output::parse(const std::string& spec, Output& out)
+    {
+        auto eq = spec.find('=');
+        if (eq == std::string::npos || eq + 1 == spec.size())
+            return false;
+        std::string kind = spec.substr(0, eq);
+        out.path = spec.substr(eq + 1);
+        out.size = 0;
+        auto colon = kind.find(':');
+        if (colon != std::string::npos)
+        {
+            // digits only: strtoul would take "-1" as ULONG_MAX
+            const char* digits = kind.c_str() + colon + 1;
+            char* e = nullptr;
+            errno = 0;
+            unsigned long size = *digits >= '0' && *digits <= '9' ? std::strtoul(digits, &e, 10) : 0;
+            if (e == nullptr || *e != 0 || errno == ERANGE || size == 0 || size > max_output_size)
+                return false;
+            out.size = size;
+            kind.resize(colon);
+        }
+        if (kind == "composite")
+            out.kind = Composite;
+        else if (kind == "thumbnail")
+            out.kind = Thumbnail;
+        else if (kind == "deepzoom")
+            out.kind = DeepZoom;
+        else if (kind == "layers")
+            out.kind = Layers;
+        else if (kind == "metadata")
+            out.kind = Metadata;
+        else
+            return false;
+        if (out.kind == Thumbnail && out.size == 0)
+            out.size = 256;
+        if (out.kind == DeepZoom && out.size == 0)
+            out.size = 254;
+        return true;
+    }
+
+    // a shared intermediate; freed once its last reader is done
+    struct Slot
+    {
+        Slot()
+            : bytes(0), readers(0)
+        {}
+        std::unique_ptr<psd::psd> doc;
+        psd::Image image;
+        uint64_t bytes;
+        size_t readers;
+    };
+
+    struct Task
+    {
+        Task()
+            : output(-1), estimate(0), waiting(0), skip(false)
+        {}
+        std::string name;
+        std::function<bool()> run;
+        std::vector<size_t> inputs; // slots read
+        int32_t output; // slot written, -1 if none
+        uint64_t estimate; // bytes of the output slot
+        std::vector<size_t> next; // tasks waiting for this one
+        size_t waiting; // unfinished tasks this one waits for
+        bool skip; // an input failed
+    };
+
+    class Graph
+    {
+    public:
+        size_t add_slot()
+        {
+            slots_.emplace_back();
+            producers_.push_back(-1);
+            return slots_.size() - 1;
+        }
+
+        Slot& slot(size_t i) { return slots_[i]; }
+
+        // runs after the producers of its inputs
+        void add(const std::string& name, const std::vector<size_t>& inputs, int32_t output, uint64_t estimate, std::function<bool()> run)
+        {
+            Task t;
+            t.name = name;
+            t.run = std::move(run);
+            t.inputs = inputs;
+            t.output = output;
+            t.estimate = estimate;
+            size_t index = tasks_.size();
+            for(auto s:inputs)
+            {
+                slots_[s].readers ++;
+                if (producers_[s] >= 0)
+                {
+                    tasks_[producers_[s]].next.push_back(index);
+                    t.waiting ++;
+                }
+            }
+            if (output >= 0)
+                producers_[output] = index;
+            tasks_.push_back(std::move(t));
+        }
+
+        void execute(unsigned threads, uint64_t budget, Report& report)
+        {
+            for(size_t i = 0; i < tasks_.size(); i ++)
+                if (!tasks_[i].waiting)
+                    ready_.insert(i);
+            live_ = 0;
+            running_ = 0;
+            remaining_ = tasks_.size();
+            std::vector<std::thread> workers;
+            for(unsigned t = 0; t < threads; t ++)
+                workers.emplace_back([this, budget, &report] { work(budget, report); });
+            for(auto& w:workers)
+                w.join();
+            report.tasks = tasks_.size();
+        }
+
+    private:
+        void work(uint64_t budget, Report& report)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            for(;;)
+            {
+                // lowest index first, so producers run ahead of their consumers
+                auto pick = ready_.end();
+                cv_.wait(lock, [&]
+                {
+                    if (!remaining_)
+                        return true;
+                    for(pick = ready_.begin(); pick != ready_.end(); ++ pick)
+                        if (!running_ || live_ + tasks_[*pick].estimate <= budget)
+                            return true;
+                    return false;
+                });
+                if (!remaining_)
+                    return;
+                size_t i = *pick;
+                ready_.erase(pick);
+                Task& t = tasks_[i];
+                live_ += t.estimate;
+                running_ ++;
+
+                bool ok = true;
+                if (!t.skip)
+                {
+                    lock.unlock();
+                    ok = t.run();
+                    lock.lock();
+                    if (!ok)
+                        report.errors.push_back(t.name + " failed");
+                }
+                else
+                    ok = false;
+
+                if (t.output >= 0)
+                    live_ = live_ - t.estimate + slots_[t.output].bytes;
+                else
+                    live_ -= t.estimate;
+                report.peak_bytes = std::max(report.peak_bytes, live_);
+                for(auto s:t.inputs)
+                {
+                    Slot& slot = slots_[s];
+                    if (-- slot.readers == 0)
+                    {
+                        live_ -= slot.bytes;
+                        slot.doc.reset();
+                        psd::Image().pixels.swap(slot.image.pixels);
+                        slot.bytes = 0;
+                    }
+                }
+                for(auto n:t.next)
+                {
+                    tasks_[n].skip = tasks_[n].skip || !ok;
+                    if (-- tasks_[n].waiting == 0)
+                        ready_.insert(n);
+                }
+                running_ --;
+                remaining_ --;
+                cv_.notify_all();
+            }
+        }
+
+        std::vector<Slot> slots_;
+        std::vector<int32_t> producers_;
+        std::vector<Task> tasks_;
+
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::set<size_t> ready_;
+        uint64_t live_;
+        size_t running_;
+        size_t remaining_;
+    };
+
+    static void make_dir(const std::string& path)
+    {
+        if (::mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+            std::cerr << "cannot create " << path << std::endl;
+    }
+
+    static bool write_file(const std::string& path, const void* data, size_t size)
+    {
+        std::ofstream f(path, std::ios::binary);
+        if (!f.write((const char*)data, size) || !f.flush())
+        {
+            std::cerr << "cannot write " << path << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    static bool write_png(const std::string& path, const psd::Image& image, const psd::Rect& r)
+    {
+        std::vector<uint8_t> pixels((size_t)(r.right - r.left)*(r.bottom - r.top)*4);
+        uint8_t* d = pixels.data();
+        for(int32_t y = r.top; y < r.bottom; y ++, d += (r.right - r.left)*4)
+            std::memcpy(d, image.row(y) + r.left*4, (r.right - r.left)*4);
+        size_t png_size = 0;
+        void* png = tdefl_write_image_to_png_file_in_memory(pixels.data(), r.right - r.left, r.bottom - r.top, 4, &png_size);
+        if (png == nullptr)
+            return false;
+        bool ok = write_file(path, png, png_size);
+        free(png);
+        return ok;
+    }
+
+    static bool write_png(const std::string& path, const psd::Image& image)
+    {
+        return write_png(path, image, psd::Rect(0, 0, image.h, image.w));
+    }
+
+    // box filter, colors weighted by alpha
+    static void downscale(const psd::Image& src, uint32_t w, uint32_t h, psd::Image& out)
+    {
+        out.resize(w, h);
+        for(uint32_t y = 0; y < out.h; y ++)
+        {
+            uint32_t y0 = (uint64_t)y * src.h / out.h, y1 = std::max(y0 + 1, (uint32_t)((uint64_t)(y + 1) * src.h / out.h));
+            for(uint32_t x = 0; x < out.w; x ++)
+            {
+                uint32_t x0 = (uint64_t)x * src.w / out.w, x1 = std::max(x0 + 1, (uint32_t)((uint64_t)(x + 1) * src.w / out.w));
+                uint64_t sum[4] = {0, 0, 0, 0};
+                for(uint32_t sy = y0; sy < y1; sy ++)
+                {
+                    const uint8_t* p = src.row(sy) + x0*4;
+                    for(uint32_t sx = x0; sx < x1; sx ++, p += 4)
+                    {
+                        sum[0] += p[0] * p[3];
+                        sum[1] += p[1] * p[3];
+                        sum[2] += p[2] * p[3];
+                        sum[3] += p[3];
+                    }
+                }
+                uint8_t* q = out.row(y) + x*4;
+                uint64_t n = (uint64_t)(x1 - x0) * (y1 - y0);
+                for(int c = 0; c < 3; c ++)
+                    q[c] = sum[3] ? (sum[c] + sum[3]/2) / sum[3] : 0;
+                q[3] = (sum[3] + n/2) / n;
+            }
+        }
+    }
+
+    static uint64_t document_bytes(psd::psd& doc)
+    {
+        uint64_t bytes = 0;
+        for(auto& l:doc.layers())
+            for(auto& id:l.channel_info_data)
+                bytes += (uint64_t)id.w*id.h;
+        return bytes;
+    }
+
+    // the layer's own pixels, without opacity, mask or blending
+    static bool layer_image(psd::psd& doc, psd::Layer& l, psd::Image& out)
+    {
+        psd::Rect r = l.bounds();
+        if (r.empty() || doc.header.bit_depth != 8 || l.section_type != psd::Layer::SectionOther)
+            return false;
+        uint32_t w = r.right - r.left, h = r.bottom - r.top;
+        bool gray = doc.header.color_mode == (uint16_t)psd::ColorMode::Grayscale;
+        psd::ImageData* ch[4];
+        for(int c = 0; c < 4; c ++)
+        {
+            ch[c] = l.get_channel_info_by_id(c == 3 ? -1 : gray ? 0 : c);
+            if (ch[c] != nullptr && (ch[c]->data.size() != h || (h && ch[c]->data[0].size() < w)))
+                ch[c] = nullptr;
+            if (ch[c] == nullptr && c < 3)
+                return false;
+        }
+        out.resize(w, h);
+        for(uint32_t y = 0; y < h; y ++)
+        {
+            uint8_t* d = out.row(y);
+            for(uint32_t x = 0; x < w; x ++, d += 4)
+                for(int c = 0; c < 4; c ++)
+                    d[c] = ch[c] ? (uint8_t)ch[c]->data[y][x] : 255;
+        }
+        return true;
+    }
+
+    static std::string json_string(const std::string& s)
+    {
+        std::string out = "\"";
+        for(unsigned char c:s)
+        {
+            if (c == '"' || c == '\\')
+                out += '\\', out += c;
+            else if (c < 0x20)
+            {
+                char buffer[8];
+                snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                out += buffer;
+            }
+            else
+                out += c;
+        }
+        return out + "\"";
+    }
+
+    static bool write_metadata(const std::string& path, psd::psd& doc)
+    {
+        std::ostringstream os;
+        auto& h = doc.header;
+        os << "{\"width\":" << h.width << ",\"height\":" << h.height
+           << ",\"channels\":" << h.num_channels << ",\"depth\":" << h.bit_depth
+           << ",\"color_mode\":" << h.color_mode << ",\"layers\":[";
+        auto& layers = doc.layers();
+        for(size_t i = 0; i < layers.size(); i ++)
+        {
+            auto& l = layers[i];
+            psd::Rect r = l.bounds();
+            uint32_t blend = l.blend_key;
+            char blend_key[4] = {(char)(blend >> 24), (char)(blend >> 16), (char)(blend >> 8), (char)blend};
+            os << (i ? "," : "") << "{\"index\":" << i
+               << ",\"name\":" << json_string(l.utf8name)
+               << ",\"bounds\":[" << r.top << "," << r.left << "," << r.bottom << "," << r.right << "]"
+               << ",\"blend\":" << json_string(std::string(blend_key, 4))
+               << ",\"opacity\":" << (int)l.opacity
+               << ",\"visible\":" << ((l.bit_flags & psd::LayerTable::Hidden) ? "false" : "true")
+               << ",\"section\":" << l.section_type;
+            if (l.has_layer_id)
+                os << ",\"id\":" << l.layer_id;
+            os << "}";
+        }
+        os << "]}\n";
+        std::string json = os.str();
+        return write_file(path, json.data(), json.size());
+    }
+
+    bool run(const std::string& psd_path, const std::vector<Output>& outputs, const Options& options, Report& report)
+    {
+        auto start = std::chrono::steady_clock::now();
+        report = Report();
+
+        // the header decides the size of every intermediate up front
+        psd::psd probe;
+        {
+            std::ifstream f(psd_path, std::ios::binary);
+            psd::psd::LoadOptions header_only;
+            header_only.layer_images = false;
+            header_only.merged_image = false;
+            if (!f || !probe.load(f, header_only))
+            {
+                report.errors.push_back("cannot read " + psd_path);
+                return false;
+            }
+        }
+        uint32_t w = probe.header.width, h = probe.header.height;
+        uint64_t file_size = 0;
+        {
+            struct stat st;
+            if (::stat(psd_path.c_str(), &st) == 0)
+                file_size = st.st_size;
+        }
+
+        // level k is the composite halved k times, rounding up
+        std::vector<std::pair<uint32_t, uint32_t>> level_size(1, std::make_pair(w, h));
+        size_t levels = 0; // needed beyond level 0
+        bool need_composite = false;
+        for(auto& o:outputs)
+        {
+            if (o.kind == Output::Composite || o.kind == Output::Thumbnail || o.kind == Output::DeepZoom)
+                need_composite = true;
+            if (o.kind == Output::DeepZoom)
+                while(level_size.back().first > 1 || level_size.back().second > 1)
+                    level_size.push_back(std::make_pair((level_size.back().first + 1)/2, (level_size.back().second + 1)/2));
+            if (o.kind == Output::Thumbnail)
+                while(std::max(level_size.back().first, level_size.back().second) >= 2*o.size)
+                    level_size.push_back(std::make_pair((level_size.back().first + 1)/2, (level_size.back().second + 1)/2));
+        }
+        // smallest level still at least as large as a thumbnail
+        auto level_for = [&](uint32_t size)
+        {
+            size_t k = 0;
+            while(k + 1 < level_size.size() && std::max(level_size[k+1].first, level_size[k+1].second) >= size)
+                k ++;
+            return k;
+        };
+        for(auto& o:outputs)
+            if (o.kind == Output::Thumbnail)
+                levels = std::max(levels, level_for(o.size));
+            else if (o.kind == Output::DeepZoom)
+                levels = level_size.size() - 1;
+
+        Graph graph;
+        size_t doc_slot = graph.add_slot();
+        graph.add("decode", {}, doc_slot, file_size*2, [&graph, doc_slot, &psd_path]
+        {
+            Slot& s = graph.slot(doc_slot);
+            std::ifstream f(psd_path, std::ios::binary);
+            psd::psd::LoadOptions options;
+            options.merged_image = false;
+            s.doc.reset(new psd::psd);
+            if (!f || !s.doc->load(f, options))
+                return false;
+            s.bytes = document_bytes(*s.doc);
+            return true;
+        });
+
+        std::vector<size_t> level_slots;
+        if (need_composite)
+        {
+            for(size_t k = 0; k <= levels; k ++)
+            {
+                size_t slot = graph.add_slot();
+                uint64_t bytes = (uint64_t)level_size[k].first*level_size[k].second*4;
+                if (k == 0)
+                    graph.add("composite", {doc_slot}, slot, bytes, [&graph, doc_slot, slot]
+                    {
+                        Slot& s = graph.slot(slot);
+                        psd::Compositor compositor(*graph.slot(doc_slot).doc);
+                        if (!compositor.render(s.image))
+                            return false;
+                        s.bytes = s.image.pixels.size();
+                        return true;
+                    });
+                else
+                {
+                    auto size = level_size[k];
+                    size_t from = level_slots.back();
+                    graph.add("level " + std::to_string(k), {from}, slot, bytes, [&graph, from, slot, size]
+                    {
+                        Slot& s = graph.slot(slot);
+                        downscale(graph.slot(from).image, size.first, size.second, s.image);
+                        s.bytes = s.image.pixels.size();
+                        return true;
+                    });
+                }
+                level_slots.push_back(slot);
+            }
+        }
+
+        for(auto& o:outputs)
+        {
+            std::string path = o.path;
+            switch(o.kind)
+            {
+                case Output::Composite:
+                    graph.add("composite " + path, {level_slots[0]}, -1, 0, [&graph, &level_slots, path]
+                    {
+                        return write_png(path, graph.slot(level_slots[0]).image);
+                    });
+                    break;
+                case Output::Thumbnail:
+                    {
+                        size_t from = level_slots[level_for(o.size)];
+                        uint32_t max_size = o.size;
+                        graph.add("thumbnail " + path, {from}, -1, 0, [&graph, from, max_size, path]
+                        {
+                            auto& src = graph.slot(from).image;
+                            uint32_t longest = std::max(src.w, src.h);
+                            if (longest <= max_size)
+                                return write_png(path, src);
+                            double scale = (double)longest / max_size;
+                            psd::Image thumb;
+                            downscale(src, std::max<uint32_t>(1, src.w / scale + 0.5), std::max<uint32_t>(1, src.h / scale + 0.5), thumb);
+                            return write_png(path, thumb);
+                        });
+                    }
+                    break;
+                case Output::DeepZoom:
+                    {
+                        std::ostringstream dzi;
+                        dzi << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                            << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"png\" Overlap=\"1\" TileSize=\"" << o.size << "\">\n"
+                            << "  <Size Width=\"" << w << "\" Height=\"" << h << "\"/>\n"
+                            << "</Image>\n";
+                        std::string xml = dzi.str();
+                        make_dir(path + "_files");
+                        if (!write_file(path + ".dzi", xml.data(), xml.size()))
+                            report.errors.push_back("cannot write " + path + ".dzi");
+                        // deepzoom level 0 is 1 x 1, the last is full size; one task per tile row
+                        int32_t tile = o.size;
+                        for(size_t k = 0; k < level_slots.size(); k ++)
+                        {
+                            std::string dir = path + "_files/" + std::to_string(level_slots.size() - 1 - k);
+                            make_dir(dir);
+                            int32_t lw = level_size[k].first, lh = level_size[k].second;
+                            size_t from = level_slots[k];
+                            for(int32_t row = 0; row*tile < lh; row ++)
+                            {
+                                graph.add("deepzoom " + dir, {from}, -1, 0, [&graph, from, dir, row, tile, lw, lh]
+                                {
+                                    auto& image = graph.slot(from).image;
+                                    int32_t top = std::max(0, row*tile - 1), bottom = std::min(lh, (row + 1)*tile + 1);
+                                    for(int32_t col = 0; col*tile < lw; col ++)
+                                    {
+                                        int32_t left = std::max(0, col*tile - 1), right = std::min(lw, (col + 1)*tile + 1);
+                                        std::string name = dir + "/" + std::to_string(col) + "_" + std::to_string(row) + ".png";
+                                        if (!write_png(name, image, psd::Rect(top, left, bottom, right)))
+                                            return false;
+                                    }
+                                    return true;
+                                });
+                            }
+                        }
+                    }
+                    break;
+                case Output::Layers:
+                    make_dir(path);
+                    for(size_t i = 0; i < probe.layers().size(); i ++)
+                    {
+                        graph.add("layer " + std::to_string(i), {doc_slot}, -1, 0, [&graph, doc_slot, path, i]
+                        {
+                            psd::psd& doc = *graph.slot(doc_slot).doc;
+                            psd::Image image;
+                            if (i >= doc.layers().size() || !layer_image(doc, doc.layers()[i], image))
+                                return true;
+                            return write_png(path + "/" + std::to_string(i) + ".png", image);
+                        });
+                    }
+                    break;
+                case Output::Metadata:
+                    graph.add("metadata " + path, {doc_slot}, -1, 0, [&graph, doc_slot, path]
+                    {
+                        return write_metadata(path, *graph.slot(doc_slot).doc);
+                    });
+                    break;
+            }
+        }
+
+        unsigned threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+        graph.execute(threads, options.memory_budget, report);
+        report.ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        return report.errors.empty();
+    }
+}
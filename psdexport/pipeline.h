@@ -0,0 +1,61 @@
+#pragma once
+
+#include "../composite.h"
+
+namespace psdexport
+{
+    // One requested product of a document, written as "KIND[:SIZE]=PATH":
+    //   composite=x.png            full size composite
+    //   thumbnail:256=t.png        composite scaled to fit 256 x 256
+    //   deepzoom:254=dz            dz.dzi and dz_files/LEVEL/COL_ROW.png, 254 pixel tiles
+    //   layers=dir                 dir/INDEX.png for every pixel layer
+    //   metadata=m.json            header and layer records
+    struct Output
+    {
+        enum Kind
+        {
+            Composite,
+            Thumbnail,
+            DeepZoom,
+            Layers,
+            Metadata,
+        };
+
+        Output()
+            : kind(Composite), size(0)
+        {}
+        Kind kind;
+        uint32_t size; // thumbnail bound or deepzoom tile size
+        std::string path;
+
+        static bool parse(const std::string& spec, Output& out);
+    };
+
+    struct Options
+    {
+        Options()
+            : threads(0), memory_budget(1ull << 30)
+        {}
+        unsigned threads; // 0 for one per core
+        // bytes of intermediate images held at once; a task that would go
+        // past it waits for others to release theirs, unless nothing runs
+        uint64_t memory_budget;
+    };
+
+    struct Report
+    {
+        Report()
+            : tasks(0), peak_bytes(0), ms(0)
+        {}
+        size_t tasks;
+        uint64_t peak_bytes; // of intermediates, the decoded document included
+        int64_t ms;
+        std::vector<std::string> errors;
+    };
+
+    // Decodes the document once and runs every output as a graph of tasks
+    // over the shared intermediates: the decoded document, the composite and
+    // its chain of half size levels. Each intermediate is released as soon
+    // as its last consumer finishes.
+    bool run(const std::string& psd_path, const std::vector<Output>& outputs, const Options& options, Report& report);
+}
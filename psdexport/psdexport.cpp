@@ -0,0 +1,46 @@
+#include "pipeline.h"
+
+int main(int argc, char** argv)
+{
+    psdexport::Options options;
+    int i = 1;
+    for(; i + 1 < argc && argv[i][0] == '-'; i += 2)
+    {
+        std::string arg = argv[i];
+        if (arg == "-j")
+            options.threads = std::max(1, atoi(argv[i+1]));
+        else if (arg == "-m")
+            options.memory_budget = (uint64_t)std::max(1, atoi(argv[i+1])) << 20;
+        else
+            break;
+    }
+    std::vector<psdexport::Output> outputs;
+    for(int k = i + 1; k < argc; k ++)
+    {
+        psdexport::Output o;
+        if (!psdexport::Output::parse(argv[k], o))
+        {
+            std::cerr << "bad output: " << argv[k] << std::endl;
+            return -1;
+        }
+        outputs.push_back(o);
+    }
+    if (i >= argc || outputs.empty())
+    {
+        std::cout << argv[0] << " [-j threads] [-m memory MB] [psd file] OUTPUT..." << std::endl;
+        std::cout << std::endl;
+        std::cout << "\tDecodes the file once and writes every OUTPUT from it:" << std::endl;
+        std::cout << "\tcomposite=PNG thumbnail:SIZE=PNG deepzoom:TILE=PATH layers=DIR metadata=JSON" << std::endl;
+        std::cout << std::endl;
+        return -1;
+    }
+
+    // the library reports parse details on stdout
+    std::cout.setstate(std::ios::failbit);
+    psdexport::Report report;
+    bool ok = psdexport::run(argv[i], outputs, options, report);
+    for(auto& e:report.errors)
+        std::cerr << e << std::endl;
+    std::cerr << report.tasks << " tasks, peak " << (report.peak_bytes >> 10) << " KB, " << report.ms << " ms" << std::endl;
+    return ok ? 0 : 1;
+}
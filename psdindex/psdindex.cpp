@@ -0,0 +1,117 @@
+#include <chrono>
+#include <cstring>
+
+#include "../catalog.h"
+
+// discards everything without any state, so scanning threads can share it
+class NullBuffer : public std::streambuf
+{
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+static void usage(const char* argv0)
+{
+    std::cout << argv0 << " [-i index] [-j threads] scan DIR..." << std::endl;
+    std::cout << argv0 << " [-i index] find [-n NAME] [-w MIN:MAX] [-h MIN:MAX] [-m MODE] [-d DEPTH] [-k KEY]..." << std::endl;
+    std::cout << std::endl;
+    std::cout << "\tscan updates the index, re-reading only files whose size, mtime or inode changed" << std::endl;
+    std::cout << "\tfind prints matching files; -n matches a layer name substring, -k a tagged block key" << std::endl;
+    std::cout << std::endl;
+}
+
+static void parse_range(const char* s, uint32_t& low, uint32_t& high)
+{
+    const char* colon = strchr(s, ':');
+    if (!colon)
+    {
+        low = high = strtoul(s, nullptr, 10);
+        return;
+    }
+    if (colon != s)
+        low = strtoul(s, nullptr, 10);
+    if (colon[1])
+        high = strtoul(colon + 1, nullptr, 10);
+}
+
+int main(int argc, char** argv)
+{
+    std::string index_path = "psd.idx";
+    unsigned threads = 0;
+    int i = 1;
+    for(; i + 1 < argc && argv[i][0] == '-'; i += 2)
+    {
+        if (!strcmp(argv[i], "-i"))
+            index_path = argv[i+1];
+        else if (!strcmp(argv[i], "-j"))
+            threads = std::max(1, atoi(argv[i+1]));
+        else
+            break;
+    }
+    if (i >= argc)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    psd::Catalog catalog;
+    catalog.load(index_path);
+    std::string command = argv[i++];
+    if (command == "scan" && i < argc)
+    {
+        for(; i < argc; i ++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            // the library reports parse details on stdout
+            NullBuffer discard;
+            auto saved = std::cout.rdbuf(&discard);
+            auto stats = catalog.scan(argv[i], threads);
+            std::cout.rdbuf(saved);
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            std::cerr << argv[i] << ": " << stats.files << " files, " << stats.parsed << " parsed ("
+                      << stats.failed << " failed), " << stats.reused << " unchanged, "
+                      << stats.removed << " removed, " << ms << " ms" << std::endl;
+        }
+        if (!catalog.save(index_path))
+        {
+            std::cerr << "cannot write " << index_path << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (command != "find")
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    psd::Catalog::Query query;
+    for(; i + 1 < argc; i += 2)
+    {
+        std::string opt = argv[i];
+        const char* value = argv[i+1];
+        if (opt == "-n")
+            query.layer_name = value;
+        else if (opt == "-w")
+            parse_range(value, query.min_width, query.max_width);
+        else if (opt == "-h")
+            parse_range(value, query.min_height, query.max_height);
+        else if (opt == "-m")
+            query.color_mode = atoi(value);
+        else if (opt == "-d")
+            query.depth = atoi(value);
+        else if (opt == "-k")
+            query.keys.push_back(psd::Catalog::key(value));
+        else
+            break;
+    }
+    if (i < argc)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    for(auto e:catalog.find(query))
+        std::cout << e->path << "\t" << e->width << "x" << e->height << "\t" << e->layers.size() << " layers" << std::endl;
+    return 0;
+}
@@ -0,0 +1,238 @@
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include "../psd.h"
+
+// Prints the structure of .psd files as JSON without decoding any pixels:
+// layer channels are skipped by their recorded sizes and only the two byte
+// compression method of each channel is read. Tagged block data is skipped
+// too, as only keys and sizes are printed. Large document (.psb, version 2)
+// files are not supported by the library and are reported as errors.
+
+// discards everything without any state, so threads can share it
+class NullBuffer : public std::streambuf
+{
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+static std::string json_string(const std::string& s)
+{
+    std::string out = "\"";
+    for(unsigned char c:s)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\', out += c;
+        else if (c < 0x20)
+        {
+            char buffer[8];
+            snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            out += buffer;
+        }
+        else
+            out += c;
+    }
+    return out + "\"";
+}
+
+static std::string key_string(psd::Signature key)
+{
+    return json_string(std::string((char*)&key.sig, 4));
+}
+
+static std::string rect_json(const psd::Rect& r)
+{
+    std::ostringstream os;
+    os << "[" << r.top << "," << r.left << "," << r.bottom << "," << r.right << "]";
+    return os.str();
+}
+
+static int compression_method(std::istream& f, int64_t pos)
+{
+    psd::be<uint16_t> method;
+    f.clear();
+    f.seekg(pos);
+    if (!f.read((char*)&method, 2))
+        return -1;
+    return method;
+}
+
+static void group_json(std::ostream& os, psd::LayerInfo& info, int32_t g)
+{
+    auto& group = info.groups[g];
+    os << "{\"name\":" << json_string(group.name)
+       << ",\"layer\":" << group.layer
+       << ",\"divider\":" << group.divider;
+    if (g)
+        os << ",\"blend\":" << key_string(group.blend_key)
+           << ",\"collapsed\":" << (group.collapsed ? "true" : "false")
+           << ",\"pass_through\":" << (group.pass_through ? "true" : "false");
+    os << ",\"layers\":[";
+    for(size_t i = 0; i < group.children.size(); i ++)
+        os << (i ? "," : "") << group.children[i];
+    os << "],\"groups\":[";
+    for(size_t i = 0; i < group.subgroups.size(); i ++)
+    {
+        os << (i ? "," : "");
+        group_json(os, info, group.subgroups[i]);
+    }
+    os << "]}";
+}
+
+static std::string inspect(const std::string& path)
+{
+    std::ostringstream os;
+    os << "{\"file\":" << json_string(path);
+    std::ifstream f(path, std::ios::binary);
+    if (!f)
+        return os.str() + ",\"error\":\"cannot open file\"}";
+    f.seekg(0, std::ios::end);
+    os << ",\"size\":" << (int64_t)f.tellg();
+    f.seekg(0);
+    char head[6];
+    if (f.read(head, 6) && std::string(head, 4) == "8BPS" && head[4] == 0 && head[5] == 2)
+        return os.str() + ",\"error\":\"large document format (psb) is not supported\"}";
+    f.clear();
+    f.seekg(0);
+
+    psd::psd doc;
+    psd::psd::LoadOptions options;
+    options.layer_images = false;
+    options.merged_image = false;
+    options.block_data = false;
+    if (!doc.load(f, options))
+        return os.str() + ",\"error\":\"cannot parse file\"}";
+
+    auto& h = doc.header;
+    os << ",\"header\":{\"signature\":" << key_string(h.signature)
+       << ",\"version\":" << h.version
+       << ",\"channels\":" << h.num_channels
+       << ",\"width\":" << h.width
+       << ",\"height\":" << h.height
+       << ",\"depth\":" << h.bit_depth
+       << ",\"color_mode\":" << h.color_mode << "}";
+
+    os << ",\"resources\":[";
+    for(size_t i = 0; i < doc.image_resources.size(); i ++)
+    {
+        auto& r = doc.image_resources[i];
+        os << (i ? "," : "") << "{\"id\":" << r.image_resource_id
+           << ",\"name\":" << json_string(r.name)
+           << ",\"size\":" << r.buffer.size() << "}";
+    }
+    os << "]";
+
+    os << ",\"layers\":[";
+    auto& layers = doc.layers();
+    for(size_t i = 0; i < layers.size(); i ++)
+    {
+        auto& l = layers[i];
+        uint32_t blend = l.blend_key;
+        char blend_key[4] = {(char)(blend >> 24), (char)(blend >> 16), (char)(blend >> 8), (char)blend};
+        os << (i ? "," : "") << "{\"index\":" << i
+           << ",\"name\":" << json_string(l.utf8name)
+           << ",\"bounds\":" << rect_json(l.bounds())
+           << ",\"blend\":" << json_string(std::string(blend_key, 4))
+           << ",\"opacity\":" << (int)l.opacity
+           << ",\"clipping\":" << (int)l.clipping
+           << ",\"flags\":" << (int)l.bit_flags
+           << ",\"section\":" << l.section_type;
+        if (l.has_layer_id)
+            os << ",\"id\":" << l.layer_id;
+        if (l.mask.length >= 4*4+2)
+            os << ",\"mask\":{\"bounds\":" << rect_json(psd::Rect(l.mask.top, l.mask.left, l.mask.bottom, l.mask.right))
+               << ",\"default_color\":" << (int)l.mask.default_color
+               << ",\"flags\":" << (int)l.mask.flags << "}";
+        os << ",\"extra\":[";
+        for(size_t j = 0; j < l.additional_extra_data.size(); j ++)
+        {
+            auto& ed = l.additional_extra_data[j];
+            os << (j ? "," : "") << "{\"key\":" << key_string(ed.key) << ",\"size\":" << ed.length << "}";
+        }
+        os << "],\"channels\":[";
+        for(size_t j = 0; j < l.channel_infos.size(); j ++)
+        {
+            auto& ci = l.channel_infos[j];
+            psd::Rect r;
+            l.channel_bounds(ci.first, r.top, r.left, r.bottom, r.right);
+            os << (j ? "," : "") << "{\"id\":" << ci.first
+               << ",\"bounds\":" << rect_json(r)
+               << ",\"compression\":" << compression_method(f, l.channel_pos(j))
+               << ",\"size\":" << ci.second << "}";
+        }
+        os << "]}";
+    }
+    os << "]";
+
+    if (!doc.layer_info.groups.empty())
+    {
+        os << ",\"tree\":";
+        group_json(os, doc.layer_info, 0);
+    }
+
+    os << ",\"global_mask_size\":" << doc.global_layer_mask_info.length;
+    os << ",\"additional_layer_data\":[";
+    auto blocks = doc.additional_layer_block_sizes();
+    for(size_t i = 0; i < blocks.size(); i ++)
+        os << (i ? "," : "") << "{\"key\":" << key_string(blocks[i].first) << ",\"size\":" << blocks[i].second << "}";
+    os << "]";
+    os << ",\"merged_image\":{\"compression\":" << doc.merged_image.compression_method << "}";
+    os << "}";
+    return os.str();
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> files;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    for(int i = 1; i < argc; i ++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc)
+            threads = std::max(1, atoi(argv[++i]));
+        else
+            files.push_back(arg);
+    }
+    if (files.empty())
+    {
+        std::cout << argv[0] << " [-j threads] [psd file]..." << std::endl;
+        std::cout << std::endl;
+        std::cout << "\tPrints header, resources, layers, channels and the layer tree as JSON" << std::endl;
+        std::cout << "\t(.psd only; .psb files are reported as errors)" << std::endl;
+        std::cout << std::endl;
+        return -1;
+    }
+
+    // the library reports parse details on stdout; keep stdout for the JSON
+    NullBuffer discard;
+    auto saved = std::cout.rdbuf(&discard);
+    std::vector<std::string> results(files.size());
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for(unsigned t = 0; t < std::min<size_t>(threads, files.size()); t ++)
+    {
+        workers.emplace_back([&]
+        {
+            for(size_t i = next++; i < files.size(); i = next++)
+                results[i] = inspect(files[i]);
+        });
+    }
+    for(auto& w:workers)
+        w.join();
+    std::cout.rdbuf(saved);
+
+    bool failed = false;
+    if (files.size() > 1)
+        std::cout << "[" << std::endl;
+    for(size_t i = 0; i < results.size(); i ++)
+    {
+        failed |= results[i].find(",\"error\":") != std::string::npos;
+        std::cout << results[i] << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    if (files.size() > 1)
+        std::cout << "]" << std::endl;
+    return failed ? 1 : 0;
+}
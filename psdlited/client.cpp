@@ -0,0 +1,137 @@
+#include "client.h"
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace psdlited
+{
+    static bool write_all(int fd, const void* data, size_t size)
+    {
+        const char* p = (const char*)data;
+        while(size)
+        {
+            ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static bool read_all(int fd, void* data, size_t size)
+    {
+        char* p = (char*)data;
+        while(size)
+        {
+            ssize_t n = ::recv(fd, p, size, 0);
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    Client::Client()
+        : fd_(-1), status_(StatusOk)
+    {
+    }
+
+    Client::~Client()
+    {
+        close();
+    }
+
+    bool Client::connect(const std::string& socket_path)
+    {
+        close();
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(addr.sun_path))
+            return false;
+        std::memcpy(addr.sun_path, socket_path.data(), socket_path.size());
+        fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd_ < 0)
+            return false;
+        if (::connect(fd_, (sockaddr*)&addr, sizeof(addr)) != 0)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void Client::close()
+    {
+        if (fd_ >= 0)
+            ::close(fd_);
+        fd_ = -1;
+    }
+
+    bool Client::call(Op op, const std::string& args, const std::string& path, std::string& payload)
+    {
+        if (fd_ < 0)
+            return false;
+        RequestHeader request;
+        std::memset(&request, 0, sizeof(request));
+        request.size = sizeof(request) - 4 + args.size() + path.size();
+        request.op = op;
+        ResponseHeader response;
+        if (!write_all(fd_, &request, sizeof(request)) ||
+            !write_all(fd_, args.data(), args.size()) ||
+            !write_all(fd_, path.data(), path.size()) ||
+            !read_all(fd_, &response, sizeof(response)) ||
+            response.size < 4 || response.size > max_frame_size)
+        {
+            close();
+            return false;
+        }
+        payload.resize(response.size - 4);
+        if (!read_all(fd_, &payload[0], payload.size()))
+        {
+            close();
+            return false;
+        }
+        status_ = (Status)response.status;
+        return status_ == StatusOk;
+    }
+
+    bool Client::call_image(Op op, const std::string& args, const std::string& path, psd::Image& image)
+    {
+        std::string payload;
+        if (!call(op, args, path, payload))
+            return false;
+        uint32_t size[2];
+        if (payload.size() < sizeof(size))
+            return false;
+        std::memcpy(size, payload.data(), sizeof(size));
+        if (payload.size() != sizeof(size) + (uint64_t)size[0]*size[1]*4)
+            return false;
+        image.resize(size[0], size[1]);
+        std::memcpy(image.pixels.data(), payload.data() + sizeof(size), image.pixels.size());
+        return true;
+    }
+
+    bool Client::metadata(const std::string& path, std::string& json)
+    {
+        return call(OpMetadata, std::string(), path, json);
+    }
+
+    bool Client::layers(const std::string& path, std::string& json)
+    {
+        return call(OpLayers, std::string(), path, json);
+    }
+
+    bool Client::thumbnail(const std::string& path, uint32_t max_size, psd::Image& image)
+    {
+        return call_image(OpThumbnail, std::string((char*)&max_size, 4), path, image);
+    }
+
+    bool Client::region(const std::string& path, const psd::Rect& rect, psd::Image& image)
+    {
+        int32_t r[4] = {rect.top, rect.left, rect.bottom, rect.right};
+        return call_image(OpRegion, std::string((char*)r, sizeof(r)), path, image);
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "../composite.h"
+#include "protocol.h"
+
+namespace psdlited
+{
+    // Blocking client for psdlited; one request at a time per connection.
+    class Client
+    {
+    public:
+        Client();
+        ~Client();
+        Client(const Client&) = delete;
+        Client& operator = (const Client&) = delete;
+
+        bool connect(const std::string& socket_path = default_socket_path());
+        void close();
+        bool connected() const { return fd_ >= 0; }
+
+        bool metadata(const std::string& path, std::string& json);
+        bool layers(const std::string& path, std::string& json);
+        // merged image scaled to fit max_size x max_size
+        bool thumbnail(const std::string& path, uint32_t max_size, psd::Image& image);
+        // full resolution composite, clipped to the document
+        bool region(const std::string& path, const psd::Rect& rect, psd::Image& image);
+
+        Status last_status() const { return status_; }
+
+    private:
+        bool call(Op op, const std::string& args, const std::string& path, std::string& payload);
+        bool call_image(Op op, const std::string& args, const std::string& path, psd::Image& image);
+
+        int fd_;
+        Status status_;
+    };
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+
+// Wire format between psdlited and its clients. Both ends run on the same
+// machine, so integers are in native byte order.
+//
+// request:  uint32 size of the rest, uint8 op, 3 reserved bytes, then
+//           op arguments and the file path (to the end of the frame)
+// response: uint32 size of the rest, int32 status, then the payload
+namespace psdlited
+{
+    enum Op : uint8_t
+    {
+        OpMetadata = 1, // path -> JSON
+        OpLayers = 2, // path -> JSON
+        OpThumbnail = 3, // uint32 max_size, path -> image
+        OpRegion = 4, // int32 top, left, bottom, right, path -> image
+    };
+
+    enum Status : int32_t
+    {
+        StatusOk = 0,
+        StatusBadRequest = 1,
+        StatusNotFound = 2,
+        StatusLoadFailed = 3,
+        StatusUnsupported = 4,
+    };
+
+    struct RequestHeader
+    {
+        uint32_t size;
+        uint8_t op;
+        uint8_t reserved[3];
+    };
+
+    struct ResponseHeader
+    {
+        uint32_t size;
+        int32_t status;
+    };
+
+    // image payloads: uint32 w, uint32 h, then w*h RGBA
+
+    enum { max_frame_size = 1 << 30 };
+
+    // whether a response carrying a w x h image fits in one frame
+    inline bool image_fits(uint64_t w, uint64_t h)
+    {
+        return 4 + 8 + w*h*4 <= max_frame_size;
+    }
+
+    // $XDG_RUNTIME_DIR/psdlited.sock, else one per user in /tmp
+    inline std::string default_socket_path()
+    {
+        const char* dir = getenv("XDG_RUNTIME_DIR");
+        if (dir && *dir)
+            return std::string(dir) + "/psdlited.sock";
+        return "/tmp/psdlited-" + std::to_string(getuid()) + ".sock";
+    }
+}
@@ -0,0 +1,734 @@
+// psdlited: serves metadata, layer lists, thumbnails and composite regions
+// of .psd files over a Unix socket, keeping recently used documents, their
+// thumbnails and decoded composite tiles in memory so repeated requests
+// skip parsing and rendering.
+
+#include "../cache.h"
+#include "protocol.h"
+#include <algorithm>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+using namespace psdlited;
+
+namespace
+{
+    enum { tile_size = 256 };
+
+    struct Document
+    {
+        Document()
+            : file_id(0), tile_clock(0), bytes(0)
+        {}
+        std::mutex lock;
+        uint64_t file_id; // DiskCache::Key::file_id of the loaded file
+        std::unique_ptr<psd::psd> doc; // loaded without layer images
+        std::string metadata;
+        std::string layers;
+        std::map<uint32_t, psd::Image> thumbnails;
+        struct Tile
+        {
+            psd::Image image;
+            uint64_t used; // tile_clock when last read
+        };
+        std::map<uint64_t, Tile> tiles; // composite tiles, key row << 32 | column
+        uint64_t tile_clock;
+        uint64_t bytes;
+    };
+
+    // recently opened documents, least recently used evicted past max_bytes
+    class Documents
+    {
+    public:
+        explicit Documents(uint64_t max_bytes)
+            : max_bytes_(max_bytes), bytes_(0)
+        {}
+
+        std::shared_ptr<Document> get(const std::string& path)
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            auto it = index_.find(path);
+            if (it != index_.end())
+            {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                return it->second->second;
+            }
+            lru_.emplace_front(path, std::make_shared<Document>());
+            index_[path] = lru_.begin();
+            return lru_.front().second;
+        }
+
+        uint64_t max_bytes() const { return max_bytes_; }
+
+        void remove(const std::string& path)
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            auto it = index_.find(path);
+            if (it == index_.end())
+                return;
+            bytes_ -= it->second->second->bytes;
+            lru_.erase(it->second);
+            index_.erase(it);
+        }
+
+        // called with the document locked after its cached data changed
+        void resize(const std::string& path, Document& d, uint64_t bytes)
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            auto it = index_.find(path);
+            if (it == index_.end() || it->second->second.get() != &d)
+            {
+                // evicted or removed while the request ran; no longer counted
+                d.bytes = bytes;
+                return;
+            }
+            bytes_ = bytes_ - d.bytes + bytes;
+            d.bytes = bytes;
+            // in-flight requests keep evicted documents alive until they finish
+            while(bytes_ > max_bytes_ && lru_.size() > 1)
+            {
+                auto& victim = lru_.back();
+                if (victim.first == path)
+                    break;
+                bytes_ -= victim.second->bytes;
+                index_.erase(victim.first);
+                lru_.pop_back();
+            }
+        }
+
+    private:
+        typedef std::list<std::pair<std::string, std::shared_ptr<Document>>> List;
+        std::mutex lock_;
+        List lru_;
+        std::unordered_map<std::string, List::iterator> index_;
+        uint64_t max_bytes_;
+        uint64_t bytes_;
+    };
+
+    std::string json_string(const std::string& s)
+    {
+        std::string out = "\"";
+        for(unsigned char c:s)
+        {
+            if (c == '"' || c == '\\')
+                out += '\\', out += c;
+            else if (c < 0x20)
+            {
+                char buffer[8];
+                snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                out += buffer;
+            }
+            else
+                out += c;
+        }
+        return out + "\"";
+    }
+
+    std::string metadata_json(psd::psd& doc)
+    {
+        std::ostringstream os;
+        os << "{\"width\":" << doc.header.width
+           << ",\"height\":" << doc.header.height
+           << ",\"channels\":" << doc.header.num_channels
+           << ",\"depth\":" << doc.header.bit_depth
+           << ",\"color_mode\":" << doc.header.color_mode
+           << ",\"layers\":" << doc.layers().size();
+        if (auto res = doc.resolution_info())
+            os << ",\"resolution\":[" << res->h_res << "," << res->v_res << "]"
+               << ",\"resolution_unit\":\"" << (res->h_res_unit == 2 ? "cm" : "inch") << "\"";
+        os << ",\"icc_profile\":" << (doc.icc_profile().empty() ? "false" : "true") << "}";
+        return os.str();
+    }
+
+    std::string layers_json(psd::psd& doc)
+    {
+        std::ostringstream os;
+        os << "[";
+        auto& layers = doc.layers();
+        for(size_t i = 0; i < layers.size(); i ++)
+        {
+            auto& l = layers[i];
+            psd::Rect r = l.bounds();
+            uint32_t key = l.blend_key;
+            char blend[4] = {(char)(key >> 24), (char)(key >> 16), (char)(key >> 8), (char)key};
+            os << (i ? "," : "") << "{\"index\":" << i
+               << ",\"name\":" << json_string(l.utf8name)
+               << ",\"bounds\":[" << r.top << "," << r.left << "," << r.bottom << "," << r.right << "]"
+               << ",\"blend\":" << json_string(std::string(blend, 4))
+               << ",\"opacity\":" << (int)l.opacity
+               << ",\"visible\":" << ((l.bit_flags & psd::LayerTable::Hidden) ? "false" : "true")
+               << ",\"section\":" << l.section_type;
+            if (l.has_layer_id)
+                os << ",\"id\":" << l.layer_id;
+            os << "}";
+        }
+        os << "]";
+        return os.str();
+    }
+
+    // 8 bit RGB and grayscale merged images are served as stored
+    bool merged_usable(psd::psd& doc)
+    {
+        auto& m = doc.merged_image;
+        uint16_t mode = doc.header.color_mode;
+        return doc.header.bit_depth == 8 && ((mode == 3 && m.datas.size() >= 3) || (mode == 1 && m.datas.size() >= 1));
+    }
+
+    void copy_merged(psd::psd& doc, const psd::Rect& r, psd::Image& out)
+    {
+        auto& m = doc.merged_image;
+        bool rgb = doc.header.color_mode == 3;
+        size_t alpha = rgb ? 3 : 1;
+        out.resize(r.right - r.left, r.bottom - r.top);
+        for(uint32_t y = 0; y < out.h; y ++)
+        {
+            uint8_t* p = out.row(y);
+            for(int32_t x = r.left; x < r.right; x ++, p += 4)
+            {
+                int32_t sy = r.top + y;
+                p[0] = m.datas[0][sy][x];
+                p[1] = m.datas[rgb ? 1 : 0][sy][x];
+                p[2] = m.datas[rgb ? 2 : 0][sy][x];
+                p[3] = m.datas.size() > alpha ? (uint8_t)m.datas[alpha][sy][x] : 255;
+            }
+        }
+    }
+
+    // rectangles of the composite, from the stored merged image when it is
+    // usable, else from the layers composited by the library; layer images
+    // are loaded once for all of them and dropped afterwards
+    bool render_rects(psd::psd& doc, const std::string& path, const std::vector<psd::Rect>& rects, std::vector<psd::Image>& out)
+    {
+        out.assign(rects.size(), psd::Image());
+        if (merged_usable(doc))
+        {
+            for(size_t i = 0; i < rects.size(); i ++)
+                copy_merged(doc, rects[i], out[i]);
+            return true;
+        }
+        std::ifstream f(path, std::ios::binary);
+        if (!f || !doc.load_layer_images(f))
+            return false;
+        psd::Compositor compositor(doc);
+        // the rects share layers; tiled layers let each read only its part
+        compositor.set_tile_size(64);
+        bool ok = true;
+        for(size_t i = 0; i < rects.size() && ok; i ++)
+            ok = compositor.render(out[i], rects[i]);
+        // keep the resident document small
+        for(auto& l:doc.layers())
+            std::vector<psd::ImageData>().swap(l.channel_info_data);
+        return ok;
+    }
+
+    // w x h fitted into max_size, never enlarged; 0 keeps the size
+    void scaled_size(uint32_t w, uint32_t h, uint32_t max_size, uint32_t& out_w, uint32_t& out_h)
+    {
+        uint32_t longest = std::max(w, h);
+        out_w = w;
+        out_h = h;
+        if (longest <= max_size || max_size == 0)
+            return;
+        double scale = (double)longest / max_size;
+        out_w = std::max<uint32_t>(1, w / scale + 0.5);
+        out_h = std::max<uint32_t>(1, h / scale + 0.5);
+    }
+
+    // area average, weighted by alpha
+    void downscale(const psd::Image& src, uint32_t max_size, psd::Image& out)
+    {
+        uint32_t w, h;
+        scaled_size(src.w, src.h, max_size, w, h);
+        if (w == src.w && h == src.h)
+        {
+            out = src;
+            return;
+        }
+        out.resize(w, h);
+        for(uint32_t y = 0; y < out.h; y ++)
+        {
+            uint32_t y0 = (uint64_t)y * src.h / out.h, y1 = std::max(y0 + 1, (uint32_t)((uint64_t)(y + 1) * src.h / out.h));
+            for(uint32_t x = 0; x < out.w; x ++)
+            {
+                uint32_t x0 = (uint64_t)x * src.w / out.w, x1 = std::max(x0 + 1, (uint32_t)((uint64_t)(x + 1) * src.w / out.w));
+                uint64_t sum[4] = {0, 0, 0, 0};
+                for(uint32_t sy = y0; sy < y1; sy ++)
+                {
+                    const uint8_t* p = src.row(sy) + x0*4;
+                    for(uint32_t sx = x0; sx < x1; sx ++, p += 4)
+                    {
+                        sum[0] += p[0] * p[3];
+                        sum[1] += p[1] * p[3];
+                        sum[2] += p[2] * p[3];
+                        sum[3] += p[3];
+                    }
+                }
+                uint8_t* q = out.row(y) + x*4;
+                uint64_t n = (uint64_t)(x1 - x0) * (y1 - y0);
+                for(int c = 0; c < 3; c ++)
+                    q[c] = sum[3] ? (sum[c] + sum[3]/2) / sum[3] : 0;
+                q[3] = (sum[3] + n/2) / n;
+            }
+        }
+    }
+
+    uint64_t image_bytes(const psd::Image& image)
+    {
+        return image.pixels.size();
+    }
+
+    class Server
+    {
+    public:
+        Server(uint64_t max_bytes, const std::string& cache_dir)
+            : documents_(max_bytes)
+        {
+            if (!cache_dir.empty())
+                disk_.reset(new psd::DiskCache(cache_dir, 1ULL << 30));
+        }
+
+        // answers one request; false when the connection is closed or broken
+        bool serve_one(int fd)
+        {
+            RequestHeader header;
+            if (!read_all(fd, &header, sizeof(header)) ||
+                header.size < sizeof(header) - 4 || header.size > max_frame_size)
+                return false;
+            std::string request(header.size - (sizeof(header) - 4), '\0');
+            if (!read_all(fd, &request[0], request.size()))
+                return false;
+            std::string response;
+            Status status = handle(header.op, request, response);
+            ResponseHeader out;
+            out.size = 4 + response.size();
+            out.status = status;
+            return write_all(fd, &out, sizeof(out)) && write_all(fd, response.data(), response.size());
+        }
+
+    private:
+        static bool read_all(int fd, void* data, size_t size)
+        {
+            char* p = (char*)data;
+            while(size)
+            {
+                ssize_t n = ::recv(fd, p, size, 0);
+                if (n <= 0)
+                    return false;
+                p += n;
+                size -= n;
+            }
+            return true;
+        }
+
+        static bool write_all(int fd, const void* data, size_t size)
+        {
+            const char* p = (const char*)data;
+            while(size)
+            {
+                ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+                if (n <= 0)
+                    return false;
+                p += n;
+                size -= n;
+            }
+            return true;
+        }
+
+        static void append_image(const psd::Image& image, std::string& out)
+        {
+            uint32_t size[2] = {image.w, image.h};
+            out.append((char*)size, sizeof(size));
+            out.append((const char*)image.pixels.data(), image.pixels.size());
+        }
+
+        // the document, reloaded when the file changed since it was cached
+        Status open(const std::string& path, Document& d, psd::DiskCache::Key& key)
+        {
+            if (!psd::DiskCache::Key::from_file(path, std::string(), key))
+            {
+                documents_.remove(path);
+                return StatusNotFound;
+            }
+            if (d.doc && d.file_id == key.file_id)
+                return StatusOk;
+            std::ifstream f(path, std::ios::binary);
+            psd::psd::LoadOptions options;
+            options.layer_images = false;
+            std::unique_ptr<psd::psd> doc(new psd::psd());
+            if (!f || !doc->load(f, options))
+            {
+                d.doc.reset();
+                documents_.remove(path);
+                return StatusLoadFailed;
+            }
+            d.doc = std::move(doc);
+            d.file_id = key.file_id;
+            d.metadata = metadata_json(*d.doc);
+            d.layers = layers_json(*d.doc);
+            d.thumbnails.clear();
+            d.tiles.clear();
+            update_size(path, d);
+            return StatusOk;
+        }
+
+        void update_size(const std::string& path, Document& d)
+        {
+            uint64_t bytes = d.metadata.size() + d.layers.size();
+            for(auto& m:d.doc->merged_image.datas)
+                bytes += (uint64_t)m.size() * d.doc->merged_image.w;
+            for(auto& t:d.thumbnails)
+                bytes += image_bytes(t.second);
+            uint64_t tiles = 0;
+            for(auto& t:d.tiles)
+                tiles += image_bytes(t.second.image);
+            // other documents cannot make room for this one's tiles; drop
+            // its least recently read ones
+            if (bytes + tiles > documents_.max_bytes())
+            {
+                std::vector<std::pair<uint64_t, uint64_t>> order; // used, key
+                for(auto& t:d.tiles)
+                    order.push_back(std::make_pair(t.second.used, t.first));
+                std::sort(order.begin(), order.end());
+                for(auto& o:order)
+                {
+                    if (bytes + tiles <= documents_.max_bytes())
+                        break;
+                    auto it = d.tiles.find(o.second);
+                    tiles -= image_bytes(it->second.image);
+                    d.tiles.erase(it);
+                }
+            }
+            documents_.resize(path, d, bytes + tiles);
+        }
+
+        // rect of the composite, assembled from cached tiles; the missing
+        // tiles are rendered together first
+        Status region(const std::string& path, Document& d, const psd::Rect& requested, psd::Image& out)
+        {
+            psd::psd& doc = *d.doc;
+            psd::Rect rect = requested.intersected(psd::Rect(0, 0, doc.header.height, doc.header.width));
+            out = psd::Image();
+            if (rect.empty())
+                return StatusOk;
+            int32_t ty0 = rect.top/tile_size, ty1 = (rect.bottom - 1)/tile_size;
+            int32_t tx0 = rect.left/tile_size, tx1 = (rect.right - 1)/tile_size;
+            std::vector<uint64_t> keys;
+            std::vector<psd::Rect> missing;
+            for(int32_t ty = ty0; ty <= ty1; ty ++)
+                for(int32_t tx = tx0; tx <= tx1; tx ++)
+                {
+                    uint64_t key = (uint64_t)ty << 32 | (uint32_t)tx;
+                    if (d.tiles.count(key))
+                        continue;
+                    keys.push_back(key);
+                    missing.push_back(psd::Rect(ty*tile_size, tx*tile_size,
+                        std::min<int32_t>(doc.header.height, (ty + 1)*tile_size), std::min<int32_t>(doc.header.width, (tx + 1)*tile_size)));
+                }
+            if (!missing.empty())
+            {
+                std::vector<psd::Image> rendered;
+                if (!render_rects(doc, path, missing, rendered))
+                    return StatusUnsupported;
+                for(size_t i = 0; i < keys.size(); i ++)
+                    d.tiles[keys[i]].image = std::move(rendered[i]);
+            }
+
+            out.resize(rect.right - rect.left, rect.bottom - rect.top);
+            uint64_t now = ++d.tile_clock;
+            for(int32_t ty = ty0; ty <= ty1; ty ++)
+                for(int32_t tx = tx0; tx <= tx1; tx ++)
+                {
+                    Document::Tile& cached = d.tiles[(uint64_t)ty << 32 | (uint32_t)tx];
+                    cached.used = now;
+                    const psd::Image& tile = cached.image;
+                    psd::Rect t(ty*tile_size, tx*tile_size, ty*tile_size + tile.h, tx*tile_size + tile.w);
+                    psd::Rect part = t.intersected(rect);
+                    for(int32_t y = part.top; y < part.bottom; y ++)
+                        std::memcpy(out.row(y - rect.top) + (part.left - rect.left)*4,
+                            tile.row(y - t.top) + (part.left - t.left)*4, (part.right - part.left)*4);
+                }
+            // after assembling, so trimming cannot take tiles this request reads
+            if (!missing.empty())
+                update_size(path, d);
+            return StatusOk;
+        }
+
+        Status handle(uint8_t op, const std::string& request, std::string& response)
+        {
+            size_t args = op == OpThumbnail ? 4 : op == OpRegion ? 16 : 0;
+            if (request.size() <= args)
+                return StatusBadRequest;
+            std::string path = request.substr(args);
+            auto d = documents_.get(path);
+            std::lock_guard<std::mutex> guard(d->lock);
+            psd::DiskCache::Key key;
+            Status status = open(path, *d, key);
+            if (status != StatusOk)
+                return status;
+
+            switch(op)
+            {
+                case OpMetadata:
+                    response = d->metadata;
+                    return StatusOk;
+                case OpLayers:
+                    response = d->layers;
+                    return StatusOk;
+                case OpThumbnail:
+                    {
+                        uint32_t max_size, w, h;
+                        std::memcpy(&max_size, request.data(), 4);
+                        scaled_size(d->doc->header.width, d->doc->header.height, max_size, w, h);
+                        if (!image_fits(w, h))
+                            return StatusBadRequest;
+                        auto it = d->thumbnails.find(max_size);
+                        if (it != d->thumbnails.end())
+                        {
+                            append_image(it->second, response);
+                            return StatusOk;
+                        }
+                        psd::Image& thumb = d->thumbnails[max_size];
+                        key.operation = "thumbnail:" + std::to_string(max_size);
+                        if (!disk_ || !disk_->get(key, thumb))
+                        {
+                            // the full composite is only needed long enough to scale it
+                            std::vector<psd::Rect> full(1, psd::Rect(0, 0, d->doc->header.height, d->doc->header.width));
+                            std::vector<psd::Image> composite;
+                            if (!render_rects(*d->doc, path, full, composite))
+                            {
+                                d->thumbnails.erase(max_size);
+                                return StatusUnsupported;
+                            }
+                            downscale(composite[0], max_size, thumb);
+                            if (disk_)
+                                disk_->put(key, thumb);
+                        }
+                        update_size(path, *d);
+                        append_image(thumb, response);
+                        return StatusOk;
+                    }
+                case OpRegion:
+                    {
+                        int32_t r[4];
+                        std::memcpy(r, request.data(), sizeof(r));
+                        psd::Rect rect(r[0], r[1], r[2], r[3]);
+                        psd::Rect clipped = rect.intersected(psd::Rect(0, 0, d->doc->header.height, d->doc->header.width));
+                        if (!image_fits(clipped.right - clipped.left, clipped.bottom - clipped.top))
+                            return StatusBadRequest;
+                        psd::Image image;
+                        status = region(path, *d, rect, image);
+                        if (status == StatusOk)
+                            append_image(image, response);
+                        return status;
+                    }
+                default:
+                    return StatusBadRequest;
+            }
+        }
+
+        Documents documents_;
+        std::unique_ptr<psd::DiskCache> disk_;
+    };
+
+    // Idle connections wait in poll() on the accepting thread. A connection
+    // with a request ready goes to the workers for that one request and then
+    // comes back, so idle clients never hold a worker.
+    class Dispatcher
+    {
+    public:
+        explicit Dispatcher(int listener)
+            : listener_(listener)
+        {
+            if (::pipe2(wake_, O_CLOEXEC | O_NONBLOCK) != 0)
+                wake_[0] = wake_[1] = -1;
+        }
+
+        bool ok() const { return wake_[0] >= 0; }
+
+        // accepting thread; returns when the listener fails
+        void run()
+        {
+            std::vector<int> idle;
+            std::vector<pollfd> fds;
+            for(;;)
+            {
+                fds.clear();
+                fds.push_back(pollfd{listener_, POLLIN, 0});
+                fds.push_back(pollfd{wake_[0], POLLIN, 0});
+                for(int fd:idle)
+                    fds.push_back(pollfd{fd, POLLIN, 0});
+                if (::poll(fds.data(), fds.size(), -1) < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    return;
+                }
+                idle.clear();
+                for(size_t i = 2; i < fds.size(); i ++)
+                {
+                    if (fds[i].revents)
+                        push(fds[i].fd); // a request, or a hang up the worker will see
+                    else
+                        idle.push_back(fds[i].fd);
+                }
+                if (fds[1].revents)
+                {
+                    char buffer[64];
+                    while(::read(wake_[0], buffer, sizeof(buffer)) > 0)
+                        ;
+                    std::lock_guard<std::mutex> guard(lock_);
+                    idle.insert(idle.end(), answered_.begin(), answered_.end());
+                    answered_.clear();
+                }
+                if (fds[0].revents)
+                {
+                    int fd = ::accept4(listener_, nullptr, nullptr, SOCK_CLOEXEC);
+                    if (fd >= 0)
+                        idle.push_back(fd);
+                    else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+                        return;
+                }
+            }
+        }
+
+        // workers: a connection with a request waiting
+        int pop()
+        {
+            std::unique_lock<std::mutex> guard(lock_);
+            ready_.wait(guard, [this] { return !requests_.empty(); });
+            int fd = requests_.front();
+            requests_.pop_front();
+            return fd;
+        }
+
+        // workers: the request was answered, wait for the next one
+        void answered(int fd)
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock_);
+                answered_.push_back(fd);
+            }
+            char c = 0;
+            if (::write(wake_[1], &c, 1) < 0 && errno != EAGAIN)
+                std::cerr << "psdlited: cannot wake the dispatcher" << std::endl;
+        }
+
+    private:
+        void push(int fd)
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            requests_.push_back(fd);
+            ready_.notify_one();
+        }
+
+        int listener_;
+        int wake_[2];
+        std::mutex lock_;
+        std::condition_variable ready_;
+        std::deque<int> requests_;
+        std::vector<int> answered_;
+    };
+
+    std::string socket_path;
+
+    void on_signal(int)
+    {
+        unlink(socket_path.c_str());
+        _exit(0);
+    }
+
+    void usage(const char* name)
+    {
+        std::cout << name << " [-s socket] [-j threads] [-m cache MB] [-c thumbnail cache dir]" << std::endl;
+        std::cout << std::endl;
+        std::cout << "\tServes .psd metadata, layer lists, thumbnails and regions over a Unix socket" << std::endl;
+        std::cout << "\t(default socket: " << default_socket_path() << ")" << std::endl;
+        std::cout << std::endl;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    socket_path = default_socket_path();
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    uint64_t max_bytes = 512ULL << 20;
+    std::string cache_dir;
+    for(int i = 1; i < argc; i ++)
+    {
+        std::string arg = argv[i];
+        if (i + 1 < argc && arg == "-s")
+            socket_path = argv[++i];
+        else if (i + 1 < argc && arg == "-j")
+            threads = std::max(1, atoi(argv[++i]));
+        else if (i + 1 < argc && arg == "-m")
+            max_bytes = (uint64_t)atoll(argv[++i]) << 20;
+        else if (i + 1 < argc && arg == "-c")
+            cache_dir = argv[++i];
+        else
+        {
+            usage(argv[0]);
+            return arg == "-h" ? 0 : -1;
+        }
+    }
+
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "socket path too long: " << socket_path << std::endl;
+        return -1;
+    }
+    std::memcpy(addr.sun_path, socket_path.data(), socket_path.size());
+    int listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    unlink(socket_path.c_str());
+    mode_t mask = umask(0077);
+    if (listener < 0 || ::bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(listener, 64) != 0)
+    {
+        std::cerr << "cannot listen on " << socket_path << std::endl;
+        return -1;
+    }
+    umask(mask);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    Server server(max_bytes, cache_dir);
+    Dispatcher dispatcher(listener);
+    if (!dispatcher.ok())
+    {
+        std::cerr << "cannot create the dispatcher pipe" << std::endl;
+        return -1;
+    }
+    std::vector<std::thread> workers;
+    for(unsigned i = 0; i < threads; i ++)
+        workers.emplace_back([&]
+        {
+            for(;;)
+            {
+                int fd = dispatcher.pop();
+                if (server.serve_one(fd))
+                    dispatcher.answered(fd);
+                else
+                    ::close(fd);
+            }
+        });
+
+    dispatcher.run();
+    unlink(socket_path.c_str());
+    return -1;
+}
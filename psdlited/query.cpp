@@ -0,0 +1,74 @@
+#include "client.h"
+#include <chrono>
+#include <fstream>
+
+int main(int argc, char** argv)
+{
+    std::string output;
+    if (argc >= 3 && std::string(argv[1]) == "-o")
+    {
+        output = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc < 3)
+    {
+        std::cout << argv[0] << " [-o OUTPUT] metadata|layers|thumbnail SIZE|region TOP LEFT BOTTOM RIGHT [psd file]" << std::endl;
+        std::cout << std::endl;
+        std::cout << "\tQueries psdlited; thumbnails and regions are written as raw RGBA to OUTPUT" << std::endl;
+        std::cout << std::endl;
+        return -1;
+    }
+    psdlited::Client client;
+    if (!client.connect())
+    {
+        std::cerr << "cannot connect to " << psdlited::default_socket_path() << std::endl;
+        return -1;
+    }
+
+    std::string op = argv[1];
+    if ((op == "thumbnail" || op == "region") && output.empty())
+    {
+        std::cerr << op << " needs -o OUTPUT" << std::endl;
+        return -1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::string json;
+    psd::Image image;
+    bool ok;
+    if (op == "metadata")
+        ok = client.metadata(argv[2], json);
+    else if (op == "layers")
+        ok = client.layers(argv[2], json);
+    else if (op == "thumbnail" && argc >= 4)
+        ok = client.thumbnail(argv[3], atoi(argv[2]), image);
+    else if (op == "region" && argc >= 7)
+        ok = client.region(argv[6], psd::Rect(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5])), image);
+    else
+    {
+        std::cerr << "unknown request: " << op << std::endl;
+        return -1;
+    }
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    if (!ok)
+    {
+        std::cerr << "request failed, status " << client.last_status() << std::endl;
+        return -1;
+    }
+    if (!json.empty())
+        std::cout << json << std::endl;
+    else
+    {
+        std::ofstream out(output, std::ios::binary);
+        out.write((const char*)image.pixels.data(), image.pixels.size());
+        if (!out)
+        {
+            std::cerr << "cannot write " << output << std::endl;
+            return -1;
+        }
+        std::cout << image.w << "x" << image.h << " written to " << output << std::endl;
+    }
+    std::cerr << us << " us" << std::endl;
+    return 0;
+}
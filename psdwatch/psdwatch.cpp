@@ -0,0 +1,405 @@
+#define MINIZ_NO_STDIO
+#define MINIZ_NO_ARCHIVE_APIS
+#define MINIZ_NO_TIME
+#define MINIZ_NO_ZLIB_APIS
+
+// the bundled miniz is kept as released; -Wall only checks our code
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmisleading-indentation"
+extern "C" {
+#include "../example_psd2pnd/miniz.c"
+}
+#pragma GCC diagnostic pop
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../composite.h"
+#include "../diff.h"
+
+// psdwatch: exports the composite of each document as PNG tiles and every
+// pixel layer as a PNG, then re-exports on save. Successive revisions are
+// compared by the hashes of their layer records and stored channel bytes;
+// only changed layers are decoded (the rest keep the pixels decoded for the
+// previous revision), only tiles under a changed layer are rendered, and an
+// output file is rewritten only when its bytes differ.
+
+struct Watched
+{
+    std::string path;
+    std::string out_dir;
+    std::unique_ptr<psd::psd> doc; // last export, layer images decoded
+    psd::DocumentFingerprint fingerprint;
+};
+
+static void make_dir(const std::string& path)
+{
+    if (::mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+        std::cerr << "cannot create " << path << std::endl;
+}
+
+// returns true if the file was written
+static bool write_if_changed(const std::string& path, const void* data, size_t size)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (in)
+    {
+        std::string old((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (old.size() == size && std::memcmp(old.data(), data, size) == 0)
+            return false;
+    }
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        if (!out.write((const char*)data, size) || !out.flush())
+        {
+            std::cerr << "cannot write " << tmp << std::endl;
+            return false;
+        }
+    }
+    if (::rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        std::cerr << "cannot replace " << path << std::endl;
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool write_png(const std::string& path, const psd::Image& image)
+{
+    size_t png_size = 0;
+    void* png = tdefl_write_image_to_png_file_in_memory(image.pixels.data(), image.w, image.h, 4, &png_size);
+    if (png == nullptr)
+        return false;
+    bool written = write_if_changed(path, png, png_size);
+    free(png);
+    return written;
+}
+
+// the layer's own pixels, without opacity, mask or blending
+static bool layer_image(psd::psd& doc, psd::Layer& l, psd::Image& out)
+{
+    psd::Rect r = l.bounds();
+    if (r.empty() || doc.header.bit_depth != 8 || l.section_type != psd::Layer::SectionOther)
+        return false;
+    uint32_t w = r.right - r.left, h = r.bottom - r.top;
+    bool gray = doc.header.color_mode == (uint16_t)psd::ColorMode::Grayscale;
+    psd::ImageData* ch[4];
+    for(int c = 0; c < 4; c ++)
+    {
+        ch[c] = l.get_channel_info_by_id(c == 3 ? -1 : gray ? 0 : c);
+        if (ch[c] != nullptr && (ch[c]->data.size() != h || (h && ch[c]->data[0].size() < w)))
+            ch[c] = nullptr;
+        if (ch[c] == nullptr && c < 3)
+            return false;
+    }
+    out.resize(w, h);
+    for(uint32_t y = 0; y < h; y ++)
+    {
+        uint8_t* d = out.row(y);
+        for(uint32_t x = 0; x < w; x ++, d += 4)
+            for(int c = 0; c < 4; c ++)
+                d[c] = ch[c] ? (uint8_t)ch[c]->data[y][x] : 255;
+    }
+    return true;
+}
+
+static std::string layer_file(const Watched& w, const psd::Layer& l, size_t index)
+{
+    return w.out_dir + "/layers/" + (l.has_layer_id ? "id" + std::to_string(l.layer_id) : "index" + std::to_string(index)) + ".png";
+}
+
+static std::string tile_file(const Watched& w, uint32_t ty, uint32_t tx)
+{
+    return w.out_dir + "/tiles/" + std::to_string(ty) + "_" + std::to_string(tx) + ".png";
+}
+
+// folders and adjustments change the look of everything below them
+static bool affects_backdrop(psd::Layer& l)
+{
+    psd::Adjustment a;
+    return l.section_type != psd::Layer::SectionOther || a.read(l);
+}
+
+// light angle shared by layer effects (resource 1037)
+static int32_t global_angle(psd::psd& doc)
+{
+    psd::ImageResourceBlock* angle = doc.get_image_resource(1037);
+    if (angle == nullptr || angle->buffer.size() < 4)
+        return 120;
+    const uint8_t* p = (const uint8_t*)angle->buffer.data();
+    return (int32_t)((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]);
+}
+
+// pixels the layer's effects draw past its bounds
+static int32_t effect_reach(psd::psd& doc, psd::Layer& l)
+{
+    psd::LayerEffects effects;
+    if (!effects.read(l, global_angle(doc)) || effects.empty())
+        return 0;
+    return effects.reach();
+}
+
+static bool export_document(Watched& w, uint32_t tile)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::ifstream f(w.path, std::ios::binary);
+    std::unique_ptr<psd::psd> doc(new psd::psd);
+    psd::psd::LoadOptions options;
+    options.layer_images = false;
+    options.merged_image = false;
+    psd::DocumentFingerprint fingerprint;
+    if (!f || !doc->load(f, options) || !psd::fingerprint(f, *doc, fingerprint))
+    {
+        // usually caught in the middle of a save; the next event retries
+        std::cerr << w.path << ": cannot read" << std::endl;
+        return false;
+    }
+    auto& layers = doc->layers();
+    psd::Rect canvas(0, 0, doc->header.height, doc->header.width);
+
+    bool full = !w.doc;
+    std::vector<psd::Rect> dirty;
+    std::vector<bool> export_layer(layers.size(), full);
+    std::vector<std::string> stale;
+    if (!full)
+    {
+        psd::DocumentDiff d;
+        psd::diff(w.fingerprint, fingerprint, d);
+        if (d.header || d.global_data || global_angle(*w.doc) != global_angle(*doc))
+            full = true;
+        bool renumbered = false;
+        for(auto& c:d.layers)
+        {
+            // effects reach past the layer, by what they were or have become
+            std::vector<psd::Rect> changed(c.dirty);
+            int32_t reach = 0;
+            if (c.old_index >= 0)
+            {
+                psd::Layer& old = w.doc->layers()[c.old_index];
+                full = full || affects_backdrop(old);
+                reach = std::max(reach, effect_reach(*w.doc, old));
+                if (c.kinds & psd::LayerChange::Extra)
+                    changed.push_back(w.fingerprint.layers[c.old_index].bounds);
+                if (c.kinds & psd::LayerChange::Removed)
+                    stale.push_back(layer_file(w, old, c.old_index));
+            }
+            if (c.new_index >= 0)
+            {
+                full = full || affects_backdrop(layers[c.new_index]);
+                reach = std::max(reach, effect_reach(*doc, layers[c.new_index]));
+                if (c.kinds & psd::LayerChange::Extra)
+                    changed.push_back(fingerprint.layers[c.new_index].bounds);
+                if (c.kinds & (psd::LayerChange::Added | psd::LayerChange::Pixels))
+                    export_layer[c.new_index] = true;
+            }
+            for(auto& r:changed)
+                if (!r.empty())
+                    dirty.push_back(psd::Rect(r.top - reach, r.left - reach, r.bottom + reach, r.right + reach));
+            renumbered = renumbered || (c.kinds & (psd::LayerChange::Added | psd::LayerChange::Removed | psd::LayerChange::Moved));
+        }
+        // files of layers without lyid are named by position
+        for(size_t i = 0; renumbered && i < layers.size(); i ++)
+            if (!layers[i].has_layer_id)
+                export_layer[i] = true;
+        if (d.empty())
+            return true;
+    }
+
+    // decoded channels move over from any previous layer with the same stored bytes
+    std::unordered_multimap<uint64_t, int32_t> previous;
+    if (w.doc)
+        for(size_t i = 0; i < w.fingerprint.layers.size(); i ++)
+            if (w.doc->layers()[i].images_loaded())
+                previous.insert(std::make_pair(w.fingerprint.layers[i].pixels, (int32_t)i));
+    size_t decoded = 0;
+    for(size_t i = 0; i < layers.size(); i ++)
+    {
+        auto it = previous.find(fingerprint.layers[i].pixels);
+        if (it != previous.end())
+        {
+            layers[i].channel_info_data.swap(w.doc->layers()[it->second].channel_info_data);
+            previous.erase(it);
+            continue;
+        }
+        f.clear();
+        f.seekg(layers[i].images_pos);
+        if (!layers[i].read_images(f))
+        {
+            std::cerr << w.path << ": cannot read images of " << layers[i].utf8name << std::endl;
+            return false;
+        }
+        export_layer[i] = true;
+        decoded ++;
+    }
+
+    make_dir(w.out_dir);
+    make_dir(w.out_dir + "/tiles");
+    make_dir(w.out_dir + "/layers");
+
+    size_t rendered = 0, written = 0;
+    uint32_t rows = (canvas.bottom + tile - 1)/tile, cols = (canvas.right + tile - 1)/tile;
+    psd::Compositor compositor(*doc);
+    for(uint32_t ty = 0; ty < rows; ty ++)
+    {
+        for(uint32_t tx = 0; tx < cols; tx ++)
+        {
+            psd::Rect r = psd::Rect(ty*tile, tx*tile, (ty+1)*tile, (tx+1)*tile).intersected(canvas);
+            bool hit = full;
+            for(size_t k = 0; k < dirty.size() && !hit; k ++)
+                hit = dirty[k].intersects(r);
+            if (!hit)
+                continue;
+            psd::Image image;
+            if (!compositor.render(image, r))
+                return false;
+            rendered ++;
+            written += write_png(tile_file(w, ty, tx), image);
+        }
+    }
+    if (w.doc)
+    {
+        // tiles past the edge of a document that shrank
+        uint32_t old_rows = (w.doc->header.height + tile - 1)/tile, old_cols = (w.doc->header.width + tile - 1)/tile;
+        for(uint32_t ty = 0; ty < old_rows; ty ++)
+            for(uint32_t tx = 0; tx < old_cols; tx ++)
+                if (ty >= rows || tx >= cols)
+                    ::unlink(tile_file(w, ty, tx).c_str());
+    }
+
+    std::set<std::string> current;
+    for(size_t i = 0; i < layers.size(); i ++)
+    {
+        std::string path = layer_file(w, layers[i], i);
+        current.insert(path);
+        psd::Image image;
+        if (export_layer[i] && layer_image(*doc, layers[i], image))
+            written += write_png(path, image);
+    }
+    for(auto& path:stale)
+        if (!current.count(path))
+            ::unlink(path.c_str());
+
+    w.doc.swap(doc);
+    w.fingerprint = std::move(fingerprint);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << w.path << ": " << decoded << " layers decoded, " << rendered << " tiles rendered, "
+              << written << " files written, " << ms << " ms" << std::endl;
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    std::string out_dir = ".";
+    uint32_t tile = 256;
+    bool once = false;
+    int i = 1;
+    for(; i < argc && argv[i][0] == '-'; i ++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc)
+            out_dir = argv[++i];
+        else if (arg == "-t" && i + 1 < argc)
+            tile = std::max(16, atoi(argv[++i]));
+        else if (arg == "-1")
+            once = true;
+        else
+            break;
+    }
+    if (i >= argc)
+    {
+        std::cout << argv[0] << " [-o output dir] [-t tile size] [-1] [psd file]..." << std::endl;
+        std::cout << std::endl;
+        std::cout << "\tExports OUT/NAME/tiles/ROW_COL.png and OUT/NAME/layers/*.png, then re-exports" << std::endl;
+        std::cout << "\tthe changed parts whenever a file is saved; -1 exports once and exits" << std::endl;
+        std::cout << std::endl;
+        return -1;
+    }
+
+    // the library reports parse details on stdout
+    std::cout.setstate(std::ios::failbit);
+    std::vector<Watched> files;
+    for(; i < argc; i ++)
+    {
+        Watched w;
+        w.path = argv[i];
+        std::string name = w.path.substr(w.path.find_last_of('/') + 1);
+        w.out_dir = out_dir + "/" + name.substr(0, name.find_last_of('.'));
+        files.push_back(std::move(w));
+    }
+    make_dir(out_dir);
+    for(auto& w:files)
+        export_document(w, tile);
+    if (once)
+        return 0;
+
+    // editors often save through a temporary file and a rename, so the
+    // directories are watched rather than the files
+    int fd = ::inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
+    {
+        std::cerr << "inotify unavailable" << std::endl;
+        return 1;
+    }
+    std::unordered_map<int, std::vector<size_t>> watches;
+    for(size_t k = 0; k < files.size(); k ++)
+    {
+        auto slash = files[k].path.find_last_of('/');
+        std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : files[k].path.substr(0, slash);
+        int wd = ::inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0)
+        {
+            std::cerr << "cannot watch " << dir << std::endl;
+            return 1;
+        }
+        watches[wd].push_back(k);
+    }
+
+    std::vector<char> buffer(64 << 10);
+    for(;;)
+    {
+        // collect events until the directory has been quiet for a moment,
+        // so a save arriving as several writes is exported once
+        std::set<size_t> changed;
+        int timeout = -1;
+        for(;;)
+        {
+            pollfd p = {fd, POLLIN, 0};
+            int n = ::poll(&p, 1, timeout);
+            if (n < 0 && errno != EINTR)
+                return 1;
+            if (n <= 0)
+                break;
+            ssize_t size = ::read(fd, buffer.data(), buffer.size());
+            if (size <= 0)
+                break;
+            for(char* e = buffer.data(); e < buffer.data() + size; )
+            {
+                auto event = (const inotify_event*)e;
+                e += sizeof(inotify_event) + event->len;
+                auto it = watches.find(event->wd);
+                if (it == watches.end() || !event->len)
+                    continue;
+                for(auto k:it->second)
+                {
+                    auto& path = files[k].path;
+                    if (path.compare(path.find_last_of('/') + 1, std::string::npos, event->name) == 0)
+                        changed.insert(k);
+                }
+            }
+            timeout = changed.empty() ? -1 : 30;
+        }
+        for(auto k:changed)
+            export_document(files[k], tile);
+    }
+}
@@ -0,0 +1,464 @@
+#include "resize.h"
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <thread>
+
+namespace psd
+{
+    static double filter_radius(ResizeFilter filter)
+    {
+        switch(filter)
+        {
+            case ResizeFilter::Box: return 0.5;
+            case ResizeFilter::Bilinear: return 1;
+            case ResizeFilter::Bicubic: return 2;
+            case ResizeFilter::Lanczos3: return 3;
+        }
+        return 1;
+    }
+
+    static double filter_weight(ResizeFilter filter, double x)
+    {
+        x = std::fabs(x);
+        switch(filter)
+        {
+            case ResizeFilter::Box:
+                return x <= 0.5 ? 1 : 0;
+            case ResizeFilter::Bilinear:
+                return x < 1 ? 1 - x : 0;
+            case ResizeFilter::Bicubic:
+                if (x < 1)
+                    return (1.5*x - 2.5)*x*x + 1;
+                return x < 2 ? ((-0.5*x + 2.5)*x - 4)*x + 2 : 0;
+            case ResizeFilter::Lanczos3:
+                if (x < 1e-8)
+                    return 1;
+                return x < 3 ? 3*std::sin(M_PI*x)*std::sin(M_PI*x/3)/(M_PI*M_PI*x*x) : 0;
+        }
+        return 0;
+    }
+
+    // filter taps along one axis: output i reads count[i] source samples
+    // from first[i]; before and after hold the weight that fell outside the
+    // source, resolved by the edge handling of each channel
+    struct Weights
+    {
+        uint32_t src_n, dst_n;
+        std::vector<int32_t> first;
+        std::vector<uint32_t> count, offset;
+        std::vector<float> weights, before, after;
+
+        // source samples start at document position src0, outputs at dst0
+        void build(ResizeFilter filter, double scale, int32_t src0, uint32_t src, int32_t dst0, uint32_t dst)
+        {
+            src_n = src;
+            dst_n = dst;
+            double stretch = std::max(1.0, 1/scale); // the kernel widens when shrinking
+            double support = filter_radius(filter)*stretch;
+            std::vector<double> w;
+            for(uint32_t i = 0; i < dst; i ++)
+            {
+                double center = (dst0 + i + 0.5)/scale - src0 - 0.5;
+                int32_t j0 = (int32_t)std::floor(center - support), j1 = (int32_t)std::ceil(center + support);
+                w.assign(j1 - j0 + 1, 0);
+                double total = 0;
+                for(int32_t j = j0; j <= j1; j ++)
+                    total += w[j - j0] = filter_weight(filter, (j - center)/stretch);
+                if (total == 0)
+                {
+                    w[(int32_t)std::lround(center) - j0] = 1;
+                    total = 1;
+                }
+                int32_t lo = std::max(j0, 0), hi = std::min(j1, (int32_t)src - 1);
+                float b = 0, a = 0;
+                for(int32_t j = j0; j <= j1; j ++)
+                {
+                    if (j < lo)
+                        b += w[j - j0]/total;
+                    else if (j > hi)
+                        a += w[j - j0]/total;
+                }
+                first.push_back(lo);
+                count.push_back(std::max(0, hi - lo + 1));
+                offset.push_back(weights.size());
+                for(int32_t j = lo; j <= hi; j ++)
+                    weights.push_back(w[j - j0]/total);
+                before.push_back(b);
+                after.push_back(a);
+            }
+        }
+    };
+
+    // past its rectangle a channel repeats its edge or reads a constant
+    struct Edge
+    {
+        bool clamp;
+        float value;
+    };
+
+    // one channel; the result is kept aside until every job is done, as
+    // color jobs read the layer's source alpha
+    struct ResizeJob
+    {
+        const std::vector<std::vector<char>>* rows;
+        const std::vector<std::vector<char>>* alpha; // weights the color when set
+        const Weights* wx;
+        const Weights* wy;
+        uint32_t bytes; // per sample: 1, 2 (16 bit) or 4 (32 bit float)
+        Edge edge;
+        std::vector<std::vector<char>> out;
+    };
+
+    static inline float load_sample(const char* p, uint32_t bytes)
+    {
+        if (bytes == 1)
+            return (uint8_t)p[0];
+        if (bytes == 2)
+            return (uint8_t)p[0] << 8 | (uint8_t)p[1];
+        uint32_t u = (uint32_t)(uint8_t)p[0] << 24 | (uint32_t)(uint8_t)p[1] << 16 | (uint32_t)(uint8_t)p[2] << 8 | (uint8_t)p[3];
+        float f;
+        std::memcpy(&f, &u, 4);
+        return f;
+    }
+
+    static inline void store_sample(char* p, uint32_t bytes, float v)
+    {
+        if (bytes == 1)
+        {
+            p[0] = (char)(uint8_t)std::min(255.0f, std::max(0.0f, v + 0.5f));
+            return;
+        }
+        if (bytes == 2)
+        {
+            uint16_t u = (uint16_t)std::min(65535.0f, std::max(0.0f, v + 0.5f));
+            p[0] = (char)(u >> 8);
+            p[1] = (char)u;
+            return;
+        }
+        uint32_t u;
+        std::memcpy(&u, &v, 4);
+        for(int i = 0; i < 4; i ++)
+            p[i] = (char)(u >> (24 - 8*i));
+    }
+
+    static void filter_line(const Weights& w, const float* in, float* out, const Edge& edge)
+    {
+        for(uint32_t i = 0; i < w.dst_n; i ++)
+        {
+            const float* k = &w.weights[w.offset[i]];
+            const float* s = in + w.first[i];
+            float v = 0;
+            for(uint32_t t = 0; t < w.count[i]; t ++)
+                v += k[t]*s[t];
+            if (edge.clamp)
+                v += w.before[i]*in[0] + w.after[i]*in[w.src_n - 1];
+            else
+                v += (w.before[i] + w.after[i])*edge.value;
+            out[i] = v;
+        }
+    }
+
+    // output row y from the horizontally filtered rows, each tap a pass over
+    // a whole row so the loops run over contiguous floats and vectorize
+    static void filter_column(const Weights& w, const std::vector<float>& rows, uint32_t width, uint32_t y, const Edge& edge, std::vector<float>& out)
+    {
+        if (edge.clamp)
+        {
+            const float* top = &rows[0];
+            const float* bottom = &rows[(size_t)(w.src_n - 1)*width];
+            float b = w.before[y], a = w.after[y];
+            for(uint32_t x = 0; x < width; x ++)
+                out[x] = b*top[x] + a*bottom[x];
+        }
+        else
+            std::fill(out.begin(), out.end(), (w.before[y] + w.after[y])*edge.value);
+        const float* k = &w.weights[w.offset[y]];
+        for(uint32_t t = 0; t < w.count[y]; t ++)
+        {
+            const float* r = &rows[(size_t)(w.first[y] + t)*width];
+            float kt = k[t];
+            for(uint32_t x = 0; x < width; x ++)
+                out[x] += kt*r[x];
+        }
+    }
+
+    static void run_job(ResizeJob& job)
+    {
+        const Weights& wx = *job.wx;
+        const Weights& wy = *job.wy;
+        uint32_t sw = wx.src_n, sh = wy.src_n, dw = wx.dst_n, dh = wy.dst_n;
+        uint32_t bytes = job.bytes;
+        job.out.assign(dh, std::vector<char>((size_t)dw*bytes));
+        if (!sw || !sh || !dw || !dh)
+            return;
+
+        // color under alpha is filtered premultiplied, then divided by the
+        // filtered alpha; both are zero past the layer
+        bool weighted = job.alpha != nullptr;
+        float alpha_scale = bytes == 1 ? 1/255.0f : bytes == 2 ? 1/65535.0f : 1;
+        Edge zero = {false, 0};
+        const Edge& edge = weighted ? zero : job.edge;
+
+        std::vector<float> line(sw), alpha_line(weighted ? sw : 0);
+        std::vector<float> rows((size_t)sh*dw), alpha_rows(weighted ? (size_t)sh*dw : 0);
+        for(uint32_t y = 0; y < sh; y ++)
+        {
+            const char* src = (*job.rows)[y].data();
+            for(uint32_t x = 0; x < sw; x ++)
+                line[x] = load_sample(src + x*bytes, bytes);
+            if (weighted)
+            {
+                const char* a = (*job.alpha)[y].data();
+                for(uint32_t x = 0; x < sw; x ++)
+                {
+                    alpha_line[x] = load_sample(a + x*bytes, bytes)*alpha_scale;
+                    line[x] *= alpha_line[x];
+                }
+                filter_line(wx, alpha_line.data(), &alpha_rows[(size_t)y*dw], zero);
+            }
+            filter_line(wx, line.data(), &rows[(size_t)y*dw], edge);
+        }
+
+        std::vector<float> out(dw), alpha_out(weighted ? dw : 0);
+        for(uint32_t y = 0; y < dh; y ++)
+        {
+            filter_column(wy, rows, dw, y, edge, out);
+            if (weighted)
+            {
+                filter_column(wy, alpha_rows, dw, y, zero, alpha_out);
+                for(uint32_t x = 0; x < dw; x ++)
+                    out[x] = alpha_out[x] > 1e-6f ? out[x]/alpha_out[x] : 0;
+            }
+            char* d = job.out[y].data();
+            for(uint32_t x = 0; x < dw; x ++)
+                store_sample(d + x*bytes, bytes, out[x]);
+        }
+    }
+
+    static Rect scale_rect(const Rect& r, double sx, double sy)
+    {
+        if (r.empty()) // nothing to snap, only moved
+            return Rect((int32_t)std::floor(r.top*sy), (int32_t)std::floor(r.left*sx),
+                (int32_t)std::floor(r.bottom*sy), (int32_t)std::floor(r.right*sx));
+        Rect s((int32_t)std::floor(r.top*sy), (int32_t)std::floor(r.left*sx),
+            (int32_t)std::ceil(r.bottom*sy), (int32_t)std::ceil(r.right*sx));
+        s.bottom = std::max(s.bottom, s.top + 1);
+        s.right = std::max(s.right, s.left + 1);
+        return s;
+    }
+
+    // resource 1032: version, grid cycle, count, then per guide a location
+    // in 1/32 pixels and a direction byte (0 vertical, 1 horizontal)
+    static void scale_guides(psd& doc, double sx, double sy)
+    {
+        ImageResourceBlock* guides = doc.get_image_resource(1032);
+        if (guides == nullptr || guides->buffer.size() < 16)
+            return;
+        char* p = guides->buffer.data();
+        uint32_t count = *(be<uint32_t>*)(p+12);
+        count = std::min<size_t>(count, (guides->buffer.size() - 16)/5);
+        for(uint32_t i = 0; i < count; i ++)
+        {
+            char* g = p + 16 + i*5;
+            be<int32_t>& location = *(be<int32_t>*)g;
+            location = (int32_t)std::lround(location*(g[4] ? sy : sx));
+        }
+    }
+
+    static void reset_channel(ImageData& d, std::vector<std::vector<char>>& rows, uint32_t w, uint32_t h)
+    {
+        d.data.swap(rows);
+        d.w = w;
+        d.h = h;
+        d.hash = 0;
+        d.block_hashes.clear();
+        d.encoded.clear();
+        d.encoded_key = 0;
+        d.packed_sizes.clear();
+        d.row_keys.clear();
+        d.dirty_rows.clear();
+        d.version = ImageData::new_version();
+    }
+
+    bool resize(psd& doc, uint32_t width, uint32_t height, ResizeFilter filter, unsigned threads)
+    {
+        uint32_t doc_w = doc.header.width, doc_h = doc.header.height;
+        if (!width || !height || !doc_w || !doc_h)
+            return false;
+        double sx = (double)width/doc_w, sy = (double)height/doc_h;
+        auto& layers = doc.layers();
+        auto& merged = doc.merged_image;
+        uint32_t depth = doc.header.bit_depth;
+        if (!merged.datas.empty() && depth != 8 && depth != 16 && depth != 32)
+        {
+            std::cerr << "resize: unsupported bit depth " << depth << std::endl;
+            return false;
+        }
+
+        std::deque<Weights> tables;
+        auto axis = [&](int32_t s0, int32_t s1, int32_t d0, int32_t d1, double scale)
+        {
+            tables.emplace_back();
+            tables.back().build(filter, scale, s0, s1 - s0, d0, d1 - d0);
+            return &tables.back();
+        };
+
+        // one job per channel; layer rectangles are only rewritten at the end
+        std::vector<ResizeJob> jobs;
+        std::vector<std::pair<ImageData*, size_t>> targets;
+        std::vector<Rect> layer_rects, mask_rects, real_mask_rects;
+        for(auto& l:layers)
+        {
+            if (!l.images_loaded())
+            {
+                std::cerr << "resize: layer images not loaded: " << l.utf8name << std::endl;
+                return false;
+            }
+            Rect b = l.bounds(), nb = scale_rect(b, sx, sy);
+            layer_rects.push_back(nb);
+            const Weights* wx = axis(b.left, b.right, nb.left, nb.right, sx);
+            const Weights* wy = axis(b.top, b.bottom, nb.top, nb.bottom, sy);
+            Rect mask, real_mask;
+            int32_t t, lf, bt, r;
+            if (l.mask.length >= 4*4+2)
+            {
+                l.channel_bounds(-2, t, lf, bt, r);
+                mask = Rect(t, lf, bt, r);
+            }
+            if (l.mask.real_offset() >= 0)
+            {
+                l.channel_bounds(-3, t, lf, bt, r);
+                real_mask = Rect(t, lf, bt, r);
+            }
+            mask_rects.push_back(scale_rect(mask, sx, sy));
+            real_mask_rects.push_back(scale_rect(real_mask, sx, sy));
+
+            ImageData* alpha = l.get_channel_info_by_id(-1);
+            for(size_t s = 0; s < l.channel_infos.size(); s ++)
+            {
+                int16_t id = l.channel_infos[s].first;
+                ImageData& d = l.channel_info_data[s];
+                if (!d.has_pixels())
+                {
+                    std::cerr << "resize: layer has no decoded pixels: " << l.utf8name << std::endl;
+                    return false;
+                }
+                ResizeJob job;
+                job.rows = &d.data;
+                job.alpha = id >= 0 && alpha && alpha->has_pixels() && alpha->w == d.w && alpha->h == d.h ? &alpha->data : nullptr;
+                job.wx = wx;
+                job.wy = wy;
+                job.bytes = d.w && d.h ? std::max<uint32_t>(1, d.data[0].size()/d.w) : 1;
+                job.edge.clamp = id >= 0;
+                job.edge.value = 0;
+                l.channel_bounds(id, t, lf, bt, r);
+                Rect src(t, lf, bt, r);
+                if (src.top != b.top || src.left != b.left || src.bottom != b.bottom || src.right != b.right)
+                {
+                    // masks keep their own rectangles, snapped the same way
+                    Rect dst = scale_rect(src, sx, sy);
+                    job.wx = axis(src.left, src.right, dst.left, dst.right, sx);
+                    job.wy = axis(src.top, src.bottom, dst.top, dst.bottom, sy);
+                }
+                if (id == -2)
+                    job.edge.value = l.mask.default_color;
+                else if (id == -3 && l.mask.real_offset() >= 0)
+                    job.edge.value = (uint8_t)l.mask.additional_data[l.mask.real_offset() + 1];
+                if (job.wx->src_n != d.w || job.wy->src_n != d.h)
+                {
+                    std::cerr << "resize: channel " << id << " does not match its rectangle: " << l.utf8name << std::endl;
+                    return false;
+                }
+                jobs.push_back(std::move(job));
+                targets.push_back(std::make_pair(&d, jobs.size() - 1));
+            }
+        }
+        size_t merged_first = jobs.size();
+        if (!merged.datas.empty())
+        {
+            const Weights* wx = axis(0, doc_w, 0, width, sx);
+            const Weights* wy = axis(0, doc_h, 0, height, sy);
+            for(auto& rows:merged.datas)
+            {
+                ResizeJob job;
+                job.rows = &rows;
+                job.alpha = nullptr;
+                job.wx = wx;
+                job.wy = wy;
+                job.bytes = depth/8;
+                job.edge.clamp = true;
+                job.edge.value = 0;
+                jobs.push_back(std::move(job));
+            }
+        }
+
+        // largest channels first, so the last ones to finish are small
+        std::vector<size_t> order(jobs.size());
+        for(size_t i = 0; i < order.size(); i ++)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+        {
+            return (uint64_t)jobs[a].wx->src_n*jobs[a].wy->src_n > (uint64_t)jobs[b].wx->src_n*jobs[b].wy->src_n;
+        });
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        threads = std::max<size_t>(1, std::min<size_t>(threads, jobs.size()));
+        std::atomic<size_t> next(0);
+        auto work = [&]()
+        {
+            for(size_t i; (i = next++) < order.size();)
+                run_job(jobs[order[i]]);
+        };
+        std::vector<std::thread> pool;
+        for(unsigned i = 1; i < threads; i ++)
+            pool.emplace_back(work);
+        work();
+        for(auto& t:pool)
+            t.join();
+
+        for(auto& target:targets)
+        {
+            ResizeJob& job = jobs[target.second];
+            reset_channel(*target.first, job.out, job.wx->dst_n, job.wy->dst_n);
+        }
+        for(size_t i = 0; i < layers.size(); i ++)
+        {
+            Layer& l = layers[i];
+            const Rect& nb = layer_rects[i];
+            l.top = nb.top;
+            l.left = nb.left;
+            l.bottom = nb.bottom;
+            l.right = nb.right;
+            const Rect& m = mask_rects[i];
+            if (l.mask.length >= 4*4+2)
+            {
+                l.mask.top = m.top;
+                l.mask.left = m.left;
+                l.mask.bottom = m.bottom;
+                l.mask.right = m.right;
+            }
+            const Rect& rm = real_mask_rects[i];
+            if (l.mask.real_offset() >= 0)
+            {
+                char* p = &l.mask.additional_data[l.mask.real_offset() + 2];
+                *(be<int32_t>*)(p+0) = rm.top;
+                *(be<int32_t>*)(p+4) = rm.left;
+                *(be<int32_t>*)(p+8) = rm.bottom;
+                *(be<int32_t>*)(p+12) = rm.right;
+            }
+        }
+        for(size_t c = 0; c < merged.datas.size(); c ++)
+            merged.datas[c].swap(jobs[merged_first + c].out);
+        merged.w = width;
+        merged.h = height;
+        merged.encoded.clear();
+        merged.encoded_key = 0;
+        scale_guides(doc, sx, sy);
+        doc.header.width = width;
+        doc.header.height = height;
+        doc.layer_info.table.build(layers);
+        return true;
+    }
+}
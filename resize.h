@@ -0,0 +1,25 @@
+#pragma once
+
+#include "psd.h"
+
+namespace psd
+{
+    enum class ResizeFilter
+    {
+        Box,
+        Bilinear,
+        Bicubic, // Catmull-Rom
+        Lanczos3,
+    };
+
+    // Rescales the document to width x height: every layer channel, the
+    // layer and mask rectangles (scaled, then snapped outwards to whole
+    // pixels) and the merged image. Color under a layer's alpha is weighted
+    // by it, so transparent pixels do not bleed into the edges. Channels
+    // are resampled on threads (0 for one per core). Layer images must be
+    // loaded. Vector masks are stored relative to the document size and
+    // follow it, guides (resource 1032) are moved. Resolution, effect
+    // sizes, mask feather, text, slices (1050) and the thumbnail (1036)
+    // keep their values.
+    bool resize(psd& doc, uint32_t width, uint32_t height, ResizeFilter filter = ResizeFilter::Bicubic, unsigned threads = 0);
+}
@@ -0,0 +1,234 @@
+#include "tiles.h"
+#include <cstring>
+
+namespace psd
+{
+    TiledImage::TiledImage()
+        : tile_size_(64), shift_(6), sample_bytes_(1), tiles_x_(0), tiles_y_(0)
+    {
+    }
+
+    bool TiledImage::from_layer(Layer& layer, uint32_t tile_size)
+    {
+        std::vector<int16_t> ids;
+        for(auto& ci:layer.channel_infos)
+            if (ci.first >= 0)
+                ids.push_back(ci.first);
+        std::sort(ids.begin(), ids.end());
+        if (layer.get_channel_slot(-1) >= 0)
+            ids.push_back(-1);
+        return from_layer(layer, ids, tile_size);
+    }
+
+    bool TiledImage::from_layer(Layer& layer, const std::vector<int16_t>& ids, uint32_t tile_size)
+    {
+        if (tile_size < 8 || (tile_size & (tile_size - 1)) || ids.empty() || !layer.images_loaded())
+            return false;
+        int32_t t, l, b, r;
+        layer.channel_bounds(ids[0], t, l, b, r);
+        uint32_t w = std::max(0, r - l), h = std::max(0, b - t);
+        std::vector<ImageData*> channels;
+        for(auto id:ids)
+        {
+            int32_t t2, l2, b2, r2;
+            layer.channel_bounds(id, t2, l2, b2, r2);
+            ImageData* data = layer.get_channel_info_by_id(id);
+            if (data == nullptr || t2 != t || l2 != l || b2 != b || r2 != r || data->data.size() != h)
+                return false;
+            channels.push_back(data);
+        }
+        uint32_t sample_bytes = w && h ? channels[0]->data[0].size() / w : 1;
+        for(auto c:channels)
+            for(auto& row:c->data)
+                if (sample_bytes == 0 || row.size() < (size_t)w*sample_bytes)
+                    return false;
+
+        tile_size_ = tile_size;
+        for(shift_ = 0; (1u << shift_) < tile_size; shift_ ++)
+            ;
+        sample_bytes_ = sample_bytes;
+        bounds_ = Rect(t, l, b, r);
+        ids_ = ids;
+        tiles_x_ = (w + tile_size - 1) >> shift_;
+        tiles_y_ = (h + tile_size - 1) >> shift_;
+        size_t row_bytes = (size_t)tile_size*sample_bytes;
+
+        // a tile is stored unless its alpha is zero throughout
+        int32_t alpha = channel_index(-1);
+        blocks_.assign((size_t)tiles_x_*tiles_y_, alpha < 0 ? 0 : -1);
+        if (alpha >= 0)
+        {
+            for(uint32_t y = 0; y < h; y ++)
+            {
+                const char* row = channels[alpha]->data[y].data();
+                int32_t* blocks = &blocks_[(size_t)(y >> shift_)*tiles_x_];
+                for(uint32_t tx = 0; tx < tiles_x_; tx ++)
+                {
+                    if (blocks[tx] >= 0)
+                        continue;
+                    const char* p = row + tx*row_bytes;
+                    const char* end = row + std::min<size_t>((size_t)(tx + 1)*row_bytes, (size_t)w*sample_bytes);
+                    while(p < end && *p == 0)
+                        p ++;
+                    if (p < end)
+                        blocks[tx] = 0;
+                }
+            }
+        }
+        size_t count = 0;
+        for(auto& block:blocks_)
+            if (block >= 0)
+                block = count ++;
+        storage_.assign(count*block_size(), 0);
+
+        // source rows are read in order; each lands in tiles_x_ blocks
+        size_t plane_size = (size_t)tile_size*row_bytes;
+        for(size_t c = 0; c < channels.size(); c ++)
+        {
+            for(uint32_t y = 0; y < h; y ++)
+            {
+                const char* row = channels[c]->data[y].data();
+                const int32_t* blocks = &blocks_[(size_t)(y >> shift_)*tiles_x_];
+                size_t offset = c*plane_size + (size_t)(y & (tile_size - 1))*row_bytes;
+                for(uint32_t tx = 0; tx < tiles_x_; tx ++)
+                {
+                    if (blocks[tx] < 0)
+                        continue;
+                    size_t x0 = (size_t)tx*row_bytes;
+                    size_t n = std::min(row_bytes, (size_t)w*sample_bytes - x0);
+                    std::memcpy(&storage_[blocks[tx]*block_size() + offset], row + x0, n);
+                }
+            }
+        }
+        return true;
+    }
+
+    bool TiledImage::to_layer(Layer& layer) const
+    {
+        uint32_t w = bounds_.right - bounds_.left, h = bounds_.bottom - bounds_.top;
+        size_t row_bytes = (size_t)tile_size_*sample_bytes_;
+        size_t plane_size = (size_t)tile_size_*row_bytes;
+        std::vector<ImageData*> channels;
+        for(auto id:ids_)
+        {
+            int32_t t, l, b, r;
+            layer.channel_bounds(id, t, l, b, r);
+            ImageData* data = layer.get_channel_info_by_id(id);
+            if (data == nullptr || t != bounds_.top || l != bounds_.left || b != bounds_.bottom || r != bounds_.right || data->data.size() != h)
+                return false;
+            channels.push_back(data);
+        }
+        // rows under empty tiles keep their content; only rows whose stored
+        // tiles differ from them are written and marked dirty
+        for(size_t c = 0; c < channels.size(); c ++)
+        {
+            ImageData* data = channels[c];
+            uint32_t first = 0, last = 0; // pending dirty range
+            for(uint32_t y = 0; y < h; y ++)
+            {
+                auto& row = data->data[y];
+                row.resize(std::max(row.size(), (size_t)w*sample_bytes_));
+                const int32_t* blocks = &blocks_[(size_t)(y >> shift_)*tiles_x_];
+                size_t offset = c*plane_size + (size_t)(y & (tile_size_ - 1))*row_bytes;
+                bool changed = false;
+                for(uint32_t tx = 0; tx < tiles_x_; tx ++)
+                {
+                    if (blocks[tx] < 0)
+                        continue;
+                    size_t x0 = (size_t)tx*row_bytes;
+                    size_t n = std::min(row_bytes, (size_t)w*sample_bytes_ - x0);
+                    const uint8_t* src = &storage_[blocks[tx]*block_size() + offset];
+                    if (std::memcmp(&row[x0], src, n) == 0)
+                        continue;
+                    std::memcpy(&row[x0], src, n);
+                    changed = true;
+                }
+                if (!changed)
+                    continue;
+                if (y != last)
+                {
+                    if (first < last)
+                        data->mark_dirty(first, last);
+                    first = y;
+                }
+                last = y + 1;
+            }
+            if (first < last)
+                data->mark_dirty(first, last);
+        }
+        return true;
+    }
+
+    int32_t TiledImage::channel_index(int16_t id) const
+    {
+        for(size_t i = 0; i < ids_.size(); i ++)
+            if (ids_[i] == id)
+                return i;
+        return -1;
+    }
+
+    const uint8_t* TiledImage::tile(uint32_t tx, uint32_t ty) const
+    {
+        if (tx >= tiles_x_ || ty >= tiles_y_)
+            return nullptr;
+        int32_t block = blocks_[(size_t)ty*tiles_x_ + tx];
+        return block < 0 ? nullptr : &storage_[block*block_size()];
+    }
+
+    uint8_t* TiledImage::tile(uint32_t tx, uint32_t ty)
+    {
+        return const_cast<uint8_t*>(static_cast<const TiledImage*>(this)->tile(tx, ty));
+    }
+
+    const uint8_t* TiledImage::plane(uint32_t tx, uint32_t ty, size_t channel) const
+    {
+        const uint8_t* p = tile(tx, ty);
+        return p && channel < ids_.size() ? p + channel*tile_size_*tile_size_*sample_bytes_ : nullptr;
+    }
+
+    const uint8_t* TiledImage::pixel(int32_t x, int32_t y, size_t channel) const
+    {
+        if (x < bounds_.left || x >= bounds_.right || y < bounds_.top || y >= bounds_.bottom)
+            return nullptr;
+        x -= bounds_.left;
+        y -= bounds_.top;
+        const uint8_t* p = plane(x >> shift_, y >> shift_, channel);
+        uint32_t mask = tile_size_ - 1;
+        return p ? p + ((y & mask)*tile_size_ + (x & mask))*sample_bytes_ : nullptr;
+    }
+
+    void TiledImage::read(const Rect& region, size_t channel, uint8_t* out, size_t stride) const
+    {
+        if (region.empty() || channel >= ids_.size())
+            return;
+        Rect r = region.intersected(bounds_);
+        size_t width = (size_t)(region.right - region.left)*sample_bytes_;
+        uint32_t mask = tile_size_ - 1;
+        for(int32_t y = region.top; y < region.bottom; y ++)
+        {
+            uint8_t* d = out + (size_t)(y - region.top)*stride;
+            if (r.empty() || y < r.top || y >= r.bottom)
+            {
+                std::memset(d, 0, width);
+                continue;
+            }
+            size_t before = (size_t)(r.left - region.left)*sample_bytes_;
+            std::memset(d, 0, before);
+            d += before;
+            uint32_t sy = y - bounds_.top;
+            for(int32_t x = r.left; x < r.right; )
+            {
+                uint32_t sx = x - bounds_.left;
+                uint32_t n = std::min<uint32_t>(tile_size_ - (sx & mask), r.right - x);
+                const uint8_t* p = plane(sx >> shift_, sy >> shift_, channel);
+                if (p)
+                    std::memcpy(d, p + ((sy & mask)*tile_size_ + (sx & mask))*sample_bytes_, n*sample_bytes_);
+                else
+                    std::memset(d, 0, n*sample_bytes_);
+                d += n*sample_bytes_;
+                x += n;
+            }
+            std::memset(d, 0, (size_t)(region.right - r.right)*sample_bytes_);
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "psd.h"
+
+namespace psd
+{
+    // Channels of a layer kept in square tiles instead of full width rows, so
+    // 2D consumers (viewports, regions of interest, tiled renderers) read one
+    // contiguous block per tile rather than tile_size rows spread over the
+    // whole channel. A tile holds its channels one after another, each
+    // tile_size*tile_size samples, with edge tiles padded. Tiles whose alpha
+    // is zero throughout are not stored and read back as zeros.
+    class TiledImage
+    {
+    public:
+        TiledImage();
+
+        // the color channels and alpha of the layer; tile_size is a power of two
+        bool from_layer(Layer& layer, uint32_t tile_size = 64);
+        // channels of equal bounds, e.g. {-2} for a layer mask
+        bool from_layer(Layer& layer, const std::vector<int16_t>& ids, uint32_t tile_size = 64);
+        // writes the stored tiles back into the layer's rows, marking dirty
+        // only the rows that change; rows under empty tiles are left as they are
+        bool to_layer(Layer& layer) const;
+
+        uint32_t tile_size() const { return tile_size_; }
+        uint32_t sample_bytes() const { return sample_bytes_; }
+        Rect bounds() const { return bounds_; } // document coordinates
+        uint32_t tiles_x() const { return tiles_x_; }
+        uint32_t tiles_y() const { return tiles_y_; }
+        const std::vector<int16_t>& channel_ids() const { return ids_; }
+        int32_t channel_index(int16_t id) const;
+        size_t stored_tiles() const { return storage_.size() / block_size(); }
+        uint64_t bytes() const { return storage_.size(); }
+
+        // every channel of tile tx, ty; nullptr when the tile is empty
+        const uint8_t* tile(uint32_t tx, uint32_t ty) const;
+        uint8_t* tile(uint32_t tx, uint32_t ty);
+        // one channel of a tile, rows of tile_size*sample_bytes bytes
+        const uint8_t* plane(uint32_t tx, uint32_t ty, size_t channel) const;
+        // one sample in document coordinates; nullptr outside the bounds or in an empty tile
+        const uint8_t* pixel(int32_t x, int32_t y, size_t channel) const;
+        // one channel of region (document coordinates) into rows stride
+        // bytes apart, region.left, region.top at out; empty tiles and
+        // pixels outside the bounds give zeros
+        void read(const Rect& region, size_t channel, uint8_t* out, size_t stride) const;
+
+    private:
+        size_t block_size() const { return (size_t)tile_size_*tile_size_*sample_bytes_*ids_.size(); }
+
+        uint32_t tile_size_;
+        uint32_t shift_; // log2(tile_size_)
+        uint32_t sample_bytes_;
+        Rect bounds_;
+        uint32_t tiles_x_;
+        uint32_t tiles_y_;
+        std::vector<int16_t> ids_;
+        std::vector<int32_t> blocks_; // per tile, row major: block index into storage_, -1 if empty
+        std::vector<uint8_t> storage_;
+    };
+}